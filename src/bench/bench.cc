@@ -0,0 +1,337 @@
+// Replays frames through the preprocessing and inference code of VESPID
+// (resizeImageForDB, then the classifier selected by NN_ENGINE and
+// NN_WEIGHTS) and reports the throughput, the latency, the confusion matrix
+// and the confidence distribution.
+// Build with `make vespid-bench`, run as
+// `vespid-bench [-j report.json] [dataset | replay | category=replay ...]`
+// A dataset is a directory with the empty, asian and european
+// subdirectories (default: dataset), or a pack (see vespid-pack). Replays are videos or directories of
+// camera frames (as for CAMERA_REPLAY), they are cropped to CAMERA_ROI and
+// converted as set by CAMERA_FORMAT, CAMERA_WIDTH and CAMERA_HEIGHT before
+// the measurement. With category=replay, all the frames show the category.
+// The JSON report makes the results of two builds easy to compare.
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cxcore.hpp>
+
+#include "classifier.hh"
+#include "dataset.hh"
+#include "image.hh"
+#include "pack.hh"
+#include "source.hh"
+#include "util.hh"
+
+// Classifications before the measurement
+#define BENCH_WARMUP 10
+// Confidence histogram bins, over [0, 1]
+#define BENCH_CONFIDENCE_BINS 10
+
+namespace Bench {
+	// A dataset, or a replay whose frames show the category (-1 if it is
+	// not labelled)
+	struct Input {
+		std::string path;
+		int category;
+		bool dataset;
+	};
+
+	struct Report {
+		std::string engine;
+		unsigned long frames = 0;
+		// Per frame, in microseconds
+		std::vector<uint64_t> resize_us;
+		std::vector<uint64_t> inference_us;
+		std::vector<uint64_t> total_us;
+		// Labelled frames only: confusion[truth][prediction]
+		unsigned long confusion[DATASET_CATEGORIES][DATASET_CATEGORIES] = {{0}};
+		// Confidence in the prediction
+		unsigned long confidence_correct[BENCH_CONFIDENCE_BINS] = {0};
+		unsigned long confidence_wrong[BENCH_CONFIDENCE_BINS] = {0};
+		unsigned long confidence_unlabelled[BENCH_CONFIDENCE_BINS] = {0};
+		Dataset::Accuracy accuracy;
+	};
+
+	class Pipeline {
+	public:
+		Pipeline(Report &report) : m_report(report), m_classifier(Image::createClassifier()) {}
+
+		// Measures a frame as delivered by the camera thread, category
+		// is -1 if it is unknown
+		void run(const cv::Mat &frame, Camera::frameFormat format, int category) {
+			for ( ; m_warmup < BENCH_WARMUP ; ++m_warmup) {
+				Image::resizeImageForDB(frame, m_resized, format);
+				m_classifier->classify(m_resized);
+			}
+
+			uint64_t start = Time::getMicros();
+			Image::resizeImageForDB(frame, m_resized, format);
+			uint64_t resized = Time::getMicros();
+			Image::nnResult result = m_classifier->classify(m_resized);
+			uint64_t end = Time::getMicros();
+
+			m_report.frames++;
+			m_report.resize_us.push_back(resized - start);
+			m_report.inference_us.push_back(end - resized);
+			m_report.total_us.push_back(end - start);
+
+			int prediction = Dataset::getPrediction(result);
+			double confidence = Dataset::getProb(result, prediction);
+			int bin = std::min((int) (confidence * BENCH_CONFIDENCE_BINS), BENCH_CONFIDENCE_BINS - 1);
+			if (category < 0) {
+				m_report.confidence_unlabelled[bin]++;
+				return;
+			}
+
+			m_report.confusion[category][prediction]++;
+			m_report.accuracy.add(category, prediction, confidence);
+			if (prediction == category)
+				m_report.confidence_correct[bin]++;
+			else
+				m_report.confidence_wrong[bin]++;
+		}
+
+	private:
+		Report &m_report;
+		std::unique_ptr<Image::Classifier> m_classifier;
+		cv::Mat m_resized;
+		int m_warmup = 0;
+	};
+
+	void runDataset(Pipeline &pipeline, const std::string &dir) {
+		if (Pack::isPack(dir)) {
+			Pack::Reader reader(dir);
+			if (reader.size() == 0)
+				throw Dataset::DatasetException("no image in " + dir);
+			for (size_t i = 0 ; i < reader.size() ; ++i)
+				pipeline.run(reader.getImage(i), Camera::FRAME_BGR, reader.getCategory(i));
+			return;
+		}
+
+		std::vector<Dataset::Sample> samples = Dataset::list(dir);
+		if (samples.empty())
+			throw Dataset::DatasetException("no image in " + dir);
+		for (auto it = samples.begin() ; it != samples.end() ; ++it)
+			pipeline.run(Dataset::load(*it), Camera::FRAME_BGR, it->category);
+	}
+
+	void runReplay(Pipeline &pipeline, const Input &input) {
+		Camera::frameFormat format;
+		int width, height;
+		Camera::getConfFormat(format, width, height);
+		cv::Rect roi = Camera::getConfROI();
+
+		Camera::ReplaySource source(input.path, 0, false, format, width, height);
+		source.open();
+		cv::Mat frame, cropped;
+		while (source.grab()) {
+			source.retrieve(frame);
+			if (roi.area() > 0) {
+				Camera::cropFrame(frame, format, roi, cropped);
+				pipeline.run(cropped, format, input.category);
+			} else {
+				pipeline.run(frame, format, input.category);
+			}
+		}
+		source.close();
+	}
+
+	double getMean(const std::vector<uint64_t> &values) {
+		double sum = 0;
+		for (auto it = values.begin() ; it != values.end() ; ++it)
+			sum += *it;
+		return values.empty() ? 0 : sum / values.size();
+	}
+
+	// values must be sorted
+	uint64_t getPercentile(const std::vector<uint64_t> &values, double p) {
+		if (values.empty())
+			return 0;
+		return values[std::min((size_t) (p * values.size()), values.size() - 1)];
+	}
+
+	double getFPS(const Report &report) {
+		double mean = getMean(report.total_us);
+		return (mean > 0) ? 1000000.0 / mean : 0;
+	}
+
+	const double percentiles[] = {0.5, 0.9, 0.95, 0.99};
+	const char *percentile_names[] = {"p50", "p90", "p95", "p99"};
+
+	void printLatency(const char *name, const std::vector<uint64_t> &values) {
+		std::cout << std::left << std::setw(12) << name << std::right << std::setprecision(1)
+			<< std::setw(9) << getMean(values);
+		for (int i = 0 ; i < 4 ; ++i)
+			std::cout << std::setw(8) << getPercentile(values, percentiles[i]);
+		std::cout << std::setw(8) << (values.empty() ? 0 : values.back()) << std::endl;
+	}
+
+	void print(const Report &report) {
+		std::cout << std::fixed << report.frames << " frames, engine " << report.engine << ": "
+			<< std::setprecision(1) << getFPS(report) << " frames/s on a single thread" << std::endl;
+
+		std::cout << "\n-- Latency (us) --" << std::endl;
+		std::cout << std::left << std::setw(12) << "stage" << std::right << std::setw(9) << "mean";
+		for (int i = 0 ; i < 4 ; ++i)
+			std::cout << std::setw(8) << percentile_names[i];
+		std::cout << std::setw(8) << "max" << std::endl;
+		printLatency("resize", report.resize_us);
+		printLatency("inference", report.inference_us);
+		printLatency("total", report.total_us);
+
+		unsigned long labelled = 0;
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i)
+			labelled += report.accuracy.total[i];
+		if (labelled > 0) {
+			std::cout << "\n-- Results --" << std::endl;
+			report.accuracy.print(std::cout);
+
+			std::cout << "\n-- Confusion matrix (rows: truth, columns: prediction) --" << std::endl;
+			std::cout << std::setw(10) << "";
+			for (int j = 0 ; j < DATASET_CATEGORIES ; ++j)
+				std::cout << std::setw(10) << Dataset::getCategoryName(j);
+			std::cout << std::endl;
+			for (int i = 0 ; i < DATASET_CATEGORIES ; ++i) {
+				std::cout << std::left << std::setw(10) << Dataset::getCategoryName(i) << std::right;
+				for (int j = 0 ; j < DATASET_CATEGORIES ; ++j)
+					std::cout << std::setw(10) << report.confusion[i][j];
+				std::cout << std::endl;
+			}
+		}
+
+		std::cout << "\n-- Confidence in the prediction --" << std::endl;
+		std::cout << std::left << std::setw(12) << "confidence" << std::right << std::setw(10) << "correct"
+			<< std::setw(10) << "wrong" << std::setw(12) << "unlabelled" << std::endl;
+		for (int i = 0 ; i < BENCH_CONFIDENCE_BINS ; ++i) {
+			if (report.confidence_correct[i] + report.confidence_wrong[i] + report.confidence_unlabelled[i] == 0)
+				continue;
+			std::ostringstream range;
+			range << std::setprecision(1) << std::fixed << (double) i / BENCH_CONFIDENCE_BINS << "-"
+				<< (double) (i + 1) / BENCH_CONFIDENCE_BINS;
+			std::cout << std::left << std::setw(12) << range.str() << std::right
+				<< std::setw(10) << report.confidence_correct[i] << std::setw(10) << report.confidence_wrong[i]
+				<< std::setw(12) << report.confidence_unlabelled[i] << std::endl;
+		}
+	}
+
+	void writeLatencyJSON(std::ostream &out, const char *name, const std::vector<uint64_t> &values) {
+		out << "\t\t\"" << name << "\": {\"mean\": " << getMean(values);
+		for (int i = 0 ; i < 4 ; ++i)
+			out << ", \"" << percentile_names[i] << "\": " << getPercentile(values, percentiles[i]);
+		out << ", \"max\": " << (values.empty() ? 0 : values.back()) << "}";
+	}
+
+	void writeArrayJSON(std::ostream &out, const unsigned long *values, int n) {
+		out << "[";
+		for (int i = 0 ; i < n ; ++i)
+			out << ((i > 0) ? ", " : "") << values[i];
+		out << "]";
+	}
+
+	void writeJSON(const Report &report, const std::string &path) {
+		std::ofstream out(path);
+		if (!out)
+			throw Dataset::DatasetException("failed to open " + path);
+
+		out << std::fixed << std::setprecision(3);
+		out << "{\n\t\"engine\": \"" << report.engine << "\",\n";
+		out << "\t\"frames\": " << report.frames << ",\n";
+		out << "\t\"fps\": " << getFPS(report) << ",\n";
+		out << "\t\"latency_us\": {\n";
+		writeLatencyJSON(out, "resize", report.resize_us);
+		out << ",\n";
+		writeLatencyJSON(out, "inference", report.inference_us);
+		out << ",\n";
+		writeLatencyJSON(out, "total", report.total_us);
+		out << "\n\t},\n";
+
+		out << "\t\"categories\": [";
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i)
+			out << ((i > 0) ? ", " : "") << "\"" << Dataset::getCategoryName(i) << "\"";
+		out << "],\n\t\"confusion\": [";
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i) {
+			out << ((i > 0) ? ", " : "");
+			writeArrayJSON(out, report.confusion[i], DATASET_CATEGORIES);
+		}
+		out << "],\n";
+
+		out << "\t\"confidence_bins\": " << BENCH_CONFIDENCE_BINS << ",\n";
+		out << "\t\"confidence\": {\n\t\t\"correct\": ";
+		writeArrayJSON(out, report.confidence_correct, BENCH_CONFIDENCE_BINS);
+		out << ",\n\t\t\"wrong\": ";
+		writeArrayJSON(out, report.confidence_wrong, BENCH_CONFIDENCE_BINS);
+		out << ",\n\t\t\"unlabelled\": ";
+		writeArrayJSON(out, report.confidence_unlabelled, BENCH_CONFIDENCE_BINS);
+		out << "\n\t}\n}\n";
+	}
+}
+
+int main(int argc, char **argv) {
+	try {
+		std::string json_path;
+		std::vector<Bench::Input> inputs;
+		for (int i = 1 ; i < argc ; ++i) {
+			std::string arg = argv[i];
+			if (arg == "-j") {
+				if (++i >= argc) {
+					std::cerr << "-j expects the path of the JSON report" << std::endl;
+					return 1;
+				}
+				json_path = argv[i];
+				continue;
+			}
+
+			size_t eq = arg.find('=');
+			if (eq != std::string::npos) {
+				int category = Dataset::getCategory(arg.substr(0, eq));
+				if (category < 0) {
+					std::cerr << "Labelled replays must be given as category=replay, with category asian, european or empty" << std::endl;
+					return 1;
+				}
+				inputs.push_back({arg.substr(eq + 1), category, false});
+				continue;
+			}
+
+			// A directory with category subdirectories or a pack is a
+			// dataset
+			bool dataset = Pack::isPack(arg);
+			for (int category = 0 ; category < DATASET_CATEGORIES ; ++category)
+				dataset |= Dataset::isDirectory(arg + "/" + Dataset::getCategoryName(category));
+			inputs.push_back({arg, -1, dataset});
+		}
+		if (inputs.empty())
+			inputs.push_back({"dataset", -1, true});
+
+		Bench::Report report;
+		report.engine = Conf::getString("NN_ENGINE", "native");
+		Bench::Pipeline pipeline(report);
+		for (auto it = inputs.begin() ; it != inputs.end() ; ++it) {
+			if (it->dataset)
+				Bench::runDataset(pipeline, it->path);
+			else
+				Bench::runReplay(pipeline, *it);
+		}
+		if (report.frames == 0)
+			throw Dataset::DatasetException("no frame to classify");
+
+		std::sort(report.resize_us.begin(), report.resize_us.end());
+		std::sort(report.inference_us.begin(), report.inference_us.end());
+		std::sort(report.total_us.begin(), report.total_us.end());
+
+		Bench::print(report);
+		if (!json_path.empty()) {
+			Bench::writeJSON(report, json_path);
+			std::cout << "\nSaved the report to " << json_path << "." << std::endl;
+		}
+	} catch (std::exception &ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,518 @@
+// Microbenchmarks of the per-frame kernels and synchronisation primitives.
+// Build with `make vespid-microbench`, run without arguments. The frame
+// benchmarks run at the camera resolutions of BENCH_RESOLUTIONS; the
+// texture benchmarks use the GPU renderer when a display is available and
+// SDL's software renderer otherwise.
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <atomic>
+#include <SDL.h>
+#include <SDL_thread.h>
+#include <SDL_mutex.h>
+#include <cxcore.hpp>
+
+#include "camera.hh"
+#include "gui.hh"
+#include "image.hh"
+#include "util.hh"
+
+// Approximate duration of each benchmark
+#define BENCH_MS 500
+// Number of values published by the producer in contention benchmarks
+#define CONTENTION_VALUES 200000
+// Number of frames captured by the camera in contention benchmarks
+#define CONTENTION_FRAMES 500
+// Size of the GUI window
+#define BENCH_SCREEN_WIDTH 320
+#define BENCH_SCREEN_HEIGHT 240
+
+namespace Bench {
+	// Runs f in batches of batch calls until BENCH_MS milliseconds have
+	// elapsed and prints the average time per call.
+	template<typename F>
+	void run(const char *name, F f, int batch = 1000) {
+		unsigned long calls = 0;
+		uint64_t start = Time::getMicros(), elapsed;
+		do {
+			for (int i = 0 ; i < batch ; ++i)
+				f();
+			calls += batch;
+			elapsed = Time::getMicros() - start;
+		} while (elapsed < BENCH_MS * 1000);
+
+		std::cout << std::left << std::setw(64) << name << std::right << std::setw(12)
+			<< (double) elapsed * 1000.0 / calls << " ns/call" << std::endl;
+	}
+
+	void printResult(const char *name, double value, const char *unit) {
+		std::cout << std::left << std::setw(64) << name << std::right << std::setw(12)
+			<< value << " " << unit << std::endl;
+	}
+
+	struct Resolution {
+		int width, height;
+	};
+
+	const Resolution resolutions[] = {{1280, 960}, {640, 480}};
+
+	std::string getName(const Resolution &resolution, const char *name) {
+		return std::to_string(resolution.width) + "x" + std::to_string(resolution.height) + " " + name;
+	}
+
+	// Frames of random pixels as captured by the camera, BGR or I420
+	cv::Mat createFrame(const Resolution &resolution, Camera::frameFormat format) {
+		cv::Mat frame;
+		if (format == Camera::FRAME_YUV420)
+			frame.create(resolution.height * 3 / 2, resolution.width, CV_8UC1);
+		else
+			frame.create(resolution.height, resolution.width, CV_8UC3);
+		for (size_t i = 0 ; i < frame.total() * frame.elemSize() ; ++i)
+			frame.data[i] = rand() & 0xff;
+		return frame;
+	}
+}
+
+namespace Legacy {
+	// Thread::ConsumerTracker as it was before being replaced by
+	// Thread::SequenceCounter, used as the baseline.
+	class ConsumerTracker {
+	public:
+		ConsumerTracker(int n) : n_consumers(n) {
+			mutex = SDL_CreateMutex();
+			newval_table = new bool[n_consumers];
+			for (int i = 0 ; i < n_consumers ; ++i)
+				newval_table[i] = false;
+		}
+		~ConsumerTracker() {
+			delete[] newval_table;
+			SDL_DestroyMutex(mutex);
+		}
+		bool getSingle(int src_id) {
+			bool v;
+			SDL_LockMutex(mutex);
+			v = newval_table[src_id];
+			SDL_UnlockMutex(mutex);
+			return v;
+		}
+		void setSingleFalse(int src_id) {
+			SDL_LockMutex(mutex);
+			newval_table[src_id] = false;
+			SDL_UnlockMutex(mutex);
+		}
+		void setAllTrue() {
+			SDL_LockMutex(mutex);
+			for (int i = 0 ; i < n_consumers ; ++i)
+				newval_table[i] = true;
+			SDL_UnlockMutex(mutex);
+		}
+
+	private:
+		int n_consumers;
+		SDL_mutex *mutex;
+		bool *newval_table;
+	};
+
+	// The producer side and the newImage()/retrieve() logic of
+	// Camera::Camera before SequenceCounter
+	struct Channel {
+		Channel() : tracker(2) {
+			sem = SDL_CreateSemaphore(0);
+			mutex = SDL_CreateMutex();
+		}
+		~Channel() {
+			SDL_DestroySemaphore(sem);
+			SDL_DestroyMutex(mutex);
+		}
+		void publish(unsigned long v) {
+			SDL_LockMutex(mutex);
+			value = v;
+			SDL_UnlockMutex(mutex);
+			if (SDL_SemValue(sem) == 0)
+				SDL_SemPost(sem);
+		}
+		bool isNew(int src_id) {
+			if (tracker.getSingle(src_id)) {
+				return true;
+			} else if (SDL_SemTryWait(sem) != SDL_MUTEX_TIMEDOUT) {
+				tracker.setAllTrue();
+				return true;
+			}
+			return false;
+		}
+		unsigned long retrieve(int src_id) {
+			unsigned long v;
+			SDL_LockMutex(mutex);
+			v = value;
+			SDL_UnlockMutex(mutex);
+			tracker.setSingleFalse(src_id);
+			return v;
+		}
+
+		ConsumerTracker tracker;
+		SDL_sem *sem;
+		SDL_mutex *mutex;
+		unsigned long value = 0;
+	};
+}
+
+namespace Sync {
+	// The same channel using Thread::SequenceCounter, as Camera::Camera
+	// and Image::NNManager do.
+	struct Channel {
+		void publish(unsigned long v) {
+			SDL_LockMutex(mutex);
+			value = v;
+			SDL_UnlockMutex(mutex);
+			seq.publish(v);
+		}
+		bool isNew(int src_id) {
+			return seq.isNewer(last_seen[src_id]);
+		}
+		unsigned long retrieve(int src_id) {
+			unsigned long v;
+			SDL_LockMutex(mutex);
+			v = value;
+			SDL_UnlockMutex(mutex);
+			last_seen[src_id] = v;
+			return v;
+		}
+
+		Channel() { mutex = SDL_CreateMutex(); }
+		~Channel() { SDL_DestroyMutex(mutex); }
+		Thread::SequenceCounter seq;
+		SDL_mutex *mutex;
+		unsigned long value = 0;
+		unsigned long last_seen[2] = {0, 0};
+	};
+
+	template<typename C>
+	struct ContentionData {
+		C *channel;
+		int src_id;
+		std::atomic<bool> *done;
+		// Results: polls, retrieved values, values retrieved twice
+		unsigned long polls = 0, retrieved = 0, duplicates = 0;
+	};
+
+	template<typename C>
+	int consumerFunc(void *data) {
+		ContentionData<C> *d = (ContentionData<C>*) data;
+		unsigned long last = 0;
+		while (!d->done->load()) {
+			d->polls++;
+			if (d->channel->isNew(d->src_id)) {
+				unsigned long v = d->channel->retrieve(d->src_id);
+				d->retrieved++;
+				if (v == last)
+					d->duplicates++;
+				last = v;
+			}
+		}
+		return 0;
+	}
+
+	// One producer publishing as fast as possible, two consumers polling
+	template<typename C>
+	void contention(const char *name) {
+		C channel;
+		std::atomic<bool> done(false);
+		ContentionData<C> data[2];
+		SDL_Thread *threads[2];
+
+		uint64_t start = Time::getMicros();
+		for (int i = 0 ; i < 2 ; ++i) {
+			data[i].channel = &channel;
+			data[i].src_id = i;
+			data[i].done = &done;
+			threads[i] = SDL_CreateThread(consumerFunc<C>, "Consumer", &data[i]);
+		}
+		for (unsigned long v = 1 ; v <= CONTENTION_VALUES ; ++v)
+			channel.publish(v);
+		uint64_t publish_us = Time::getMicros() - start;
+		done.store(true);
+		for (int i = 0 ; i < 2 ; ++i)
+			SDL_WaitThread(threads[i], NULL);
+		uint64_t elapsed = Time::getMicros() - start;
+
+		std::string prefix(name);
+		Bench::printResult((prefix + ": publish").c_str(), (double) publish_us * 1000.0 / CONTENTION_VALUES, "ns/call");
+		for (int i = 0 ; i < 2 ; ++i) {
+			Bench::printResult((prefix + ": poll").c_str(), (double) elapsed * 1000.0 / data[i].polls, "ns/call");
+			Bench::printResult((prefix + ": values retrieved twice").c_str(), data[i].duplicates, "");
+		}
+	}
+
+	void run() {
+		Legacy::Channel legacy;
+		Channel channel;
+
+		std::cout << "-- Synchronisation --" << std::endl;
+		Bench::run("ConsumerTracker: check, nothing new", [&]() { legacy.isNew(0); });
+		Bench::run("SequenceCounter: check, nothing new", [&]() { channel.isNew(0); });
+		Bench::run("ConsumerTracker: publish + check + retrieve", [&]() {
+			legacy.publish(legacy.value + 1);
+			if (legacy.isNew(0))
+				legacy.retrieve(0);
+		});
+		Bench::run("SequenceCounter: publish + check + retrieve", [&]() {
+			channel.publish(channel.value + 1);
+			if (channel.isNew(0))
+				channel.retrieve(0);
+		});
+		contention<Legacy::Channel>("ConsumerTracker, 2 consumers");
+		contention<Channel>("SequenceCounter, 2 consumers");
+	}
+}
+
+namespace Frames {
+	// Per-frame kernels of the preprocessing stage and of the GUI
+	void run() {
+		std::cout << "\n-- Frame kernels --" << std::endl;
+		for (const Bench::Resolution &resolution : Bench::resolutions) {
+			cv::Mat bgr = Bench::createFrame(resolution, Camera::FRAME_BGR);
+			cv::Mat yuv = Bench::createFrame(resolution, Camera::FRAME_YUV420);
+			cv::Mat dst;
+			int x_pos, y_pos;
+
+			Bench::run(Bench::getName(resolution, "resizeImageForDB, BGR").c_str(), [&]() {
+				Image::resizeImageForDB(bgr, dst, Camera::FRAME_BGR);
+			}, 10);
+			Bench::run(Bench::getName(resolution, "resizeImageForDB, YUV420").c_str(), [&]() {
+				Image::resizeImageForDB(yuv, dst, Camera::FRAME_YUV420);
+			}, 10);
+			Bench::run(Bench::getName(resolution, "resizeImageForDBGeneric, BGR").c_str(), [&]() {
+				Image::resizeImageForDBGeneric(bgr, dst);
+			}, 10);
+			Bench::run(Bench::getName(resolution, "resizeImageForScreen, BGR").c_str(), [&]() {
+				Image::resizeImageForScreen(bgr, dst, BENCH_SCREEN_WIDTH, BENCH_SCREEN_HEIGHT, x_pos, y_pos);
+			}, 10);
+		}
+	}
+}
+
+namespace Legacy {
+	// Camera::Camera before the frame ring: the camera thread captured
+	// into a Mat under the mutex, and retrieve() copied it.
+	struct CameraChannel {
+		CameraChannel() { mutex = SDL_CreateMutex(); }
+		~CameraChannel() { SDL_DestroyMutex(mutex); }
+
+		void capture(const cv::Mat &src, unsigned long seq) {
+			SDL_LockMutex(mutex);
+			src.copyTo(image);
+			SDL_UnlockMutex(mutex);
+			newimage_seq.publish(seq);
+		}
+		// The frame is valid until the next retrieve of the consumer
+		const cv::Mat* retrieve(int src_id) {
+			SDL_LockMutex(mutex);
+			image.copyTo(copies[src_id]);
+			SDL_UnlockMutex(mutex);
+			return &copies[src_id];
+		}
+
+		Thread::SequenceCounter newimage_seq;
+		SDL_mutex *mutex;
+		cv::Mat image;
+		cv::Mat copies[CAMERA_CLASER_ONSUMERS];
+	};
+}
+
+namespace Ring {
+	// The producer side of Camera::CameraThread and retrieve() of
+	// Camera::Camera, the source writes into the ring slot.
+	struct CameraChannel {
+		void capture(const cv::Mat &src, unsigned long seq) {
+			cv::Mat *slot = ring.beginWrite();
+			if (slot == NULL) {
+				dropped++;
+				return;
+			}
+			src.copyTo(*slot);
+			newimage_seq.publish(ring.endWrite(Time::getMicros(), Camera::FRAME_BGR));
+		}
+		const cv::Mat* retrieve(int src_id) {
+			frames[src_id].release();
+			if (!ring.acquireLatest(frames[src_id]))
+				return NULL;
+			return &frames[src_id].getImage();
+		}
+
+		Camera::FrameRing ring;
+		Thread::SequenceCounter newimage_seq;
+		Camera::Frame frames[CAMERA_CLASER_ONSUMERS];
+		std::atomic<unsigned long> dropped{0};
+	};
+
+	template<typename C>
+	struct ContentionData {
+		C *channel;
+		int src_id;
+		std::atomic<bool> *done;
+		// Results: retrieved frames, frames published but never retrieved
+		unsigned long retrieved = 0, skipped = 0;
+	};
+
+	// The consumers process the frames as the GUI (resizeImageForScreen)
+	// and the preprocessing stage (resizeImageForDB) do.
+	template<typename C>
+	int consumerFunc(void *data) {
+		ContentionData<C> *d = (ContentionData<C>*) data;
+		unsigned long last = 0;
+		cv::Mat dst;
+		int x_pos, y_pos;
+		while (true) {
+			unsigned long seq = d->channel->newimage_seq.wait(last);
+			if (d->done->load())
+				break;
+			const cv::Mat *frame = d->channel->retrieve(d->src_id);
+			if (frame == NULL)
+				continue;
+			d->retrieved++;
+			d->skipped += seq - last - 1;
+			last = seq;
+
+			if (d->src_id == CAMERA_CLASER_ONSUMER_MAIN_ID)
+				Image::resizeImageForScreen(*frame, dst, BENCH_SCREEN_WIDTH, BENCH_SCREEN_HEIGHT, x_pos, y_pos);
+			else
+				Image::resizeImageForDB(*frame, dst);
+		}
+		return 0;
+	}
+
+	unsigned long getDropped(const CameraChannel &channel) { return channel.dropped; }
+	unsigned long getDropped(const Legacy::CameraChannel &channel) { return 0; }
+
+	// The camera captures CONTENTION_FRAMES frames as fast as possible
+	// while both consumers retrieve and process them.
+	template<typename C>
+	void contention(const Bench::Resolution &resolution, const char *name) {
+		cv::Mat src = Bench::createFrame(resolution, Camera::FRAME_BGR);
+		C channel;
+		std::atomic<bool> done(false);
+		ContentionData<C> data[CAMERA_CLASER_ONSUMERS];
+		SDL_Thread *threads[CAMERA_CLASER_ONSUMERS];
+
+		for (int i = 0 ; i < CAMERA_CLASER_ONSUMERS ; ++i) {
+			data[i].channel = &channel;
+			data[i].src_id = i;
+			data[i].done = &done;
+			threads[i] = SDL_CreateThread(consumerFunc<C>, "Consumer", &data[i]);
+		}
+		uint64_t start = Time::getMicros();
+		for (unsigned long seq = 1 ; seq <= CONTENTION_FRAMES ; ++seq)
+			channel.capture(src, seq);
+		uint64_t capture_us = Time::getMicros() - start;
+		// Wake the consumers up so they see done
+		done.store(true);
+		channel.newimage_seq.publish(CONTENTION_FRAMES + 1);
+		for (int i = 0 ; i < CAMERA_CLASER_ONSUMERS ; ++i)
+			SDL_WaitThread(threads[i], NULL);
+
+		std::string prefix = Bench::getName(resolution, name);
+		Bench::printResult((prefix + ": capture").c_str(), (double) capture_us * 1000.0 / CONTENTION_FRAMES, "ns/frame");
+		Bench::printResult((prefix + ": frames dropped").c_str(), getDropped(channel), "");
+		for (int i = 0 ; i < CAMERA_CLASER_ONSUMERS ; ++i) {
+			const char *consumer = (i == CAMERA_CLASER_ONSUMER_MAIN_ID) ? ": GUI" : ": preprocessing";
+			Bench::printResult((prefix + consumer + " frames retrieved").c_str(), data[i].retrieved, "");
+			Bench::printResult((prefix + consumer + " frames skipped").c_str(), data[i].skipped, "");
+		}
+	}
+
+	void run() {
+		std::cout << "\n-- Camera frames --" << std::endl;
+		for (const Bench::Resolution &resolution : Bench::resolutions) {
+			cv::Mat src = Bench::createFrame(resolution, Camera::FRAME_BGR);
+			Legacy::CameraChannel legacy;
+			CameraChannel channel;
+			unsigned long seq = 0;
+
+			Bench::run(Bench::getName(resolution, "Mat copy: capture + retrieve").c_str(), [&]() {
+				legacy.capture(src, ++seq);
+				legacy.retrieve(CAMERA_CLASER_ONSUMER_MAIN_ID);
+			}, 10);
+			Bench::run(Bench::getName(resolution, "FrameRing: capture + retrieve").c_str(), [&]() {
+				channel.capture(src, 0);
+				channel.retrieve(CAMERA_CLASER_ONSUMER_MAIN_ID);
+			}, 10);
+			Bench::run(Bench::getName(resolution, "FrameRing: retrieve").c_str(), [&]() {
+				channel.retrieve(CAMERA_CLASER_ONSUMER_MAIN_ID);
+			});
+			contention<Legacy::CameraChannel>(resolution, "Mat copy, 2 consumers");
+			contention<CameraChannel>(resolution, "FrameRing, 2 consumers");
+		}
+	}
+}
+
+namespace Display {
+	// TextureImage::updateFromImage, which uploads the camera preview
+	// with Texture::updateFromData (YUV420) or a locked streaming texture
+	// (BGR).
+	void run() {
+		std::cout << "\n-- Textures --" << std::endl;
+		SDL_Window *window = NULL;
+		SDL_Renderer *renderer = NULL;
+		SDL_Surface *surface = NULL;
+		if (SDL_Init(SDL_INIT_VIDEO) == 0) {
+			window = SDL_CreateWindow("vespid-microbench", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+				BENCH_SCREEN_WIDTH, BENCH_SCREEN_HEIGHT, SDL_WINDOW_HIDDEN | SDL_WINDOW_OPENGL);
+			if (window != NULL)
+				renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+		}
+		if (renderer == NULL) {
+			surface = SDL_CreateRGBSurface(0, BENCH_SCREEN_WIDTH, BENCH_SCREEN_HEIGHT, 32, 0, 0, 0, 0);
+			if (surface != NULL)
+				renderer = SDL_CreateSoftwareRenderer(surface);
+		}
+		if (renderer == NULL) {
+			std::cout << "No renderer available, skipped." << std::endl;
+			SDL_Quit();
+			return;
+		}
+
+		SDL_RendererInfo info;
+		if (SDL_GetRendererInfo(renderer, &info) == 0)
+			std::cout << "Renderer: " << info.name << std::endl;
+
+		{
+			GUI::TextureSet set;
+			GUI::TextureImage texture(0, 0, &set);
+			set.init(renderer, NULL);
+
+			for (const Bench::Resolution &resolution : Bench::resolutions) {
+				cv::Mat bgr = Bench::createFrame(resolution, Camera::FRAME_BGR);
+				cv::Mat yuv = Bench::createFrame(resolution, Camera::FRAME_YUV420);
+
+				Bench::run(Bench::getName(resolution, "updateFromImage, BGR").c_str(), [&]() {
+					texture.updateFromImage(bgr, Camera::FRAME_BGR);
+				}, 10);
+				Bench::run(Bench::getName(resolution, "updateFromImage, YUV420").c_str(), [&]() {
+					texture.updateFromImage(yuv, Camera::FRAME_YUV420);
+				}, 10);
+			}
+			// The texture is destroyed before the renderer
+		}
+
+		SDL_DestroyRenderer(renderer);
+		if (surface != NULL)
+			SDL_FreeSurface(surface);
+		if (window != NULL)
+			SDL_DestroyWindow(window);
+		SDL_Quit();
+	}
+}
+
+int main() {
+	try {
+		Sync::run();
+		Frames::run();
+		Ring::run();
+		Display::run();
+	} catch (std::exception &ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
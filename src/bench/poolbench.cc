@@ -0,0 +1,87 @@
+// Throughput of the inference pool with 1 to N workers (default: the number
+// of cores, at most POOL_MAX_WORKERS). Build with `make vespid-poolbench`, run as
+// `vespid-poolbench [max_workers]`. The classifier is selected as in VESPID
+// (NN_ENGINE, NN_WEIGHTS).
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <SDL_cpuinfo.h>
+#include <cxcore.hpp>
+
+#include "pool.hh"
+#include "classifier.hh"
+#include "util.hh"
+
+// Duration of each run
+#define BENCH_MS 3000
+// Number of distinct input frames
+#define BENCH_FRAMES 64
+
+namespace Bench {
+	class CountingSink : public Image::JobSink {
+	public:
+		virtual void onJobDone(const Image::InferenceJob &job) {
+			frames += job.n;
+		}
+
+		std::atomic<unsigned long> frames{0};
+	};
+
+	// Classifies single frames as fast as possible, returns frames/s
+	double run(unsigned int workers, const std::vector<cv::Mat> &inputs) {
+		CountingSink sink;
+		Image::InferencePool pool(workers, &sink);
+
+		unsigned long submitted = 0;
+		uint64_t start = Time::getMicros(), elapsed = 0;
+		do {
+			Image::InferenceJob *job = pool.beginJob(100);
+			if (job == NULL) {
+				pool.checkDeath();
+				continue;
+			}
+			job->n = 1;
+			inputs[submitted++ % inputs.size()].copyTo(job->images[0]);
+			pool.endJob(job);
+		} while ((elapsed = Time::getMicros() - start) < BENCH_MS * 1000);
+
+		return sink.frames * 1000000.0 / elapsed;
+	}
+}
+
+int main(int argc, char **argv) {
+	try {
+		unsigned int max_workers = std::min(SDL_GetCPUCount(), POOL_MAX_WORKERS);
+		if (argc > 1)
+			max_workers = atoi(argv[1]);
+		if (max_workers < 1 || max_workers > POOL_MAX_WORKERS) {
+			std::cerr << "The number of workers must be between 1 and " << POOL_MAX_WORKERS << std::endl;
+			return 1;
+		}
+
+		std::vector<cv::Mat> inputs(BENCH_FRAMES);
+		for (auto it = inputs.begin() ; it != inputs.end() ; ++it) {
+			it->create(DB_RESIZED_IMAGE_HEIGHT, DB_RESIZED_IMAGE_WIDTH, CV_8UC3);
+			for (int i = 0 ; i < DB_RESIZED_IMAGE_SIZE ; ++i)
+				it->data[i] = rand() & 0xff;
+		}
+
+		std::cout << std::setw(8) << "workers" << std::setw(14) << "frames/s" << std::setw(10) << "speedup" << std::endl;
+		double base = 0;
+		for (unsigned int workers = 1 ; workers <= max_workers ; ++workers) {
+			double fps = Bench::run(workers, inputs);
+			if (workers == 1)
+				base = fps;
+			std::cout << std::setw(8) << workers << std::setw(14) << std::fixed << std::setprecision(1) << fps
+				<< std::setw(10) << std::setprecision(2) << fps / base << std::endl;
+		}
+	} catch (std::exception &ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
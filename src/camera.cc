@@ -1,72 +1,177 @@
-#include <raspicam/raspicam_cv.h>
 #include <cxcore.hpp>
 #include <SDL_thread.h>
 #include <SDL_mutex.h>
 
 #include "camera.hh"
+#include "metrics.hh"
+#include "source.hh"
 #include "util.hh"
 
 namespace Camera {
-	Camera::Camera() : m_newimage_tracker(CAMERA_CLASER_ONSUMERS) {
+	Camera::Camera() {
 		m_thread.launch("CameraThread");
 	}
 
 	bool Camera::newImage(int src_id) {
-		if (m_newimage_tracker.getSingle(src_id)) {
-			return true;
-		} else if (SDL_SemTryWait(m_thread.newimage_sem) != SDL_MUTEX_TIMEDOUT) {
-			m_newimage_tracker.setAllTrue();
-			return true;
-		}
-
-		return false;
+		m_thread.checkDeath();
+		return m_thread.newimage_seq.isNewer(m_last_seq[src_id]);
 	}
 
-	void Camera::waitForImage(int src_id) {
-		if (m_newimage_tracker.getSingle(src_id))
-			return;
-
-		SDL_SemWait(m_thread.newimage_sem);
-		m_newimage_tracker.setAllTrue();
+	bool Camera::waitForImage(int src_id, unsigned int timeout_ms) {
+		m_thread.checkDeath();
+		return m_thread.newimage_seq.wait(m_last_seq[src_id], timeout_ms) > m_last_seq[src_id];
 	}
 
-	void Camera::retrieve(cv::Mat &image, int src_id) {
-		SDL_LockMutex(m_thread.mutex);
-		image = m_thread.image;
-		SDL_UnlockMutex(m_thread.mutex);
-		m_newimage_tracker.setSingleFalse(src_id);
+	void Camera::retrieve(Frame &frame, int src_id) {
+		frame.release();
+		if (m_thread.ring.acquireLatest(frame)) {
+			if (m_last_seq[src_id] != 0 && frame.getSeq() > m_last_seq[src_id] + 1) {
+				unsigned long skipped = frame.getSeq() - m_last_seq[src_id] - 1;
+				m_skipped[src_id] += skipped;
+				Metrics::increment((Metrics::counter) (Metrics::CONSUMER_SKIPPED_MAIN + src_id), skipped);
+			}
+			m_last_seq[src_id] = frame.getSeq();
+		}
 	}
 
-	void CameraThread::construct() {
-		mutex = SDL_CreateMutex();
-		newimage_sem = SDL_CreateSemaphore(0);
+	unsigned long Camera::getSkippedFrames(int src_id) {
+		return m_skipped[src_id];
 	}
 
+	void CameraThread::construct() {}
+
 	CameraThread::~CameraThread() {
 		destruct();
-
-		if (newimage_sem != NULL)
-			SDL_DestroySemaphore(newimage_sem);
-		if (mutex != NULL)
-			SDL_DestroyMutex(mutex);
 	}
 
 	void CameraThread::onStart() {
-		camera.set(CV_CAP_PROP_FORMAT, CV_8UC3);
-		if (!camera.open())
-			throw CameraException();
+		source.reset(createSource());
+		source->open();
+
+		// Check the frame size once, the frames are then cropped without
+		// checks.
+		const cv::Size size = source->getSize();
+		roi = clipROI(getConfROI(), size, source->getFormat());
+		if (roi == cv::Rect(0, 0, size.width, size.height))
+			roi = cv::Rect();
 	}
 
 	void CameraThread::onEnd() {
-		camera.release();
+		if (source)
+			source->close();
+		source.reset();
 	}
 
 	void CameraThread::loop() {
-		camera.grab();
-		SDL_LockMutex(mutex);
-		camera.retrieve(image);
-		SDL_UnlockMutex(mutex);
-		if (SDL_SemValue(newimage_sem) == 0)
-			SDL_SemPost(newimage_sem);
+		if (!source->grab()) {
+			// End of the replay
+			Time::delay(100);
+			return;
+		}
+		uint64_t timestamp = Time::getMicros();
+
+		cv::Mat *slot = ring.beginWrite();
+		if (slot == NULL) {
+			// All slots are held, drop the frame.
+			Metrics::increment(Metrics::CAMERA_DROPPED);
+			return;
+		}
+		if (roi.area() > 0) {
+			source->retrieve(capture_image);
+			cropFrame(capture_image, source->getFormat(), roi, *slot);
+		} else {
+			source->retrieve(*slot);
+		}
+		newimage_seq.publish(ring.endWrite(timestamp, source->getFormat()));
+		Metrics::increment(Metrics::CAMERA_FRAMES);
+	}
+
+	FrameRing::FrameRing() {
+		m_mutex = SDL_CreateMutex();
+	}
+
+	FrameRing::~FrameRing() {
+		SDL_DestroyMutex(m_mutex);
+		m_mutex = NULL;
+	}
+
+	cv::Mat* FrameRing::beginWrite() {
+		SDL_LockMutex(m_mutex);
+		m_writing = -1;
+		for (int i = 0 ; i < CAMERA_RING_SIZE ; ++i) {
+			if (i != m_latest && m_slots[i].refcount == 0) {
+				m_writing = i;
+				break;
+			}
+		}
+		SDL_UnlockMutex(m_mutex);
+
+		return (m_writing >= 0) ? &m_slots[m_writing].image : NULL;
+	}
+
+	unsigned long FrameRing::endWrite(uint64_t timestamp, frameFormat format) {
+		unsigned long seq;
+		SDL_LockMutex(m_mutex);
+		seq = m_slots[m_writing].seq = ++m_seq;
+		m_slots[m_writing].timestamp = timestamp;
+		m_slots[m_writing].format = format;
+		m_latest = m_writing;
+		m_writing = -1;
+		SDL_UnlockMutex(m_mutex);
+		return seq;
+	}
+
+	bool FrameRing::acquireLatest(Frame &frame) {
+		SDL_LockMutex(m_mutex);
+		int slot = m_latest;
+		if (slot >= 0)
+			m_slots[slot].refcount++;
+		SDL_UnlockMutex(m_mutex);
+
+		if (slot < 0)
+			return false;
+
+		frame.m_ring = this;
+		frame.m_slot = slot;
+		return true;
+	}
+
+	void FrameRing::release(int slot) {
+		SDL_LockMutex(m_mutex);
+		m_slots[slot].refcount--;
+		SDL_UnlockMutex(m_mutex);
+	}
+
+	Frame::~Frame() {
+		release();
+	}
+
+	bool Frame::empty() const {
+		return m_ring == NULL;
+	}
+
+	const cv::Mat& Frame::getImage() const {
+		return m_ring->m_slots[m_slot].image;
+	}
+
+	frameFormat Frame::getFormat() const {
+		return m_ring->m_slots[m_slot].format;
+	}
+
+	unsigned long Frame::getSeq() const {
+		return m_ring->m_slots[m_slot].seq;
+	}
+
+	uint64_t Frame::getTimestamp() const {
+		return m_ring->m_slots[m_slot].timestamp;
+	}
+
+	void Frame::release() {
+		if (m_ring == NULL)
+			return;
+
+		m_ring->release(m_slot);
+		m_ring = NULL;
+		m_slot = -1;
 	}
 }
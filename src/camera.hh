@@ -1,11 +1,12 @@
 #pragma once
 
 #include <exception>
-#include <raspicam/raspicam_cv.h>
+#include <memory>
 #include <cxcore.hpp>
 #include <SDL_thread.h>
 #include <SDL_mutex.h>
 
+#include "source.hh"
 #include "util.hh"
 
 #define IMAGE_SAVE_PATH "/tmp/hornetimg.ppm"
@@ -14,6 +15,10 @@
 #define CAMERA_CLASER_ONSUMER_MAIN_ID 0
 #define CAMERA_CLASER_ONSUMER_PROCESSING_ID 1
 
+// Number of frame slots: one per consumer, one for the latest frame and
+// one being written by the camera.
+#define CAMERA_RING_SIZE (CAMERA_CLASER_ONSUMERS + 2)
+
 namespace Camera {
 	struct CameraException : public std::exception {
 		const char* what() const noexcept {
@@ -21,6 +26,68 @@ namespace Camera {
 		}
 	};
 
+	class FrameRing;
+
+	// A frame held by a consumer. The camera does not write into the slot
+	// of a held frame; frames are released on destruction.
+	class Frame {
+	public:
+		Frame() {}
+		~Frame();
+		Frame(const Frame&) = delete;
+		Frame& operator=(const Frame&) = delete;
+
+		bool empty() const;
+		const cv::Mat& getImage() const;
+		frameFormat getFormat() const;
+		unsigned long getSeq() const;
+		// Capture time, in microseconds (see Time::getMicros)
+		uint64_t getTimestamp() const;
+		void release();
+
+	private:
+		friend class FrameRing;
+		FrameRing *m_ring = NULL;
+		int m_slot = -1;
+	};
+
+	// Fixed-size ring of preallocated frame slots, written by the camera
+	// thread and read by the consumers. The mutex only protects the slot
+	// bookkeeping, images are written and read without holding it.
+	class FrameRing {
+	public:
+		FrameRing();
+		~FrameRing();
+
+		// Producer side: returns the image of a free slot to write to, or
+		// NULL if all slots are held. endWrite() publishes it as the latest
+		// frame and returns its sequence number.
+		cv::Mat* beginWrite();
+		unsigned long endWrite(uint64_t timestamp, frameFormat format);
+
+		// Consumer side: holds the latest frame. Returns false if no frame
+		// was captured yet.
+		bool acquireLatest(Frame &frame);
+
+	private:
+		friend class Frame;
+		void release(int slot);
+
+		struct Slot {
+			cv::Mat image;
+			frameFormat format = FRAME_BGR;
+			unsigned long seq = 0;
+			uint64_t timestamp = 0;
+			int refcount = 0;
+		};
+
+		Slot m_slots[CAMERA_RING_SIZE];
+		int m_latest = -1;
+		int m_writing = -1;
+		unsigned long m_seq = 0;
+		SDL_mutex *m_mutex = NULL;
+	};
+
 	class CameraThread : public Thread::ThreadBase {
 	public:
 		virtual void onStart();
@@ -28,27 +95,42 @@ namespace Camera {
 		virtual void loop();
 		virtual void construct();
 		~CameraThread();
-		cv::Mat image;
-		SDL_mutex *mutex = NULL;
-		SDL_sem *newimage_sem = NULL;
+		FrameRing ring;
+		Thread::SequenceCounter newimage_seq;
 
 	private:
-		raspicam::RaspiCam_Cv camera;
+		std::unique_ptr<Source> source;
+		// Region of interest (see clipROI), empty for the whole frame. When
+		// it is set, frames are captured to capture_image then cropped to
+		// the ring.
+		cv::Rect roi;
+		cv::Mat capture_image;
 	};
 
 	class Camera {
 	public:
 		Camera();
 
-		// All these functions are thread-safe.
+		// All these functions are thread-safe. newImage() and
+		// waitForImage() throw the exception of the camera thread if it
+		// died.
 		bool newImage(int src_id);
-		void waitForImage(int src_id);
-		void retrieve(cv::Mat &image, int src_id);
+		// Waits at most timeout_ms for a new image, returns false if there
+		// is none.
+		bool waitForImage(int src_id, unsigned int timeout_ms);
+		// Releases the frame previously held by frame, if any, and holds
+		// the latest one.
+		void retrieve(Frame &frame, int src_id);
+		// Number of frames the consumer did not retrieve since it started
+		unsigned long getSkippedFrames(int src_id);
 
 	private:
-		Thread::ConsumerTracker m_newimage_tracker;
 		CameraThread m_thread;
 
+		// Per-consumer state, only accessed by the consumer thread
+		unsigned long m_last_seq[CAMERA_CLASER_ONSUMERS] = {0};
+		unsigned long m_skipped[CAMERA_CLASER_ONSUMERS] = {0};
+
 		static int camThread(void *thread_data);
 	};
 }
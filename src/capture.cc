@@ -0,0 +1,202 @@
+#include <string>
+#include <cstdlib>
+#include <dirent.h>
+#include <cxcore.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "capture.hh"
+#include "util.hh"
+
+// Maximal waiting time of the writer thread, so it can be stopped
+#define QUEUE_TIMEOUT_MS 100
+// Images waiting to be written (bursts run at the camera rate)
+#define QUEUE_DEFAULT_DEPTH 256
+
+namespace Capture {
+	void WriterThread::construct() {
+		mutex = SDL_CreateMutex();
+
+		int depth = Conf::getInt("CAPTURE_QUEUE_DEPTH", QUEUE_DEFAULT_DEPTH);
+		if (depth < 1)
+			throw Conf::ConfException("CAPTURE_QUEUE_DEPTH");
+		queue.reset(new ItemQueue(depth));
+	}
+
+	WriterThread::~WriterThread() {
+		destruct();
+
+		if (mutex != NULL)
+			SDL_DestroyMutex(mutex);
+	}
+
+	void WriterThread::write(const Item &item) {
+		std::string path;
+		if (pack) {
+			// Capture times are kept as wall-clock times
+			uint64_t timestamp_us = Pack::getTimestamp() - (Time::getMicros() - item.info.capture_us);
+			pack->append(item.image, item.category, item.index, timestamp_us, item.info.seq, item.source);
+			path = dir + ":" + Dataset::getCategoryName(item.category) + "/" + std::to_string(item.index);
+		} else {
+			path = dir + "/" + Dataset::getCategoryName(item.category) + "/" + std::to_string(item.index) + ".ppm";
+			if (!cv::imwrite(path, item.image))
+				throw CaptureException(path);
+		}
+
+		saved++;
+		SDL_LockMutex(mutex);
+		last_path = path;
+		SDL_UnlockMutex(mutex);
+	}
+
+	void WriterThread::loop() {
+		Item *item = queue->beginPop(QUEUE_TIMEOUT_MS);
+		if (item == NULL)
+			return;
+		write(*item);
+		queue->endPop();
+	}
+
+	void WriterThread::onEnd() {
+		Item *item;
+		while ((item = queue->beginPop(0)) != NULL) {
+			try {
+				write(*item);
+			} catch (std::exception&) {
+				queue->endPop();
+				return;
+			}
+			queue->endPop();
+		}
+
+		if (pack)
+			pack->close();
+	}
+
+	Writer::Writer(const std::string &dir, const std::string &pack_path) {
+		m_mutex = SDL_CreateMutex();
+
+		// The images are numbered from 1
+		if (!pack_path.empty()) {
+			m_thread.pack.reset(new Pack::Writer(pack_path));
+			for (int category = 0 ; category < DATASET_CATEGORIES ; ++category)
+				m_next_index[category] = m_thread.pack->getMaxNumber(category) + 1;
+			m_thread.dir = pack_path;
+			m_thread.launch("CaptureThread");
+			return;
+		}
+
+		for (int category = 0 ; category < DATASET_CATEGORIES ; ++category) {
+			m_next_index[category] = 0;
+
+			std::string path = dir + "/" + Dataset::getCategoryName(category);
+			DIR *dpdf = opendir(path.c_str());
+			if (dpdf == NULL)
+				continue;
+
+			unsigned int image_n = 0;
+			struct dirent *epdf;
+			while ((epdf = readdir(dpdf))) {
+				unsigned int n = strtol(epdf->d_name, NULL, 10);
+				if (n > image_n)
+					image_n = n;
+			}
+			closedir(dpdf);
+
+			m_next_index[category] = image_n + 1;
+		}
+
+		m_thread.dir = dir;
+		m_thread.launch("CaptureThread");
+	}
+
+	Writer::~Writer() {
+		SDL_DestroyMutex(m_mutex);
+	}
+
+	void Writer::checkCategory(int category) {
+		m_thread.checkDeath();
+		if (m_next_index[category] == 0)
+			throw CaptureException("no directory " + m_thread.dir + "/" + Dataset::getCategoryName(category));
+	}
+
+	std::string Writer::getPath(int category, unsigned int index) {
+		if (m_thread.pack)
+			return m_thread.dir + ":" + Dataset::getCategoryName(category) + "/" + std::to_string(index);
+		return m_thread.dir + "/" + Dataset::getCategoryName(category) + "/" + std::to_string(index) + ".ppm";
+	}
+
+	bool Writer::enqueue(const cv::Mat &image, int category, const Trace::FrameInfo &info,
+			Pack::recordSource source, unsigned int &index) {
+		SDL_LockMutex(m_mutex);
+		Item *item = m_thread.queue->beginPush(0);
+		if (item == NULL) {
+			SDL_UnlockMutex(m_mutex);
+			m_dropped++;
+			return false;
+		}
+
+		image.copyTo(item->image);
+		item->category = category;
+		item->index = index = m_next_index[category]++;
+		item->info = info;
+		item->source = source;
+		m_thread.queue->endPush();
+		SDL_UnlockMutex(m_mutex);
+		return true;
+	}
+
+	std::string Writer::push(const cv::Mat &image, int category, const Trace::FrameInfo &info) {
+		checkCategory(category);
+
+		unsigned int index;
+		if (!enqueue(image, category, info, Pack::SOURCE_CAMERA, index))
+			return "";
+		return getPath(category, index);
+	}
+
+	void Writer::startBurst(int category, unsigned int ms) {
+		checkCategory(category);
+
+		m_burst_end_us = Time::getMicros() + ms * (uint64_t) 1000;
+		m_burst_category = category;
+	}
+
+	void Writer::stopBurst() {
+		m_burst_category = -1;
+	}
+
+	bool Writer::isBursting() {
+		return m_burst_category >= 0 && Time::getMicros() < m_burst_end_us;
+	}
+
+	unsigned int Writer::getBurstTime() {
+		uint64_t now = Time::getMicros(), end = m_burst_end_us;
+		return (isBursting() && end > now) ? (end - now) / 1000 : 0;
+	}
+
+	unsigned long Writer::getSaved() {
+		m_thread.checkDeath();
+		return m_thread.saved;
+	}
+
+	std::string Writer::getLastPath() {
+		SDL_LockMutex(m_thread.mutex);
+		std::string path = m_thread.last_path;
+		SDL_UnlockMutex(m_thread.mutex);
+		return path;
+	}
+
+	void Writer::onFramePrepared(const Image::PreparedFrame &prepared) {
+		int category = m_burst_category;
+		if (category < 0)
+			return;
+		if (Time::getMicros() >= m_burst_end_us) {
+			// Unless a new burst was started meanwhile
+			m_burst_category.compare_exchange_strong(category, -1);
+			return;
+		}
+
+		unsigned int index;
+		enqueue(prepared.image, category, prepared.info, Pack::SOURCE_BURST, index);
+	}
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <exception>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <SDL_mutex.h>
+#include <cxcore.hpp>
+
+#include "dataset.hh"
+#include "image.hh"
+#include "pack.hh"
+#include "trace.hh"
+#include "util.hh"
+
+// Directory the images are saved to, relative to the working directory
+#define CAPTURE_DIR "dataset"
+
+// Captured images are written to the dataset by a background thread, so
+// neither the GUI nor the preprocessing stage wait for the disk.
+namespace Capture {
+	struct CaptureException : public std::exception {
+		CaptureException(std::string p_msg) : msg(p_msg) {}
+		const char* what() const noexcept {
+			static char ret[300];
+			snprintf(ret, 300, "Failed to save file to database: %s", msg.c_str());
+			return ret;
+		}
+
+		std::string msg;
+	};
+
+	// A classifier input waiting to be written as dir/category/index.ppm, or
+	// to the pack
+	struct Item {
+		cv::Mat image;
+		int category = 0;
+		unsigned int index = 0;
+		Trace::FrameInfo info;
+		Pack::recordSource source = Pack::SOURCE_CAMERA;
+	};
+
+	typedef Thread::SPSCQueue<Item> ItemQueue;
+
+	class WriterThread : public Thread::ThreadBase {
+	public:
+		virtual void onStart() {}
+		// Writes the images still in the queue
+		virtual void onEnd();
+		virtual void loop();
+		virtual void construct();
+		~WriterThread();
+
+		std::string dir;
+		// If set, images are appended to this pack instead of dir
+		std::unique_ptr<Pack::Writer> pack;
+		// Created by construct() with CAPTURE_QUEUE_DEPTH items
+		std::unique_ptr<ItemQueue> queue;
+
+		std::atomic<unsigned long> saved{0};
+		// Path of the last image written (protected by mutex)
+		SDL_mutex *mutex = NULL;
+		std::string last_path;
+
+	private:
+		void write(const Item &item);
+	};
+
+	// Saves classifier inputs (images resized by resizeImageForDB) to the
+	// dataset directory, or to a pack if pack_path is not empty. The next
+	// index of each category is found when the writer is created, then
+	// counted in memory. In burst mode, every frame prepared by the
+	// inference pipeline is saved.
+	class Writer : public Image::PreparedSink {
+	public:
+		Writer(const std::string &dir = CAPTURE_DIR, const std::string &pack_path = "");
+		~Writer();
+
+		// Queues an image of the camera frame info and returns its path,
+		// or an empty string if the queue is full. Throws CaptureException
+		// if the category directory does not exist or if the writer thread
+		// died.
+		std::string push(const cv::Mat &image, int category, const Trace::FrameInfo &info);
+		// Saves the prepared frames for ms milliseconds
+		void startBurst(int category, unsigned int ms);
+		void stopBurst();
+		bool isBursting();
+		// Remaining burst time, in milliseconds
+		unsigned int getBurstTime();
+
+		// Images written, and images dropped because the queue was full
+		unsigned long getSaved();
+		unsigned long getDropped() { return m_dropped; }
+		std::string getLastPath();
+
+		// Called by the preprocessing stage
+		virtual void onFramePrepared(const Image::PreparedFrame &prepared);
+
+	private:
+		void checkCategory(int category);
+		std::string getPath(int category, unsigned int index);
+		// Returns false if the queue is full
+		bool enqueue(const cv::Mat &image, int category, const Trace::FrameInfo &info,
+			Pack::recordSource source, unsigned int &index);
+
+		WriterThread m_thread;
+		// Next index of each category, 0 if its directory does not exist
+		// (protected by m_mutex, which also serializes the producers of the
+		// queue)
+		unsigned int m_next_index[DATASET_CATEGORIES];
+		SDL_mutex *m_mutex = NULL;
+		std::atomic<unsigned long> m_dropped{0};
+
+		// Burst category (-1 when there is no burst) and end time, see
+		// Time::getMicros
+		std::atomic<int> m_burst_category{-1};
+		std::atomic<uint64_t> m_burst_end_us{0};
+	};
+}
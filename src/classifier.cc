@@ -0,0 +1,188 @@
+#include <string>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <cxcore.hpp>
+#include <lua.hpp>
+
+#include "classifier.hh"
+#include "nn.hh"
+#include "util.hh"
+#include "cmake_config.h"
+
+#define TESTSCRIPT SHAREDIR "/torchnn/test.lua"
+#define NN_WEIGHTS_PATH SHAREDIR "/nnhornet.net"
+#define NN_CALIBRATION_PATH SHAREDIR "/nnhornet.cal"
+// Number of frames between two reports of the compare classifier
+#define COMPARE_REPORT_FRAMES 100
+
+namespace Image {
+	nnResult Classifier::classify(const cv::Mat &image) {
+		nnResult result;
+		classifyBatch(&image, 1, &result);
+		return result;
+	}
+
+	LuaClassifier::LuaClassifier() {
+		L = luaL_newstate();
+		if (L == NULL)
+			throw LuaException(LUA_ERRMEM);
+
+		luaL_openlibs(L);
+
+		m_thread_state = lua_newthread(L);
+
+		int err;
+		if ((err = luaL_loadfile(m_thread_state, TESTSCRIPT)) != 0) {
+			lua_close(L);
+			throw LuaException(err);
+		}
+
+		// Push the thread arguments: the shared buffers and their size
+		lua_pushlightuserdata(m_thread_state, m_input);
+		lua_pushlightuserdata(m_thread_state, m_results);
+		lua_pushinteger(m_thread_state, NN_MAX_BATCH);
+		lua_pushinteger(m_thread_state, DB_RESIZED_IMAGE_HEIGHT);
+		lua_pushinteger(m_thread_state, DB_RESIZED_IMAGE_WIDTH);
+		if ((err = lua_resume(m_thread_state, 5)) > 1) {
+			LuaException ex(err, std::string(lua_tostring(m_thread_state, -1)));
+			lua_close(L);
+			throw ex;
+		}
+	}
+
+	LuaClassifier::~LuaClassifier() {
+		lua_close(L);
+	}
+
+	void LuaClassifier::classifyBatch(const cv::Mat *images, int n, nnResult *results) {
+		for (int i = 0 ; i < n ; ++i)
+			imageToInput(images[i], m_input + i * DB_RESIZED_IMAGE_SIZE);
+
+		// Resume the Lua thread with the batch size, it reads the input
+		// buffer and fills m_results.
+		int err;
+		lua_pushinteger(m_thread_state, n);
+		if ((err = lua_resume(m_thread_state, 1)) > 1)
+			throw LuaException(err, std::string(lua_tostring(m_thread_state, -1)));
+
+		std::copy(m_results, m_results + n, results);
+	}
+
+	NativeClassifier::NativeClassifier(const std::string &path) {
+		m_net.load(path);
+
+		if (m_net.getInputChannels() != 3 || m_net.getInputHeight() != DB_RESIZED_IMAGE_HEIGHT
+				|| m_net.getInputWidth() != DB_RESIZED_IMAGE_WIDTH)
+			throw NN::NNException("unexpected input size in " + path);
+
+		const std::vector<std::string> &categories = m_net.getCategories();
+		if (categories.size() != 3)
+			throw NN::NNException("unexpected number of categories in " + path);
+
+		for (int i = 0 ; i < 3 ; ++i) {
+			if (categories[i] == "empty")
+				m_fields[i] = &nnResult::empty_prob;
+			else if (categories[i] == "asian")
+				m_fields[i] = &nnResult::asian_prob;
+			else if (categories[i] == "european")
+				m_fields[i] = &nnResult::european_prob;
+			else
+				throw NN::NNException("unknown category " + categories[i] + " in " + path);
+		}
+	}
+
+	void NativeClassifier::prepareInputs(const cv::Mat *images, int n) {
+		for (int i = 0 ; i < n ; ++i) {
+			imageToInput(images[i], m_input + i * DB_RESIZED_IMAGE_SIZE);
+			m_net.normalize(m_input + i * DB_RESIZED_IMAGE_SIZE);
+		}
+	}
+
+	void NativeClassifier::storeResults(const float *outputs, int n, nnResult *results) {
+		for (int i = 0 ; i < n ; ++i)
+			for (int j = 0 ; j < 3 ; ++j)
+				results[i].*m_fields[j] = outputs[i * 3 + j];
+	}
+
+	void NativeClassifier::classifyBatch(const cv::Mat *images, int n, nnResult *results) {
+		prepareInputs(images, n);
+		float output[NN_MAX_BATCH * 3];
+		m_net.forwardBatch(m_input, n, output);
+		storeResults(output, n, results);
+	}
+
+	QuantizedClassifier::QuantizedClassifier(const std::string &path, const std::string &calibration_path) :
+		NativeClassifier(path)
+	{
+		NN::Calibration calibration;
+		calibration.load(calibration_path);
+		m_qnet.load(m_net, calibration);
+	}
+
+	void QuantizedClassifier::classifyBatch(const cv::Mat *images, int n, nnResult *results) {
+		prepareInputs(images, n);
+		float output[NN_MAX_BATCH * 3];
+		m_qnet.forwardBatch(m_input, n, output);
+		storeResults(output, n, results);
+	}
+
+	CompareClassifier::CompareClassifier(const std::string &path) : m_native(path) {}
+
+	void CompareClassifier::classifyBatch(const cv::Mat *images, int n, nnResult *results) {
+		nnResult lua_results[NN_MAX_BATCH];
+		m_lua.classifyBatch(images, n, lua_results);
+		m_native.classifyBatch(images, n, results);
+
+		for (int i = 0 ; i < n ; ++i) {
+			m_max_diff = std::max(m_max_diff, std::fabs(lua_results[i].empty_prob - results[i].empty_prob));
+			m_max_diff = std::max(m_max_diff, std::fabs(lua_results[i].asian_prob - results[i].asian_prob));
+			m_max_diff = std::max(m_max_diff, std::fabs(lua_results[i].european_prob - results[i].european_prob));
+
+			if (++m_frames % COMPARE_REPORT_FRAMES == 0) {
+				std::cerr << "Native engine: largest probability difference with Torch over "
+					<< m_frames << " frames: " << m_max_diff
+					<< ((m_max_diff <= NN_TOLERANCE) ? " (within tolerance)" : " (OUT OF TOLERANCE)")
+					<< std::endl;
+			}
+		}
+	}
+
+	Classifier* createClassifier() {
+		std::string engine = Conf::getString("NN_ENGINE", "native");
+		std::string path = Conf::getString("NN_WEIGHTS", NN_WEIGHTS_PATH);
+
+		if (engine == "torch")
+			return new LuaClassifier();
+		else if (engine == "compare")
+			return new CompareClassifier(path);
+		else if (engine == "native")
+			return new NativeClassifier(path);
+		else if (engine == "int8")
+			return new QuantizedClassifier(path, Conf::getString("NN_CALIBRATION", NN_CALIBRATION_PATH));
+		throw Conf::ConfException("NN_ENGINE");
+	}
+
+	template<typename T>
+	static void imageToInputT(const cv::Mat &src, T *dst) {
+		const int plane_size = DB_RESIZED_IMAGE_HEIGHT * DB_RESIZED_IMAGE_WIDTH;
+		T *r = dst, *g = dst + plane_size, *b = dst + 2 * plane_size;
+
+		for (int y = 0 ; y < DB_RESIZED_IMAGE_HEIGHT ; ++y) {
+			const unsigned char *row = src.ptr<unsigned char>(y);
+			for (int x = 0 ; x < DB_RESIZED_IMAGE_WIDTH ; ++x) {
+				*b++ = row[3 * x] / (T) 255;
+				*g++ = row[3 * x + 1] / (T) 255;
+				*r++ = row[3 * x + 2] / (T) 255;
+			}
+		}
+	}
+
+	void imageToInput(const cv::Mat &src, double *dst) {
+		imageToInputT(src, dst);
+	}
+
+	void imageToInput(const cv::Mat &src, float *dst) {
+		imageToInputT(src, dst);
+	}
+}
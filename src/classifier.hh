@@ -0,0 +1,131 @@
+#pragma once
+
+#include <exception>
+#include <string>
+#include <cstdio>
+#include <cxcore.hpp>
+#include <lua.hpp>
+
+#include "nn.hh"
+
+#define DB_RESIZED_IMAGE_WIDTH 32
+#define DB_RESIZED_IMAGE_HEIGHT 16
+#define DB_RESIZED_IMAGE_SIZE (3 * DB_RESIZED_IMAGE_WIDTH * DB_RESIZED_IMAGE_HEIGHT)
+// Maximal number of images classified in a single forward pass
+#define NN_MAX_BATCH 16
+
+namespace Image {
+	struct LuaException : public std::exception {
+		LuaException(int errcode, std::string p_msg = "") : err(errcode), msg(p_msg) {}
+
+		const char* what() const noexcept {
+			static char ret[1000];
+			switch (err) {
+			case LUA_ERRSYNTAX:
+				return "Lua error: syntax error";
+			case LUA_ERRMEM:
+				return "Lua error: not enough memory.";
+			case LUA_ERRRUN:
+				snprintf(ret, 1000, "Lua error: runtime error: %s", msg.c_str());
+				return ret;
+			case LUA_ERRERR:
+				return "Lua error: error while running the message handler.";
+			case LUA_ERRFILE:
+				return "Lua error: file error.";
+			default:
+				snprintf(ret, 1000, "Lua error: unknown error: %d", err);
+				return ret;
+			}
+		}
+
+		int err;
+		std::string msg;
+	};
+
+	// This struct is shared with the Lua classifier through the LuaJIT FFI
+	// (see torchnn/test.lua), keep both declarations in sync.
+	struct nnResult {
+		double empty_prob;
+		double asian_prob;
+		double european_prob;
+	};
+
+	// A classifier computes the category probabilities of an image resized
+	// by resizeImageForDB. Classifiers are not thread-safe.
+	class Classifier {
+	public:
+		virtual ~Classifier() {}
+		virtual nnResult classify(const cv::Mat &image);
+		// Classifies n images (at most NN_MAX_BATCH) in a single forward pass
+		virtual void classifyBatch(const cv::Mat *images, int n, nnResult *results) = 0;
+	};
+
+	// Runs torchnn/test.lua in a Lua coroutine (LuaJIT + Torch)
+	class LuaClassifier : public Classifier {
+	public:
+		LuaClassifier();
+		~LuaClassifier();
+		virtual void classifyBatch(const cv::Mat *images, int n, nnResult *results);
+
+	private:
+		lua_State *L = NULL;
+		lua_State *m_thread_state = NULL;
+
+		// Buffers shared with the Lua coroutine: the input is wrapped by a
+		// Torch tensor and the script writes its results directly into
+		// m_results.
+		double m_input[NN_MAX_BATCH * DB_RESIZED_IMAGE_SIZE];
+		nnResult m_results[NN_MAX_BATCH];
+	};
+
+	// Runs the network exported by torchnn/export.lua with the native engine
+	class NativeClassifier : public Classifier {
+	public:
+		NativeClassifier(const std::string &path);
+		virtual void classifyBatch(const cv::Mat *images, int n, nnResult *results);
+
+	protected:
+		// Normalized inputs of the network
+		void prepareInputs(const cv::Mat *images, int n);
+		void storeResults(const float *outputs, int n, nnResult *results);
+
+		NN::Network m_net;
+		float m_input[NN_MAX_BATCH * DB_RESIZED_IMAGE_SIZE];
+		// Offsets of the network outputs in nnResult
+		double nnResult::*m_fields[3];
+	};
+
+	// Runs the network quantised to 8 bits with the activation ranges
+	// measured by vespid-calibrate
+	class QuantizedClassifier : public NativeClassifier {
+	public:
+		QuantizedClassifier(const std::string &path, const std::string &calibration_path);
+		virtual void classifyBatch(const cv::Mat *images, int n, nnResult *results);
+
+	private:
+		NN::QuantizedNetwork m_qnet;
+	};
+
+	// Runs both classifiers, returns the native results and reports the
+	// largest difference between them.
+	class CompareClassifier : public Classifier {
+	public:
+		CompareClassifier(const std::string &path);
+		virtual void classifyBatch(const cv::Mat *images, int n, nnResult *results);
+
+	private:
+		LuaClassifier m_lua;
+		NativeClassifier m_native;
+		double m_max_diff = 0;
+		unsigned long m_frames = 0;
+	};
+
+	// Creates the classifier selected by the NN_ENGINE environment variable
+	// ("native" by default, "int8", "torch" or "compare").
+	Classifier* createClassifier();
+
+	// Converts a BGR image resized with resizeImageForDB to the planar RGB
+	// layout expected by the network, with values between 0 and 1.
+	void imageToInput(const cv::Mat &src, double *dst);
+	void imageToInput(const cv::Mat &src, float *dst);
+}
@@ -0,0 +1,129 @@
+#include <string>
+#include <ostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cxcore.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "dataset.hh"
+#include "classifier.hh"
+
+namespace Dataset {
+	static const char *category_names[DATASET_CATEGORIES] = {"empty", "asian", "european"};
+	static double Image::nnResult::*category_fields[DATASET_CATEGORIES] = {
+		&Image::nnResult::empty_prob,
+		&Image::nnResult::asian_prob,
+		&Image::nnResult::european_prob
+	};
+
+	const char* getCategoryName(int category) {
+		return category_names[category];
+	}
+
+	int getCategory(const std::string &name) {
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i)
+			if (name == category_names[i])
+				return i;
+		return -1;
+	}
+
+	double getProb(const Image::nnResult &result, int category) {
+		return result.*category_fields[category];
+	}
+
+	int getPrediction(const Image::nnResult &result) {
+		int best = 0;
+		for (int i = 1 ; i < DATASET_CATEGORIES ; ++i)
+			if (getProb(result, i) > getProb(result, best))
+				best = i;
+		return best;
+	}
+
+	bool isDirectory(const std::string &path) {
+		struct stat st;
+		return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+	}
+
+	// Images are sorted by number, as in the replay source
+	static bool compareFileNames(const std::string &a, const std::string &b) {
+		long na = strtol(a.c_str(), NULL, 10), nb = strtol(b.c_str(), NULL, 10);
+		if (na != nb)
+			return na < nb;
+		return a < b;
+	}
+
+	std::vector<Sample> list(const std::string &dir) {
+		if (!isDirectory(dir))
+			throw DatasetException(dir + " is not a directory");
+
+		std::vector<Sample> samples;
+		for (int category = 0 ; category < DATASET_CATEGORIES ; ++category) {
+			std::string path = dir + "/" + category_names[category];
+			DIR *dpdf = opendir(path.c_str());
+			if (dpdf == NULL)
+				continue;
+
+			struct dirent *epdf;
+			std::vector<std::string> names;
+			while ((epdf = readdir(dpdf))) {
+				if (epdf->d_name[0] != '.')
+					names.push_back(epdf->d_name);
+			}
+			closedir(dpdf);
+
+			std::sort(names.begin(), names.end(), compareFileNames);
+			for (auto it = names.begin() ; it != names.end() ; ++it)
+				samples.push_back({path + "/" + *it, category});
+		}
+
+		return samples;
+	}
+
+	cv::Mat load(const Sample &sample) {
+		cv::Mat image = cv::imread(sample.path);
+		if (image.empty())
+			throw DatasetException("failed to read " + sample.path);
+		if (image.rows != DB_RESIZED_IMAGE_HEIGHT || image.cols != DB_RESIZED_IMAGE_WIDTH)
+			throw DatasetException(sample.path + " is not a database image");
+		return image;
+	}
+
+	void Accuracy::add(int truth, int prediction, double prob) {
+		total[truth]++;
+		if (prediction != truth)
+			return;
+		correct[truth]++;
+		prob_sum[truth] += prob;
+		prob_min[truth] = std::min(prob_min[truth], prob);
+	}
+
+	// Mean and min confidence are 0 without correct predictions
+	static void printLine(std::ostream &out, const char *name, unsigned long correct, unsigned long total,
+			double prob_sum, double prob_min) {
+		out << name << ": " << correct << " correct out of " << total << " (" << correct * 100.0 / total
+			<< "%). Mean confidence " << ((correct > 0) ? prob_sum / correct * 100 : 0) << "%, min "
+			<< ((correct > 0) ? prob_min * 100 : 0) << "%" << std::endl;
+	}
+
+	void Accuracy::print(std::ostream &out) const {
+		unsigned long all_correct = 0, all_total = 0;
+		double all_prob_sum = 0, all_prob_min = 1;
+		out << std::fixed << std::setprecision(6);
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i) {
+			if (total[i] == 0)
+				continue;
+			printLine(out, category_names[i], correct[i], total[i], prob_sum[i], prob_min[i]);
+			all_correct += correct[i];
+			all_total += total[i];
+			all_prob_sum += prob_sum[i];
+			if (correct[i] > 0)
+				all_prob_min = std::min(all_prob_min, prob_min[i]);
+		}
+		if (all_total > 0)
+			printLine(out, "Total", all_correct, all_total, all_prob_sum, all_prob_min);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <exception>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <ostream>
+#include <cxcore.hpp>
+
+#include "classifier.hh"
+
+// Number of categories of the classifier
+#define DATASET_CATEGORIES 3
+
+// Datasets are directories with a subdirectory per category (`empty`, `asian`
+// and `european`) containing the images saved in capture mode (see
+// captureToDb), numbered from 1.
+namespace Dataset {
+	struct DatasetException : public std::exception {
+		DatasetException(std::string p_msg) : msg(p_msg) {}
+		const char* what() const noexcept {
+			static char ret[300];
+			snprintf(ret, 300, "Dataset error: %s", msg.c_str());
+			return ret;
+		}
+
+		std::string msg;
+	};
+
+	struct Sample {
+		std::string path;
+		// Index in getCategoryName order
+		int category;
+	};
+
+	const char* getCategoryName(int category);
+	// Returns -1 if name is not a category
+	int getCategory(const std::string &name);
+	double getProb(const Image::nnResult &result, int category);
+	// Most probable category
+	int getPrediction(const Image::nnResult &result);
+
+	bool isDirectory(const std::string &path);
+	// Images of all the categories of dir, by category and number. Missing
+	// category directories are skipped.
+	std::vector<Sample> list(const std::string &dir);
+	// Reads an image saved by captureToDb, throws DatasetException if it is
+	// not a BGR image of the classifier input size.
+	cv::Mat load(const Sample &sample);
+
+	// Accuracy of a classifier on labelled images
+	struct Accuracy {
+		unsigned long correct[DATASET_CATEGORIES] = {0};
+		unsigned long total[DATASET_CATEGORIES] = {0};
+		// Probability of the true category of the correct predictions
+		double prob_sum[DATASET_CATEGORIES] = {0};
+		double prob_min[DATASET_CATEGORIES] = {1, 1, 1};
+
+		// prob: probability of the predicted category
+		void add(int truth, int prediction, double prob);
+		// Prints the results as torchnn/train.lua does, nothing if there
+		// is no image.
+		void print(std::ostream &out) const;
+	};
+}
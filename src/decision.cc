@@ -0,0 +1,118 @@
+#include <cmath>
+#include <algorithm>
+
+#include "decision.hh"
+#include "classifier.hh"
+#include "util.hh"
+
+// Bounds of the asian probability of a frame, the log-likelihood ratio of
+// a frame is at most log(0.99 / 0.01) = 4.6, below the default upper bound
+// log(0.95 / 0.005) = 5.2.
+#define DECISION_PROB_FLOOR 0.01
+
+namespace Decision {
+	Settings getConfSettings() {
+		Settings settings;
+		settings.alpha = Conf::getDouble("DECISION_ALPHA", settings.alpha);
+		settings.beta = Conf::getDouble("DECISION_BETA", settings.beta);
+		long frames = Conf::getInt("DECISION_FRAMES", settings.max_frames);
+		settings.min_prob = Conf::getDouble("MIN_PROB", settings.min_prob);
+
+		if (settings.alpha <= 0 || settings.alpha >= 0.5)
+			throw Conf::ConfException("DECISION_ALPHA");
+		if (settings.beta <= 0 || settings.beta >= 0.5)
+			throw Conf::ConfException("DECISION_BETA");
+		if (frames < 1 || frames > NN_MAX_BATCH)
+			throw Conf::ConfException("DECISION_FRAMES");
+		settings.max_frames = frames;
+		return settings;
+	}
+
+	ResultWindow::ResultWindow() {
+		clear();
+	}
+
+	void ResultWindow::clear() {
+		m_first = m_size = 0;
+		m_count = 0;
+		m_sum = m_ema = {0, 0, 0};
+		m_log_odds = 0;
+		m_last_nonempty_us = 0;
+	}
+
+	void ResultWindow::push(const Image::nnResult &result, uint64_t time_us) {
+		// A frame without a hornet (just after the laser break, or with
+		// the hornet out of view) is no evidence either way.
+		const bool nonempty = result.empty_prob < result.asian_prob || result.empty_prob < result.european_prob;
+		double log_odds = 0;
+		if (nonempty) {
+			double p = std::min(std::max(result.asian_prob, DECISION_PROB_FLOOR), 1 - DECISION_PROB_FLOOR);
+			log_odds = std::log(p / (1 - p));
+		}
+
+		unsigned int index;
+		if (m_size < RESULT_WINDOW_SIZE) {
+			index = (m_first + m_size++) % RESULT_WINDOW_SIZE;
+		} else {
+			// Evict the oldest result
+			index = m_first;
+			m_first = (m_first + 1) % RESULT_WINDOW_SIZE;
+			m_sum.empty_prob -= m_results[index].empty_prob;
+			m_sum.asian_prob -= m_results[index].asian_prob;
+			m_sum.european_prob -= m_results[index].european_prob;
+			m_log_odds -= m_result_log_odds[index];
+		}
+
+		m_results[index] = result;
+		m_result_log_odds[index] = log_odds;
+		m_sum.empty_prob += result.empty_prob;
+		m_sum.asian_prob += result.asian_prob;
+		m_sum.european_prob += result.european_prob;
+		m_log_odds += log_odds;
+
+		if (m_count++ == 0) {
+			m_ema = result;
+		} else {
+			const double w = RESULT_WINDOW_EMA_WEIGHT;
+			m_ema.empty_prob += w * (result.empty_prob - m_ema.empty_prob);
+			m_ema.asian_prob += w * (result.asian_prob - m_ema.asian_prob);
+			m_ema.european_prob += w * (result.european_prob - m_ema.european_prob);
+		}
+
+		if (nonempty)
+			m_last_nonempty_us = time_us;
+	}
+
+	const Image::nnResult& ResultWindow::get(unsigned int i) const {
+		return m_results[(m_first + i) % RESULT_WINDOW_SIZE];
+	}
+
+	Image::nnResult ResultWindow::getMean() const {
+		Image::nnResult mean = {0, 0, 0};
+		if (m_size > 0) {
+			mean.empty_prob = m_sum.empty_prob / m_size;
+			mean.asian_prob = m_sum.asian_prob / m_size;
+			mean.european_prob = m_sum.european_prob / m_size;
+		}
+		return mean;
+	}
+
+	SPRT::SPRT(const Settings &settings) : m_settings(settings) {
+		m_upper = std::log((1 - settings.beta) / settings.alpha);
+		m_lower = std::log(settings.beta / (1 - settings.alpha));
+	}
+
+	outcome SPRT::evaluate(const ResultWindow &window) const {
+		if (window.getCount() == 0)
+			return UNDECIDED;
+
+		double llr = window.getAsianLogOdds();
+		if (llr >= m_upper)
+			return ASIAN;
+		if (llr <= m_lower)
+			return NOT_ASIAN;
+		if (window.getCount() >= m_settings.max_frames)
+			return (window.getMean().asian_prob > m_settings.min_prob) ? ASIAN : NOT_ASIAN;
+		return UNDECIDED;
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+
+#include "classifier.hh"
+
+// Capacity of the result windows, enough for the frames of a decision
+#define RESULT_WINDOW_SIZE NN_MAX_BATCH
+// Weight of the newest result in the moving averages of the result windows
+#define RESULT_WINDOW_EMA_WEIGHT 0.3
+
+namespace Decision {
+	enum outcome { UNDECIDED, ASIAN, NOT_ASIAN };
+
+	struct Settings {
+		// Error bounds: probability to decide ASIAN for a hornet which is
+		// not asian (it gets killed), and to decide NOT_ASIAN for an asian
+		// one.
+		double alpha = 0.005;
+		double beta = 0.05;
+		// Frames after which the decision is forced (at most NN_MAX_BATCH)
+		unsigned int max_frames = 5;
+		// Forced decisions: minimal average asian probability
+		double min_prob = 0.7;
+	};
+
+	// Settings given by DECISION_ALPHA, DECISION_BETA, DECISION_FRAMES
+	// and MIN_PROB
+	Settings getConfSettings();
+
+	// Fixed-capacity ring of the last results and their reception times.
+	// The statistics over the window are updated incrementally on each push;
+	// nothing is allocated.
+	class ResultWindow {
+	public:
+		ResultWindow();
+		void clear();
+		void push(const Image::nnResult &result, uint64_t time_us);
+
+		// Results in the window, at most RESULT_WINDOW_SIZE
+		unsigned int getSize() const { return m_size; }
+		// Results pushed since clear()
+		unsigned long getCount() const { return m_count; }
+		// i = 0 is the oldest result of the window
+		const Image::nnResult& get(unsigned int i) const;
+		// Over the window
+		Image::nnResult getMean() const;
+		// Sum of the log odds of the asian probabilities, clamped to
+		// [0.01, 0.99], of the results whose most probable category is not
+		// empty
+		double getAsianLogOdds() const { return m_log_odds; }
+		// Exponential moving average since clear()
+		Image::nnResult getEMA() const { return m_ema; }
+		// Reception time of the last result whose most probable category
+		// is not empty, 0 if there is none since clear()
+		uint64_t getLastNonEmptyTime() const { return m_last_nonempty_us; }
+
+	private:
+		Image::nnResult m_results[RESULT_WINDOW_SIZE];
+		double m_result_log_odds[RESULT_WINDOW_SIZE];
+		// Index of the oldest result
+		unsigned int m_first = 0;
+		unsigned int m_size = 0;
+		unsigned long m_count = 0;
+		Image::nnResult m_sum, m_ema;
+		double m_log_odds = 0;
+		uint64_t m_last_nonempty_us = 0;
+	};
+
+	// Wald's sequential probability ratio test between "the hornet is asian"
+	// and "it is not". The classifier probabilities are taken as posteriors
+	// with equal priors, so the log-likelihood ratio is the sum of the log
+	// odds of the asian probabilities kept by the window (with the default
+	// bounds, a single frame can't decide that a hornet is asian). Empty
+	// frames don't count in the ratio, only towards max_frames. The test
+	// stops as soon as the ratio crosses log((1 - beta) / alpha) or
+	// log(beta / (1 - alpha)); after max_frames frames, the average asian
+	// probability is compared with min_prob.
+	class SPRT {
+	public:
+		SPRT(const Settings &settings);
+		// window: the results of the frames since the laser break, in
+		// order (the window is large enough for max_frames results)
+		outcome evaluate(const ResultWindow &window) const;
+		unsigned int getMaxFrames() const { return m_settings.max_frames; }
+
+	private:
+		Settings m_settings;
+		double m_upper, m_lower;
+	};
+}
@@ -1,26 +1,30 @@
+#include <algorithm>
 #include <SDL_mutex.h>
 #include <pigpiod_if2.h>
 
 #include "gpio.hh"
 #include "image.hh"
+#include "metrics.hh"
+#include "trace.hh"
 #include "util.hh"
 
-// The number of times the GPIO thread should run per second
+// The number of times the GPIO thread should run per second in active mode
 // The GPIO thread must run faster than all other threads.
 // (It is very lightweight so that shouldn't be a problem)
+// In waiting mode, it sleeps until a laser edge occurs.
 #define GPIO_FREQUENCY 50
+// Maximal sleeping time in waiting mode, in milliseconds
+#define GPIO_IDLE_TIMEOUT 1000
 
 namespace GPIO {
-	GPIO::GPIO(Image::NNManager *nn_manager) {
+	GPIO::GPIO(Image::NNManager *nn_manager) : m_thread(Decision::getConfSettings()) {
 		m_thread.nn_manager = nn_manager;
 		m_thread.laser_pin = Conf::getInt("LASER_RECEPTOR_PIN");
 		m_thread.servo_pin = Conf::getInt("SERVO_PIN");
 		m_thread.servo_death = Conf::getInt("SERVO_DEATH");
 		m_thread.servo_life = Conf::getInt("SERVO_LIFE");
 		m_thread.delay_empty = Conf::getInt("EMPTY_DELAY", 2000);
-		m_thread.min_prob = Conf::getDouble("MIN_PROB", 0.7);
 
-		m_thread.setFrequency(GPIO_FREQUENCY);
 		m_thread.launch("GPIOThread");
 	}
 
@@ -42,15 +46,24 @@ namespace GPIO {
 
 	void GPIOThread::construct() {
 		mutex = SDL_CreateMutex();
+		wake_sem = SDL_CreateSemaphore(0);
 	}
 
 	GPIOThread::~GPIOThread() {
 		destruct();
 
+		if (wake_sem != NULL)
+			SDL_DestroySemaphore(wake_sem);
 		if (mutex != NULL)
 			SDL_DestroyMutex(mutex);
 	}
 
+	void GPIOThread::wake() {
+		// Don't wait for the idle timeout to stop the thread
+		if (wake_sem != NULL)
+			SDL_SemPost(wake_sem);
+	}
+
 	void GPIOThread::onStart() {
 		if ((gpio_pi = pigpio_start(NULL, NULL)) < 0)
 			throw GPIOException();
@@ -60,31 +73,135 @@ namespace GPIO {
 			throw GPIOException();
 		if (set_servo_pulsewidth(gpio_pi, servo_pin, servo_life) != 0)
 			throw GPIOException();
+
+		int level = gpio_read(gpio_pi, laser_pin);
+		if (level < 0)
+			throw GPIOException();
+		laser_level = level;
+		calibrateTicks();
+		if ((laser_callback = callback_ex(gpio_pi, laser_pin, EITHER_EDGE, laserCallback, this)) < 0)
+			throw GPIOException();
 	}
 
 	void GPIOThread::onEnd() {
+		// Cancel the pending batch request
+		if (active && stage == STAGE_DECISION)
+			image_processor.stop();
+
+		if (laser_callback >= 0)
+			callback_cancel(laser_callback);
 		if (gpio_pi >= 0)
 			pigpio_stop(gpio_pi);
 	}
 
+	void GPIOThread::laserCallback(int pi, unsigned int gpio, unsigned int level, uint32_t tick, void *data) {
+		// Runs in the pigpio callback thread
+		GPIOThread *thread = (GPIOThread*) data;
+		if (level == PI_TIMEOUT)
+			return;
+
+		if (level == 0) {
+			// The laser beam has been broken
+			thread->laser_break_tick = tick;
+			thread->laser_breaks++;
+		}
+		thread->laser_level = level;
+
+		if (SDL_SemValue(thread->wake_sem) == 0)
+			SDL_SemPost(thread->wake_sem);
+	}
+
+	void GPIOThread::calibrateTicks() {
+		calib_tick = get_current_tick(gpio_pi);
+		calib_us = Time::getMicros();
+	}
+
+	uint64_t GPIOThread::tickToMicros(uint32_t tick) {
+		// Ticks wrap around every 72 minutes, the difference with the
+		// calibration tick is only valid if it is recent enough.
+		return calib_us + (int32_t) (tick - calib_tick);
+	}
+
 	void GPIOThread::loop() {
+		/// Sleep until a laser edge, or the next step in active mode
+		if (SDL_SemWaitTimeout(wake_sem, active ? 1000 / GPIO_FREQUENCY : GPIO_IDLE_TIMEOUT) == SDL_MUTEX_TIMEDOUT
+				&& !active)
+			calibrateTicks();
+		Metrics::increment(Metrics::GPIO_LOOPS);
+
 		/// Retrieve laserState
+		// Breaks shorter than a loop are not missed: they are counted by
+		// the callback.
+		unsigned long breaks = laser_breaks;
+		bool laser_broken = laser_level == 0 || breaks != seen_breaks;
+		seen_breaks = breaks;
+
 		SDL_LockMutex(mutex);
-		if (!gpio_read(gpio_pi, laser_pin) || simlaser) {
+		if (laser_broken || simlaser) {
 			laser_state = LASER_ON;
-			active = true;
+			if (!active) {
+				active = true;
+				break_us = laser_broken ? tickToMicros(laser_break_tick) : simlaser_us;
+				Metrics::increment(Metrics::TRIGGERS);
+			}
 		} else {
 			laser_state = LASER_OFF;
 		}
 		SDL_UnlockMutex(mutex);
 
 		/// Active mode management
-		if (active)
+		if (active) {
+			uint64_t now = Time::getMicros();
+			if (active_loop_us != 0)
+				Trace::record(Trace::STAGE_GPIO_PERIOD, now - active_loop_us);
+			active_loop_us = now;
 			activeLoop();
+		} else {
+			active_loop_us = 0;
+		}
 	}
 
 	void GPIOThread::activeLoop() {
-		if (empty_timer != NULL) {
+		switch (stage) {
+		case STAGE_START:
+			// First run, start image processing stage
+			image_processor.start(nn_manager, break_us);
+			stage = STAGE_DECISION;
+			break;
+
+		case STAGE_DECISION: {
+			// Image processing stage:
+			// Feed the results to the decision test until it decides
+			image_processor.step();
+			Decision::outcome outcome = image_processor.getOutcome();
+			if (outcome == Decision::UNDECIDED)
+				break;
+
+			const Image::nnBatch &batch = image_processor.getBatch();
+			unsigned int n = image_processor.getProcessedNumber();
+			uint64_t now = Time::getMicros();
+			// break_us is converted from a pigpio tick and may be slightly ahead
+			Trace::record(Trace::STAGE_BREAK_TO_DECISION, (now > break_us) ? now - break_us : 0);
+			Trace::record(Trace::STAGE_CAPTURE_TO_DECISION, now - batch.frames[0].capture_us);
+			Trace::recordDecision(batch.frames[0], batch.frames[n - 1], now);
+			Metrics::observe((outcome == Decision::ASIAN) ? Metrics::DECISION_ASIAN : Metrics::DECISION_NOT_ASIAN,
+				image_processor.getMeanAsianProb());
+			image_processor.stop();
+
+			if (outcome == Decision::ASIAN) {
+				// Start empty timer stage
+				setServo(SERVO_DEATH);
+				empty_timer.start(nn_manager);
+				stage = STAGE_EMPTY_TIMER;
+			} else {
+				// Unvalidated.
+				active = false;
+				stage = STAGE_START;
+			}
+			break;
+		}
+
+		case STAGE_EMPTY_TIMER:
 			// Empty timer stage:
 			// If all images are empty for 2 seconds, switch back
 			// to waiting mode.
@@ -94,42 +211,22 @@ namespace GPIO {
 			// This is enforced by the absence of public method to change
 			// these values.
 			if (laser_state == LASER_ON)
-				empty_timer->reset();
+				empty_timer.reset();
 
-			empty_timer->step();
-			if (empty_timer->getEmptyTime() >= delay_empty) {
+			empty_timer.step();
+			if (empty_timer.getEmptyTime() >= delay_empty) {
 				setServo(SERVO_LIFE);
 				active = false;
-				delete empty_timer;
-				empty_timer = NULL;
-			}
-		} else if (image_processor != NULL) {
-			// Image processing stage:
-			// Analyse five images and check the average results
-			image_processor->step();
-			if (image_processor->getProcessedNumber() >= 5) {
-				Image::nnResult result;
-				result = image_processor->getAverageResult();
-				delete image_processor;
-				image_processor = NULL;
-
-				if (result.asian_prob > min_prob) {
-					// Start empty timer stage
-					setServo(SERVO_DEATH);
-					empty_timer = new EmptyTimer(nn_manager);
-				} else {
-					// Unvalidated.
-					active = false;
-				}
+				stage = STAGE_START;
 			}
-		} else {
-			// First run, stat image processing stage
-			image_processor = new ImageProcessor(nn_manager);
+			break;
 		}
 	}
 
 	void GPIOThread::setServo(servoState p_servo_state) {
+		uint64_t start_us = Time::getMicros();
 		set_servo_pulsewidth(gpio_pi, servo_pin, (p_servo_state == SERVO_LIFE) ? servo_life : servo_death);
+		Trace::record(Trace::STAGE_SERVO_COMMAND, Time::getMicros() - start_us);
 		SDL_LockMutex(mutex);
 		servo_state = p_servo_state;
 		SDL_UnlockMutex(mutex);
@@ -153,62 +250,64 @@ namespace GPIO {
 
 	void GPIOThread::simLaserOn() {
 		SDL_LockMutex(mutex);
+		if (!simlaser)
+			simlaser_us = Time::getMicros();
 		simlaser = true;
 		SDL_UnlockMutex(mutex);
+		SDL_SemPost(wake_sem);
 	}
 
 	void GPIOThread::simLaserOff() {
 		SDL_LockMutex(mutex);
 		simlaser = false;
 		SDL_UnlockMutex(mutex);
+		SDL_SemPost(wake_sem);
 	}
 
-	ImageProcessor::ImageProcessor(Image::NNManager *nn_manager) {
+	void ImageProcessor::start(Image::NNManager *nn_manager, uint64_t since_us) {
 		m_nn_manager = nn_manager;
+		m_batch.n = 0;
+		m_window.clear();
+		m_outcome = Decision::UNDECIDED;
+		m_nn_manager->requestBatch(m_test.getMaxFrames(), since_us);
 	}
 
-	void ImageProcessor::step() {
-		if (m_nn_manager->newResult(RESULTS_CLASER_ONSUMER_GPIO_ID))
-			m_results.push_back(m_nn_manager->getResult(RESULTS_CLASER_ONSUMER_GPIO_ID));
+	void ImageProcessor::stop() {
+		// The request is still pending after an early decision
+		m_nn_manager->cancelBatch();
 	}
 
-	unsigned int ImageProcessor::getProcessedNumber() {
-		return m_results.size();
-	}
-
-	Image::nnResult ImageProcessor::getAverageResult() {
-		Image::nnResult sum = {0, 0, 0};
-
-		for (std::vector<Image::nnResult>::iterator it = m_results.begin() ; it != m_results.end() ; ++it) {
-			sum.asian_prob += it->asian_prob;
-			sum.european_prob += it->european_prob;
-			sum.empty_prob += it->empty_prob;
+	void ImageProcessor::step() {
+		if (m_outcome != Decision::UNDECIDED || !m_nn_manager->newBatch())
+			return;
+
+		uint64_t now = Time::getMicros();
+		m_batch = m_nn_manager->getBatch();
+		Trace::record(Trace::STAGE_RESULT_TO_GPIO, now - m_batch.published_us);
+		for (unsigned int i = m_window.getCount() ; i < m_batch.n ; ++i) {
+			m_window.push(m_batch.results[i], now);
+			if ((m_outcome = m_test.evaluate(m_window)) != Decision::UNDECIDED)
+				break;
 		}
-
-		sum.asian_prob /= (double) m_results.size();
-		sum.european_prob /= (double) m_results.size();
-		sum.empty_prob /= (double) m_results.size();
-		return sum;
 	}
 
-	EmptyTimer::EmptyTimer(Image::NNManager *nn_manager) {
+	void EmptyTimer::start(Image::NNManager *nn_manager) {
 		m_nn_manager = nn_manager;
-		m_start_ticks = Time::getTicks();
+		m_window.clear();
+		reset();
 	}
 
 	void EmptyTimer::step() {
-		if (m_nn_manager->newResult(RESULTS_CLASER_ONSUMER_GPIO_ID)) {
-			Image::nnResult result = m_nn_manager->getResult(RESULTS_CLASER_ONSUMER_GPIO_ID);
-			if (result.empty_prob < result.asian_prob || result.empty_prob < result.european_prob)
-				reset();
-		}
+		if (m_nn_manager->newResult(RESULTS_CLASER_ONSUMER_GPIO_ID))
+			m_window.push(m_nn_manager->getResult(RESULTS_CLASER_ONSUMER_GPIO_ID), Time::getMicros());
 	}
 
 	void EmptyTimer::reset() {
-		m_start_ticks = Time::getTicks();
+		m_start_us = Time::getMicros();
 	}
 
 	int EmptyTimer::getEmptyTime() {
-		return Time::getTicks() - m_start_ticks;
+		uint64_t since = std::max(m_start_us, m_window.getLastNonEmptyTime());
+		return (Time::getMicros() - since) / 1000;
 	}
 }
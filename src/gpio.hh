@@ -2,11 +2,15 @@
 
 #include <exception>
 #include <vector>
+#include <atomic>
+#include <cstdint>
 #include <SDL_thread.h>
 #include <SDL_mutex.h>
 #include <cxcore.hpp>
 
+#include "decision.hh"
 #include "image.hh"
+#include "trace.hh"
 
 namespace GPIO {
 	// The special NLASER_ONE value is used by the GUI
@@ -19,34 +23,54 @@ namespace GPIO {
 		}
 	};
 
+	// Decision stage: requests the classification of the frames following
+	// a laser break and decides on their results as they arrive.
 	class ImageProcessor {
 	public:
-		ImageProcessor(Image::NNManager *nn_manager);
+		ImageProcessor(const Decision::Settings &settings) : m_test(settings) {}
+		// Only frames captured after since_us (see Time::getMicros) are
+		// classified.
+		void start(Image::NNManager *nn_manager, uint64_t since_us);
+		// Cancels the request if it is still pending
+		void stop();
 		void step();
-		unsigned int getProcessedNumber();
-		Image::nnResult getAverageResult();
+		Decision::outcome getOutcome() { return m_outcome; }
+		// Frames the decision is based on
+		unsigned int getProcessedNumber() { return m_window.getCount(); }
+		// Mean asian probability over the decision window
+		double getMeanAsianProb() { return m_window.getMean().asian_prob; }
+		const Image::nnBatch& getBatch() { return m_batch; }
 	private:
-		Image::NNManager *m_nn_manager;
-		std::vector<Image::nnResult> m_results;
+		Image::NNManager *m_nn_manager = NULL;
+		Image::nnBatch m_batch;
+		Decision::ResultWindow m_window;
+		Decision::SPRT m_test;
+		Decision::outcome m_outcome = Decision::UNDECIDED;
 	};
 
+	// Empty timer stage: measures the time since the last result which was
+	// not empty (or since the last reset).
 	class EmptyTimer {
 	public:
-		EmptyTimer(Image::NNManager *nn_manager);
+		void start(Image::NNManager *nn_manager);
 		void step();
+		// In milliseconds
 		int getEmptyTime();
 		void reset();
 	private:
-		unsigned int m_start_ticks;
-		Image::NNManager *m_nn_manager;
+		uint64_t m_start_us = 0;
+		Image::NNManager *m_nn_manager = NULL;
+		Decision::ResultWindow m_window;
 	};
 
 	class GPIOThread : public Thread::ThreadBase {
 	public:
+		GPIOThread(const Decision::Settings &settings) : decision(settings), image_processor(settings) {}
 		virtual void onStart();
 		virtual void onEnd();
 		virtual void loop();
 		virtual void construct();
+		virtual void wake();
 		~GPIOThread();
 
 		servoState getServoState();
@@ -60,7 +84,7 @@ namespace GPIO {
 		long servo_death;
 		long servo_life;
 		long delay_empty;
-		double min_prob;
+		const Decision::Settings decision;
 
 		// NNManager object
 		Image::NNManager *nn_manager;
@@ -68,16 +92,42 @@ namespace GPIO {
 	private:
 		void activeLoop();
 		void setServo(servoState servo_satte);
+		void calibrateTicks();
+		uint64_t tickToMicros(uint32_t tick);
+		static void laserCallback(int pi, unsigned int gpio, unsigned int level, uint32_t tick, void *data);
 
 		// Information passing with main thread
 		SDL_mutex *mutex = NULL;
 		servoState servo_state = SERVO_LIFE;
 		laserState laser_state = LASER_OFF;
 		bool simlaser = false;
-
+		uint64_t simlaser_us = 0;
+
+		// Information passing with the pigpio callback thread. The
+		// semaphore wakes the GPIO thread up on each edge.
+		SDL_sem *wake_sem = NULL;
+		std::atomic<unsigned int> laser_level{1};
+		std::atomic<unsigned long> laser_breaks{0};
+		std::atomic<uint32_t> laser_break_tick{0};
+		int laser_callback = -1;
+
+		// Correspondence between pigpio ticks and Time::getMicros()
+		uint32_t calib_tick = 0;
+		uint64_t calib_us = 0;
+
+		// Active mode stages, the objects are reused (the GPIO thread does
+		// not allocate memory)
+		enum activeStage { STAGE_START, STAGE_DECISION, STAGE_EMPTY_TIMER };
 		bool active = false;
-		ImageProcessor *image_processor = NULL;
-		EmptyTimer *empty_timer = NULL;
+		activeStage stage = STAGE_START;
+		unsigned long seen_breaks = 0;
+		// Time of the laser break which started the active mode
+		uint64_t break_us = 0;
+		// Start of the previous loop in active mode, 0 if the previous loop
+		// was idle
+		uint64_t active_loop_us = 0;
+		ImageProcessor image_processor;
+		EmptyTimer empty_timer;
 
 		int gpio_pi = -1;
 	};
@@ -1,6 +1,7 @@
 #include <string>
 #include <vector>
 #include <cstdio>
+#include <cstring>
 #include <SDL.h>
 #include <SDL_video.h>
 #include <SDL_render.h>
@@ -35,6 +36,8 @@ namespace GUI {
 		m_renderer = SDL_CreateRenderer(m_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 		if (m_renderer == NULL)
 			throw SDLException("Failed to create the renderer");
+		// The camera image is scaled by the renderer
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
 
 		m_general_textures.init(m_renderer, m_font);
 		m_normal_mode_textures.init(m_renderer, m_font);
@@ -66,8 +69,8 @@ namespace GUI {
 		// Textures are freed in destructor.
 	}
 
-	void GUI::updateImage(const cv::Mat &image) {
-		m_general_textures.image.updateFromImage(image);
+	void GUI::updateImage(const cv::Mat &image, Camera::frameFormat format) {
+		m_general_textures.image.updateFromImage(image, format);
 	}
 
 	void GUI::updateServo(GPIO::servoState servo_state) {
@@ -118,9 +121,15 @@ namespace GUI {
 				case SDLK_SPACE:
 					event.captureImage = true;
 					break;
+				case SDLK_b:
+					event.captureBurst = true;
+					break;
 				case SDLK_l:
 					event.laserOn = true;
 					break;
+				case SDLK_t:
+					event.dumpTrace = true;
+					break;
 				case SDLK_ESCAPE:
 					event.quit = true;
 					break;
@@ -142,22 +151,39 @@ namespace GUI {
 		return event;
 	}
 
-	void TextureImage::updateFromImage(const cv::Mat &image) {
-		int renderer_width, renderer_height;
-		SDL_GetRendererOutputSize(renderer, &renderer_width, &renderer_height);
-
-		cv::Mat image_resized;
-		int x_pos = 0, y_pos = 0;
+	void TextureImage::updateFromImage(const cv::Mat &image, Camera::frameFormat format) {
+		const bool yuv = (format == Camera::FRAME_YUV420);
+		const unsigned int tex_format = yuv ? SDL_PIXELFORMAT_IYUV : SDL_PIXELFORMAT_BGR24;
+		const int width = image.cols, height = yuv ? image.rows * 2 / 3 : image.rows;
 
-		Image::resizeImageForScreen(image, image_resized, renderer_width, renderer_height, x_pos, y_pos);
+		if (!isInitialized() || getWidth() != width || getHeight() != height || getFormat() != tex_format)
+			recreateEmpty(tex_format, width, height, SDL_TEXTUREACCESS_STREAMING);
 
-		if (!isInitialized()) {
-			// TODO: also recreate the texture when the screen size changes
-			setXY(x_pos, y_pos);
-			recreateEmpty(SDL_PIXELFORMAT_BGR24, image_resized.cols, image_resized.rows);
+		// The screen size may change, so the position is computed each time
+		int renderer_width, renderer_height;
+		SDL_GetRendererOutputSize(renderer, &renderer_width, &renderer_height);
+		int w, h, x_pos, y_pos;
+		Image::fitToScreen(width, height, renderer_width, renderer_height, w, h, x_pos, y_pos);
+		setXY(x_pos, y_pos);
+		setDrawSize(w, h);
+
+		if (yuv) {
+			// I420 frames are continuous: the planes follow each other as
+			// SDL expects them.
+			updateFromData((void*) image.data, width);
+			return;
 		}
 
-		updateFromData((void*) image_resized.data, image_resized.cols * 3);
+		int pitch;
+		unsigned char *pixels = (unsigned char*) lock(pitch);
+		const size_t row_size = width * 3;
+		if (image.isContinuous() && pitch == (int) row_size) {
+			memcpy(pixels, image.data, row_size * height);
+		} else {
+			for (int y = 0 ; y < height ; ++y)
+				memcpy(pixels + y * pitch, image.ptr<unsigned char>(y), row_size);
+		}
+		unlock();
 	}
 
 	TextureFreq::TextureFreq(int x, int y, TextureSet *parent_set) : Texture(x, y, parent_set) {
@@ -265,6 +291,13 @@ namespace GUI {
 	void Texture::setXY(int p_x, int p_y) {
 		x = p_x;
 		y = p_y;
+		rect.x = x;
+		rect.y = y;
+	}
+
+	void Texture::setDrawSize(int w, int h) {
+		rect.w = w;
+		rect.h = h;
 	}
 
 	void Texture::setRenderer(SDL_Renderer *p_renderer) {
@@ -299,13 +332,16 @@ namespace GUI {
 		recreateFromSurface(txt_surface);
 	}
 
-	void Texture::recreateEmpty(unsigned int format, int w, int h) {
+	void Texture::recreateEmpty(unsigned int format, int w, int h, int access) {
 		destroy();
 
-		texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STATIC, w, h);
+		texture = SDL_CreateTexture(renderer, format, access, w, h);
 		if (texture == NULL)
 			throw SDLException("Failed to create empty texture");
 
+		tex_w = w;
+		tex_h = h;
+		tex_format = format;
 		rect.w = w;
 		rect.h = h;
 		rect.x = x;
@@ -317,6 +353,17 @@ namespace GUI {
 			throw SDLException("Failed to update texture");
 	}
 
+	void* Texture::lock(int &pitch) {
+		void *pixels;
+		if (SDL_LockTexture(texture, NULL, &pixels, &pitch) < 0)
+			throw SDLException("Failed to lock texture");
+		return pixels;
+	}
+
+	void Texture::unlock() {
+		SDL_UnlockTexture(texture);
+	}
+
 	void Texture::draw() {
 		if (texture != NULL)
 			SDL_RenderCopy(renderer, texture, NULL, &rect);
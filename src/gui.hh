@@ -49,10 +49,12 @@ namespace GUI {
 	struct Event {
 		bool quit              = false;
 		bool captureImage      = false;
+		bool captureBurst      = false;
 		bool captureMode       = false;
 		// LaserOn is used to simulate a laser enabling using keyboard.
 		bool laserOn           = false;
 		bool laserOff          = false;
+		bool dumpTrace         = false;
 	};
 
 	enum captureMode { NORMAL, CAPTURE_EMPTY, CAPTURE_ASIAN, CAPTURE_EUROPEAN };
@@ -93,13 +95,24 @@ namespace GUI {
 		bool isInitialized();
 		void recreateFromText(const char *str, SDL_Color color);
 		void recreateFromSurface(SDL_Surface *surface);
-		void recreateEmpty(unsigned int format, int w, int h);
+		void recreateEmpty(unsigned int format, int w, int h, int access = SDL_TEXTUREACCESS_STATIC);
 		void updateFromData(void *data, int pitch);
+		// Streaming textures only. Returns the pixels and their pitch.
+		void* lock(int &pitch);
+		void unlock();
 		void destroy();
 		void setXY(int x, int y);
+		// Size of the rectangle the texture is drawn to, the renderer
+		// scales the texture to it.
+		void setDrawSize(int w, int h);
+		int getWidth() { return tex_w; }
+		int getHeight() { return tex_h; }
+		unsigned int getFormat() { return tex_format; }
 
 	private:
 		int x = 0, y = 0;
+		int tex_w = 0, tex_h = 0;
+		unsigned int tex_format = 0;
 		SDL_Texture *texture = NULL;
 		SDL_Rect rect = {0, 0, 0, 0};
 		TTF_Font *font;
@@ -107,10 +120,13 @@ namespace GUI {
 
 	// Derived Textures
 
+	// Camera preview: a streaming texture at the camera resolution, scaled
+	// to the screen by the renderer. YUV420 frames are uploaded as they are,
+	// the renderer converts them.
 	class TextureImage : public Texture {
 	public:
 		using Texture::Texture;
-		void updateFromImage(const cv::Mat &image);
+		void updateFromImage(const cv::Mat &image, Camera::frameFormat format);
 	};
 
 	class TextureFreq : public Texture {
@@ -179,7 +195,7 @@ namespace GUI {
 
 		// General
 		Event pollEvent();
-		void updateImage(const cv::Mat &image);
+		void updateImage(const cv::Mat &image, Camera::frameFormat format = Camera::FRAME_BGR);
 		void redraw();
 
 	private:
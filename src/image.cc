@@ -1,103 +1,358 @@
 #include <string>
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
 #include <SDL_surface.h>
 #include <SDL_thread.h>
 #include <cxcore.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
-#include <lua.hpp>
 
 #include "image.hh"
 #include "camera.hh"
+#include "classifier.hh"
+#include "metrics.hh"
+#include "trace.hh"
 #include "cmake_config.h"
 
-#define TESTSCRIPT SHAREDIR "/torchnn/test.lua"
-#define IMG_SAVE_PATH "/tmp/hornet.ppm"
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define IMAGE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define IMAGE_SSE2
+#endif
+
+// Number of frames over which profiling times are averaged
+#define PROFILE_FRAMES 100
+
+// Default number of prepared frames between the two stages
+#define QUEUE_DEFAULT_DEPTH 2
+// Maximal waiting time on the queue, so the threads can be stopped
+#define QUEUE_TIMEOUT_MS 100
+
+// Change detection defaults, see ChangeDetector
+#define CHANGE_DEFAULT_PIXEL_THRESHOLD 12
+#define CHANGE_DEFAULT_MIN_PIXELS 2
+#define CHANGE_DEFAULT_MAX_AGE 50
 
 namespace Image {
+	PreprocessThread::~PreprocessThread() {
+		destruct();
+	}
+
+	void PreprocessThread::onStart() {
+		profile = Conf::getInt("NN_PROFILE", 0) != 0;
+		profile_start_us = Time::getMicros();
+	}
+
+	void PreprocessThread::loop() {
+		// Time out regularly so the thread can be stopped
+		PreparedFrame *prepared = queue->beginPush(QUEUE_TIMEOUT_MS);
+		if (prepared == NULL)
+			return;
+
+		Camera::Frame frame;
+		if (camera->waitForImage(CAMERA_CLASER_ONSUMER_PROCESSING_ID, QUEUE_TIMEOUT_MS))
+			camera->retrieve(frame, CAMERA_CLASER_ONSUMER_PROCESSING_ID);
+		if (frame.empty()) {
+			// No frame yet (or anymore): give the item back
+			queue->cancelPush();
+			return;
+		}
+
+		uint64_t start_us = Time::getMicros();
+
+		prepared->info.seq = frame.getSeq();
+		prepared->info.capture_us = frame.getTimestamp();
+		Trace::record(Trace::STAGE_FRAME_AGE, start_us - prepared->info.capture_us);
+
+		resizeImageForDB(frame.getImage(), prepared->image, frame.getFormat());
+		frame.release();
+
+		prepared->prepared_us = Time::getMicros();
+		Trace::record(Trace::STAGE_RESIZE, prepared->prepared_us - start_us);
+		queue->endPush();
+
+		// The item is only written again by this thread
+		PreparedSink *prepared_sink = sink;
+		if (prepared_sink != NULL)
+			prepared_sink->onFramePrepared(*prepared);
+
+		if (!profile)
+			return;
+
+		profile_prepare_us += prepared->prepared_us - start_us;
+		if (++profile_frames >= PROFILE_FRAMES) {
+			std::cerr << "Preprocessing: " << (double) profile_prepare_us / (1000.0 * profile_frames)
+				<< " ms/frame, utilisation " << 100 * profile_prepare_us / (prepared->prepared_us - profile_start_us)
+				<< " %, " << camera->getSkippedFrames(CAMERA_CLASER_ONSUMER_PROCESSING_ID)
+				<< " camera frames skipped since start" << std::endl;
+			profile_frames = profile_prepare_us = 0;
+			profile_start_us = prepared->prepared_us;
+		}
+	}
+
 	void NNManagerThread::construct() {
-		newresult_sem = SDL_CreateSemaphore(0);
 		mutex = SDL_CreateMutex();
+
+		int depth = Conf::getInt("NN_QUEUE_DEPTH", QUEUE_DEFAULT_DEPTH);
+		if (depth < 1)
+			throw Conf::ConfException("NN_QUEUE_DEPTH");
+		queue.reset(new PreparedQueue(depth));
 	}
 
 	NNManagerThread::~NNManagerThread() {
 		destruct();
 
-		if (newresult_sem != NULL)
-			SDL_DestroySemaphore(newresult_sem);
 		if (mutex != NULL)
 			SDL_DestroyMutex(mutex);
 	}
 
 	void NNManagerThread::onStart() {
-		L = luaL_newstate();
-		if (L == NULL)
-			throw LuaException(LUA_ERRMEM);
+		change_detector.reset(new ChangeDetector());
+		profile = Conf::getInt("NN_PROFILE", 0) != 0;
+		profile_start_us = Time::getMicros();
+		pool.reset(new InferencePool(getConfWorkers(), this));
+	}
 
-		luaL_openlibs(L);
+	void NNManagerThread::onEnd() {
+		pool.reset();
+	}
 
-		thread_state = lua_newthread(L);
+	void NNManagerThread::loop() {
+		pool->checkDeath();
 
-		int err;
-		if ((err = luaL_loadfile(thread_state, TESTSCRIPT)) != 0)
-			throw LuaException(err);
+		PreparedFrame *prepared = queue->beginPop(QUEUE_TIMEOUT_MS);
+		if (prepared == NULL)
+			return;
 
-		// Push the thread arguments
-		lua_pushstring(thread_state, IMG_SAVE_PATH);
-		if ((err = lua_resume(thread_state, 1)) > 1)
-			throw LuaException(err, std::string(lua_tostring(thread_state, -1)));
+		// In batch mode, the frames already waiting in the queue (those
+		// prepared before the trigger, or while the workers were busy) are
+		// classified in a single forward pass.
+		do {
+			uint64_t start_us = Time::getMicros();
+			Trace::record(Trace::STAGE_QUEUE_WAIT, start_us - prepared->prepared_us);
+			dispatchPrepared(*prepared, start_us);
+			queue->endPop();
+		} while (batch_job != NULL && (prepared = queue->beginPop(0)) != NULL);
+		endBatchJob();
 	}
 
-	void NNManagerThread::onEnd() {
-		lua_close(L);
+	void NNManagerThread::endBatchJob() {
+		if (batch_job == NULL)
+			return;
+		pool->endJob(batch_job);
+		batch_job = NULL;
 	}
 
-	void NNManagerThread::loop() {
-		camera->waitForImage(CAMERA_CLASER_ONSUMER_PROCESSING_ID);
-		cv::Mat image;
-		camera->retrieve(image, CAMERA_CLASER_ONSUMER_PROCESSING_ID);
+	InferenceJob* NNManagerThread::getJob() {
+		// Jobs are freed by the workers, which keep running until the pool
+		// is destroyed.
+		InferenceJob *job;
+		while ((job = pool->beginJob(QUEUE_TIMEOUT_MS)) == NULL)
+			pool->checkDeath();
+		job->detect_us = detect_us;
+		detect_us = 0;
+		return job;
+	}
 
-		cv::Mat resized;
-		resizeImageForDB(image, resized);
-		imwrite(IMG_SAVE_PATH, resized);
-
-		// Resume the Lua thread
-		int err;
-		if ((err = lua_resume(thread_state, 0)) > 1)
-			throw LuaException(err, std::string(lua_tostring(thread_state, -1)));
-
-		nnResult tmp_result;
-		// Get the results
-		lua_getfield(thread_state, 1, "empty");
-		tmp_result.empty_prob = lua_tonumber(thread_state, 2);
-		lua_pop(thread_state, 1);
-		lua_getfield(thread_state, 1, "asian");
-		tmp_result.asian_prob = lua_tonumber(thread_state, 2);
-		lua_pop(thread_state, 1);
-		lua_getfield(thread_state, 1, "european");
-		tmp_result.european_prob = lua_tonumber(thread_state, 2);
-		lua_pop(thread_state, 2);
+	void NNManagerThread::dispatchPrepared(const PreparedFrame &prepared, uint64_t start_us) {
+		const cv::Mat &resized = prepared.image;
+		const Trace::FrameInfo &info = prepared.info;
 
+		unsigned int request, size;
+		uint64_t since;
 		SDL_LockMutex(mutex);
-		result = tmp_result;
+		request = batch_request;
+		size = batch_size;
+		since = batch_since;
 		SDL_UnlockMutex(mutex);
-		SDL_SemPost(newresult_sem);
+
+		if (size == 0) {
+			// The batch request was cancelled
+			endBatchJob();
+
+			// Unchanged frames get the result of the last classified one
+			bool changed = change_detector->isChanged(resized);
+			uint64_t detected_us = Time::getMicros();
+			detect_us += detected_us - start_us;
+			Trace::record(Trace::STAGE_CHANGE_DETECT, detected_us - start_us);
+
+			InferenceJob *job = getJob();
+			job->n = 1;
+			job->frames[0] = info;
+			if (changed) {
+				resized.copyTo(job->images[0]);
+				change_detector->setReference(resized);
+			} else {
+				job->reuse = true;
+			}
+			pool->endJob(job);
+			return;
+		}
+
+		// Batch mode: every frame captured after since is classified
+		if (request != window_request) {
+			window_n = 0;
+			window_request = request;
+		}
+		if (info.capture_us < since || window_n >= size)
+			return; // Captured before the laser was triggered, or not requested
+		window_n++;
+
+		if (batch_job != NULL && batch_job->batch_request != request)
+			endBatchJob();
+		if (batch_job == NULL) {
+			batch_job = getJob();
+			batch_job->batch = true;
+			batch_job->batch_request = request;
+		}
+		batch_job->frames[batch_job->n] = info;
+		resized.copyTo(batch_job->images[batch_job->n]);
+		batch_job->n++;
+		change_detector->setReference(resized);
+		if (batch_job->n >= NN_MAX_BATCH || window_n >= size)
+			endBatchJob();
+	}
+
+	void NNManagerThread::onJobDone(const InferenceJob &job) {
+		addProfile(job);
+
+		if (!job.batch) {
+			if (!job.reuse)
+				Trace::record(Trace::STAGE_FORWARD, job.forward_us);
+			Metrics::increment(job.reuse ? Metrics::INFERENCE_REUSED : Metrics::INFERENCE_SINGLE);
+			publishResult(job.results[0], job.frames[0]);
+			return;
+		}
+
+		Trace::record(Trace::STAGE_FORWARD_BATCH, job.forward_us);
+		Metrics::increment(Metrics::INFERENCE_BATCH, job.n);
+		uint64_t now = Time::getMicros();
+
+		SDL_LockMutex(mutex);
+		if (batch_request == job.batch_request) {
+			for (unsigned int i = 0 ; i < job.n && batch.n < NN_MAX_BATCH ; ++i) {
+				batch.results[batch.n] = job.results[i];
+				batch.frames[batch.n] = job.frames[i];
+				batch.n++;
+			}
+			batch.published_us = now;
+			batch_ready = true;
+			if (batch.n >= batch_size)
+				batch_size = 0;
+		}
+		SDL_UnlockMutex(mutex);
+
+		// Only the last result of the job is published
+		for (unsigned int i = 0 ; i + 1 < job.n ; ++i)
+			Trace::record(Trace::STAGE_CAPTURE_TO_RESULT, now - job.frames[i].capture_us);
+		publishResult(job.results[job.n - 1], job.frames[job.n - 1]);
+	}
+
+	void NNManagerThread::publishResult(const nnResult &new_result, const Trace::FrameInfo &info, bool trace) {
+		if (trace)
+			Trace::record(Trace::STAGE_CAPTURE_TO_RESULT, Time::getMicros() - info.capture_us);
+
+		unsigned long seq;
+		SDL_LockMutex(mutex);
+		result = new_result;
+		result_frame = info;
+		seq = ++result_seq;
+		SDL_UnlockMutex(mutex);
+		newresult_seq.publish(seq);
+	}
+
+	void NNManagerThread::addProfile(const InferenceJob &job) {
+		if (!profile)
+			return;
+
+		profile_frames += job.n;
+		if (!job.reuse)
+			profile_classified += job.n;
+		profile_forward_us += job.forward_us;
+		profile_detect_us += job.detect_us;
+		profile_depth += queue->getDepth();
+		profile_pool_depth += pool->getDepth();
+		profile_jobs++;
+
+		if (profile_frames >= PROFILE_FRAMES) {
+			uint64_t now = Time::getMicros();
+			uint64_t elapsed_us = now - profile_start_us;
+			std::cerr << "Inference: change detection " << (double) profile_detect_us / profile_frames
+				<< " us/frame, forward pass " << ((profile_classified > 0) ? (double) profile_forward_us / (1000.0 * profile_classified) : 0)
+				<< " ms/classified frame, " << 100 * (profile_frames - profile_classified) / profile_frames
+				<< " % of forward passes saved, " << profile_classified * 1000000.0 / elapsed_us
+				<< " classified frames/s, worker utilisation " << 100 * profile_forward_us / (elapsed_us * pool->getWorkers())
+				<< " % (" << pool->getWorkers() << " workers), average queue depth "
+				<< (double) profile_depth / profile_jobs << "/" << queue->getCapacity()
+				<< ", jobs waiting for a worker " << (double) profile_pool_depth / profile_jobs << std::endl;
+			profile_frames = profile_classified = profile_jobs = profile_depth = profile_pool_depth = 0;
+			profile_detect_us = profile_forward_us = 0;
+			profile_start_us = now;
+		}
+	}
+
+	ChangeDetector::ChangeDetector() {
+		m_pixel_threshold = Conf::getInt("CHANGE_PIXEL_THRESHOLD", CHANGE_DEFAULT_PIXEL_THRESHOLD);
+		m_min_pixels = Conf::getInt("CHANGE_MIN_PIXELS", CHANGE_DEFAULT_MIN_PIXELS);
+		m_max_age = Conf::getInt("CHANGE_MAX_AGE", CHANGE_DEFAULT_MAX_AGE);
+	}
+
+	bool ChangeDetector::isChanged(const cv::Mat &frame) {
+		if (!m_valid || m_min_pixels <= 0 || ++m_age >= m_max_age)
+			return true;
+
+		int changed = 0;
+		for (int y = 0 ; y < DB_RESIZED_IMAGE_HEIGHT ; ++y) {
+			const unsigned char *row = frame.ptr<unsigned char>(y);
+			const unsigned char *ref = m_reference + y * DB_RESIZED_IMAGE_WIDTH * 3;
+			for (int x = 0 ; x < DB_RESIZED_IMAGE_WIDTH * 3 ; x += 3) {
+				if (std::abs(row[x] - ref[x]) > m_pixel_threshold
+						|| std::abs(row[x + 1] - ref[x + 1]) > m_pixel_threshold
+						|| std::abs(row[x + 2] - ref[x + 2]) > m_pixel_threshold) {
+					if (++changed >= m_min_pixels)
+						return true;
+				}
+			}
+		}
+		return false;
 	}
 
-	NNManager::NNManager(Camera::Camera *camera) : m_newresult_tracker(RESULTS_CLASER_ONSUMERS) {
+	void ChangeDetector::setReference(const cv::Mat &frame) {
+		for (int y = 0 ; y < DB_RESIZED_IMAGE_HEIGHT ; ++y) {
+			const unsigned char *row = frame.ptr<unsigned char>(y);
+			std::copy(row, row + DB_RESIZED_IMAGE_WIDTH * 3, m_reference + y * DB_RESIZED_IMAGE_WIDTH * 3);
+		}
+		m_valid = true;
+		m_age = 0;
+	}
+
+	NNManager::NNManager(Camera::Camera *camera) {
 		m_thread.camera = camera;
 		m_thread.launch("ImageProcessingThread");
+
+		m_preprocess.camera = camera;
+		m_preprocess.queue = m_thread.queue.get();
+		m_preprocess.launch("PreprocessingThread");
+	}
+
+	unsigned int NNManager::getQueueDepth() {
+		return m_thread.queue->getDepth();
+	}
+
+	void NNManager::setPreparedSink(PreparedSink *sink) {
+		m_preprocess.sink = sink;
 	}
 
 	bool NNManager::newResult(int src_id) {
 		m_thread.checkDeath();
+		m_preprocess.checkDeath();
 
-		if (m_newresult_tracker.getSingle(src_id)) {
-			return true;
-		} else if (SDL_SemTryWait(m_thread.newresult_sem) != SDL_MUTEX_TIMEDOUT) {
-			m_newresult_tracker.setAllTrue();
-			return true;
-		}
-
-		return false;
+		return m_thread.newresult_seq.isNewer(m_last_seq[src_id]);
 	}
 
 	nnResult NNManager::getResult(int src_id) {
@@ -106,17 +361,190 @@ namespace Image {
 		nnResult result;
 		SDL_LockMutex(m_thread.mutex);
 		result = m_thread.result;
+		m_last_seq[src_id] = m_thread.result_seq;
 		SDL_UnlockMutex(m_thread.mutex);
 
-		m_newresult_tracker.setSingleFalse(src_id);
 		return result;
 	}
 
-	void resizeImageForDB(const cv::Mat &src, cv::Mat &dst) {
+	void NNManager::requestBatch(unsigned int n, uint64_t since_us) {
+		SDL_LockMutex(m_thread.mutex);
+		m_thread.batch_size = (n < NN_MAX_BATCH) ? n : NN_MAX_BATCH;
+		m_thread.batch_since = since_us;
+		m_thread.batch_request++;
+		m_thread.batch_ready = false;
+		m_thread.batch.n = 0;
+		SDL_UnlockMutex(m_thread.mutex);
+	}
+
+	void NNManager::cancelBatch() {
+		SDL_LockMutex(m_thread.mutex);
+		m_thread.batch_size = 0;
+		m_thread.batch_request++;
+		m_thread.batch_ready = false;
+		m_thread.batch.n = 0;
+		SDL_UnlockMutex(m_thread.mutex);
+	}
+
+	bool NNManager::newBatch() {
+		m_thread.checkDeath();
+
+		bool ready;
+		SDL_LockMutex(m_thread.mutex);
+		ready = m_thread.batch_ready;
+		SDL_UnlockMutex(m_thread.mutex);
+		return ready;
+	}
+
+	nnBatch NNManager::getBatch() {
+		m_thread.checkDeath();
+
+		nnBatch batch;
+		SDL_LockMutex(m_thread.mutex);
+		batch = m_thread.batch;
+		m_thread.batch_ready = false;
+		SDL_UnlockMutex(m_thread.mutex);
+		return batch;
+	}
+
+	// Sums the rows [y, y + n) of an image whose rows are step bytes apart
+	// column-wise into acc, which holds len values.
+	static void sumRows(const unsigned char *data, size_t step, int y, int n, uint16_t *acc, int len) {
+		std::fill(acc, acc + len, 0);
+		for (int k = 0 ; k < n ; ++k) {
+			const unsigned char *row = data + (y + k) * step;
+			int i = 0;
+#if defined(IMAGE_NEON)
+			for ( ; i + 16 <= len ; i += 16) {
+				uint8x16_t v = vld1q_u8(row + i);
+				vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(v)));
+				vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(v)));
+			}
+#elif defined(IMAGE_SSE2)
+			const __m128i zero = _mm_setzero_si128();
+			for ( ; i + 16 <= len ; i += 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*) (row + i));
+				__m128i *a = (__m128i*) (acc + i);
+				_mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_unpacklo_epi8(v, zero)));
+				_mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_unpackhi_epi8(v, zero)));
+			}
+#endif
+			for ( ; i < len ; ++i)
+				acc[i] += row[i];
+		}
+	}
+
+	// Averages the column sums of sumRows() over groups of scale pixels of
+	// channels interleaved values, into w output pixels. The rounding is the
+	// one of OpenCV's INTER_AREA: its 2x2 kernel rounds halves up, the
+	// generic one to even.
+	static void averageColumns(const uint16_t *acc, int scale, int channels, int w, unsigned char *out) {
+		const float inv_area = 1.f / (scale * scale);
+		for (int x = 0 ; x < w ; ++x, acc += scale * channels) {
+			for (int c = 0 ; c < channels ; ++c) {
+				unsigned int sum = 0;
+				for (int k = 0 ; k < scale ; ++k)
+					sum += acc[k * channels + c];
+				*out++ = (scale == 2) ? (sum + 2) >> 2 : cvRound((float) sum * inv_area);
+			}
+		}
+	}
+
+	// Computes the scale and the first row of the crop of a width x height
+	// frame. Returns false if the fused resize can't be used: INTER_AREA
+	// only averages square blocks of scale x scale pixels when the scale is
+	// an integer and both dimensions are multiples of it (the last row is
+	// partial otherwise), and the column sums fit in 16 bits up to a scale
+	// of 257.
+	static bool getDBCrop(int width, int height, int &scale, int &y0) {
+		double ratio = (double) DB_RESIZED_IMAGE_WIDTH / (double) width;
+		const int rows = cvRound(height * ratio);
+		y0 = (rows - DB_RESIZED_IMAGE_HEIGHT) / 2;
+		scale = width / DB_RESIZED_IMAGE_WIDTH;
+		return scale * DB_RESIZED_IMAGE_WIDTH == width && std::abs(1. / ratio - scale) < DBL_EPSILON
+			&& rows * scale == height && scale <= 257 && y0 >= 0;
+	}
+
+	static void resizeBGRForDB(const cv::Mat &src, cv::Mat &dst) {
+		// Only the blocks of the cropped rows are computed, so the result
+		// is identical to resizeImageForDBGeneric.
+		int scale, y0;
+		if (src.type() != CV_8UC3 || !getDBCrop(src.cols, src.rows, scale, y0)) {
+			resizeImageForDBGeneric(src, dst);
+			return;
+		}
+
+		const int len = src.cols * 3;
+		std::unique_ptr<uint16_t[]> acc(new uint16_t[len]);
+
+		dst.create(DB_RESIZED_IMAGE_HEIGHT, DB_RESIZED_IMAGE_WIDTH, CV_8UC3);
+		for (int y = 0 ; y < DB_RESIZED_IMAGE_HEIGHT ; ++y) {
+			sumRows(src.data, src.step, (y0 + y) * scale, scale, acc.get(), len);
+			averageColumns(acc.get(), scale, 3, DB_RESIZED_IMAGE_WIDTH, dst.ptr<unsigned char>(y));
+		}
+	}
+
+	// ITU-R BT.601 conversion of OpenCV's COLOR_YUV2BGR_I420, 20 bits fixed
+	// point
+	static inline unsigned char clampByte(int v) {
+		return (v < 0) ? 0 : (v > 255) ? 255 : v;
+	}
+
+	static void yuvToBGR(const unsigned char *y, const unsigned char *u, const unsigned char *v, int w, unsigned char *out) {
+		for (int x = 0 ; x < w ; ++x) {
+			const int cu = u[x] - 128, cv = v[x] - 128;
+			const int cy = std::max(0, y[x] - 16) * 1220542 + (1 << 19);
+			*out++ = clampByte((cy + 2116026 * cu) >> 20);
+			*out++ = clampByte((cy - 409993 * cu - 852492 * cv) >> 20);
+			*out++ = clampByte((cy + 1673527 * cv) >> 20);
+		}
+	}
+
+	static void resizeYUV420ForDB(const cv::Mat &src, cv::Mat &dst) {
+		// The planes are downscaled separately, the chroma planes with half
+		// the scale, so every output pixel gets its own chroma. Only the
+		// 32x16 result is converted to BGR.
+		const int width = src.cols, height = src.rows * 2 / 3;
+		int scale, y0;
+		if (!getDBCrop(width, height, scale, y0) || scale % 2 != 0) {
+			cv::Mat bgr;
+			cv::cvtColor(src, bgr, cv::COLOR_YUV2BGR_I420);
+			resizeImageForDBGeneric(bgr, dst);
+			return;
+		}
+
+		const unsigned char *y_plane = src.data;
+		const unsigned char *u_plane = y_plane + width * height;
+		const unsigned char *v_plane = u_plane + width * height / 4;
+		const int cscale = scale / 2;
+		std::unique_ptr<uint16_t[]> acc(new uint16_t[width]);
+		unsigned char luma[DB_RESIZED_IMAGE_WIDTH], u[DB_RESIZED_IMAGE_WIDTH], v[DB_RESIZED_IMAGE_WIDTH];
+
+		dst.create(DB_RESIZED_IMAGE_HEIGHT, DB_RESIZED_IMAGE_WIDTH, CV_8UC3);
+		for (int y = 0 ; y < DB_RESIZED_IMAGE_HEIGHT ; ++y) {
+			sumRows(y_plane, width, (y0 + y) * scale, scale, acc.get(), width);
+			averageColumns(acc.get(), scale, 1, DB_RESIZED_IMAGE_WIDTH, luma);
+			sumRows(u_plane, width / 2, (y0 + y) * cscale, cscale, acc.get(), width / 2);
+			averageColumns(acc.get(), cscale, 1, DB_RESIZED_IMAGE_WIDTH, u);
+			sumRows(v_plane, width / 2, (y0 + y) * cscale, cscale, acc.get(), width / 2);
+			averageColumns(acc.get(), cscale, 1, DB_RESIZED_IMAGE_WIDTH, v);
+
+			yuvToBGR(luma, u, v, DB_RESIZED_IMAGE_WIDTH, dst.ptr<unsigned char>(y));
+		}
+	}
+
+	void resizeImageForDB(const cv::Mat &src, cv::Mat &dst, Camera::frameFormat format) {
 		// This function stretches the image so it fits the horizontal
 		// resolution first, then crops the top and bottom parts to it
 		// fits the vertical resolution.
 		// It makes no checks about the source image, no be careful.
+		if (format == Camera::FRAME_YUV420)
+			resizeYUV420ForDB(src, dst);
+		else
+			resizeBGRForDB(src, dst);
+	}
+
+	void resizeImageForDBGeneric(const cv::Mat &src, cv::Mat &dst) {
 		cv::Mat resized;
 		double ratio = (double) DB_RESIZED_IMAGE_WIDTH / (double) src.cols;
 		cv::resize(src, resized, cv::Size(), ratio, ratio, cv::INTER_AREA);
@@ -125,19 +553,27 @@ namespace Image {
 		dst = resized(roi);
 	}
 
-	void resizeImageForScreen(const cv::Mat &src, cv::Mat &dst, int width, int height, int &x_pos, int &y_pos) {
+	void fitToScreen(int cols, int rows, int width, int height, int &w, int &h, int &x_pos, int &y_pos) {
 		double x_ratio, y_ratio;
-		x_ratio = (double) width / (double) src.cols;
-		y_ratio = (double) height / (double) src.rows;
+		x_ratio = (double) width / (double) cols;
+		y_ratio = (double) height / (double) rows;
 
 		y_pos = x_pos = 0;
 
 		if (x_ratio < y_ratio) {
-			cv::resize(src, dst, cv::Size(), x_ratio, x_ratio);
-			y_pos = (height - dst.rows) / 2;
+			w = width;
+			h = cvRound(rows * x_ratio);
+			y_pos = (height - h) / 2;
 		} else {
-			cv::resize(src, dst, cv::Size(), y_ratio, y_ratio);
-			x_pos = (width - dst.cols) / 2;
+			w = cvRound(cols * y_ratio);
+			h = height;
+			x_pos = (width - w) / 2;
 		}
 	}
+
+	void resizeImageForScreen(const cv::Mat &src, cv::Mat &dst, int width, int height, int &x_pos, int &y_pos) {
+		int w, h;
+		fitToScreen(src.cols, src.rows, width, height, w, h, x_pos, y_pos);
+		cv::resize(src, dst, cv::Size(w, h));
+	}
 }
@@ -3,57 +3,98 @@
 #include <queue>
 #include <cstdio>
 #include <string>
+#include <memory>
+#include <atomic>
 #include <SDL_surface.h>
 #include <SDL_thread.h>
 #include <SDL_mutex.h>
 #include <cxcore.hpp>
-#include <lua.hpp>
 
 #include "camera.hh"
+#include "classifier.hh"
+#include "pool.hh"
+#include "trace.hh"
 #include "util.hh"
 
-#define DB_RESIZED_IMAGE_WIDTH 32
-#define DB_RESIZED_IMAGE_HEIGHT 16
-
 #define RESULTS_CLASER_ONSUMERS 2
 #define RESULTS_CLASER_ONSUMER_MAIN_ID 0
 #define RESULTS_CLASER_ONSUMER_GPIO_ID 1
 
 namespace Image {
-	struct LuaException : public std::exception {
-		LuaException(int errcode, std::string p_msg = "") : err(errcode), msg(p_msg) {}
-
-		const char* what() const noexcept {
-			static char ret[1000];
-			switch (err) {
-			case LUA_ERRSYNTAX:
-				return "Lua error: syntax error";
-			case LUA_ERRMEM:
-				return "Lua error: not enough memory.";
-			case LUA_ERRRUN:
-				snprintf(ret, 1000, "Lua error: runtime error: %s", msg.c_str());
-				return ret;
-			case LUA_ERRERR:
-				return "Lua error: error while running the message handler.";
-			case LUA_ERRFILE:
-				return "Lua error: file error.";
-			default:
-				snprintf(ret, 1000, "Lua error: unknown error: %d", err);
-				return ret;
-			}
-		}
-
-		int err;
-		std::string msg;
+	// Results of a batch of consecutive frames
+	struct nnBatch {
+		unsigned int n = 0;
+		nnResult results[NN_MAX_BATCH];
+		Trace::FrameInfo frames[NN_MAX_BATCH];
+		// Publication time, see Time::getMicros
+		uint64_t published_us = 0;
+	};
+
+	// Decides whether a frame resized by resizeImageForDB differs enough from
+	// the last classified one to be worth a forward pass. A pixel changed if
+	// one of its channels differs by more than CHANGE_PIXEL_THRESHOLD, and a
+	// frame changed if at least CHANGE_MIN_PIXELS pixels changed (0 disables
+	// the detection). A frame is classified at least every CHANGE_MAX_AGE
+	// frames anyway.
+	class ChangeDetector {
+	public:
+		ChangeDetector();
+		bool isChanged(const cv::Mat &frame);
+		// Sets the last classified frame
+		void setReference(const cv::Mat &frame);
+
+	private:
+		unsigned char m_reference[DB_RESIZED_IMAGE_SIZE];
+		bool m_valid = false;
+		unsigned int m_age = 0;
+		int m_pixel_threshold;
+		int m_min_pixels;
+		unsigned int m_max_age;
 	};
 
-	struct nnResult {
-		double empty_prob;
-		double asian_prob;
-		double european_prob;
+	// A frame resized by the preprocessing stage, waiting to be classified
+	struct PreparedFrame {
+		cv::Mat image;
+		Trace::FrameInfo info;
+		// End of the preprocessing, see Time::getMicros
+		uint64_t prepared_us = 0;
 	};
 
-	class NNManagerThread : public Thread::ThreadBase {
+	typedef Thread::SPSCQueue<PreparedFrame> PreparedQueue;
+
+	// Receives every frame resized by the preprocessing stage, in the
+	// preprocessing thread
+	class PreparedSink {
+	public:
+		virtual void onFramePrepared(const PreparedFrame &prepared) = 0;
+	};
+
+	// Preprocessing stage: waits for a free queue item, then for a camera
+	// frame, and resizes it into the queue. The next frame is thus prepared
+	// while the inference stage classifies the current one.
+	class PreprocessThread : public Thread::ThreadBase {
+	public:
+		virtual void onStart();
+		virtual void onEnd() {}
+		virtual void loop();
+		~PreprocessThread();
+
+		Camera::Camera *camera;
+		PreparedQueue *queue;
+		std::atomic<PreparedSink*> sink{NULL};
+
+	private:
+		// Profiling (enabled with the NN_PROFILE environment variable)
+		bool profile = false;
+		unsigned long profile_frames = 0;
+		uint64_t profile_prepare_us = 0;
+		uint64_t profile_start_us = 0;
+	};
+
+	// Inference stage: dispatches the prepared frames to the inference
+	// pool, after change detection and batch collection, and publishes the
+	// results in frame order.
+	class NNManagerThread : public Thread::ThreadBase, public JobSink {
 	public:
 		virtual void onStart();
 		virtual void onEnd();
@@ -61,14 +102,67 @@ namespace Image {
 		virtual void construct();
 		~NNManagerThread();
 
-		SDL_sem *newresult_sem = NULL;
+		Thread::SequenceCounter newresult_seq;
 		SDL_mutex *mutex = NULL;
+		// Last result, its frame and its sequence number (protected by mutex)
 		nnResult result;
+		Trace::FrameInfo result_frame;
+		unsigned long result_seq = 0;
 		Camera::Camera *camera;
 
+		// Batch requests (protected by mutex). batch_size is 0 when no
+		// batch is requested, batch_request is incremented by each request.
+		// batch holds the results received so far, batch_ready is set
+		// when it grows.
+		unsigned int batch_size = 0;
+		unsigned int batch_request = 0;
+		uint64_t batch_since = 0;
+		bool batch_ready = false;
+		nnBatch batch;
+
+		// Queue between the preprocessing and inference stages, created by
+		// construct() with NN_QUEUE_DEPTH items
+		std::unique_ptr<PreparedQueue> queue;
+
+		// Called by the pool, in job order
+		virtual void onJobDone(const InferenceJob &job);
+
 	private:
-		lua_State *L;
-		lua_State *thread_state;
+		void dispatchPrepared(const PreparedFrame &prepared, uint64_t start_us);
+		// Waits for a free job of the pool
+		InferenceJob* getJob();
+		// Submits batch_job, if any
+		void endBatchJob();
+		// trace: record the capture to result latency
+		void publishResult(const nnResult &new_result, const Trace::FrameInfo &info, bool trace = true);
+		void addProfile(const InferenceJob &job);
+
+		std::unique_ptr<InferencePool> pool;
+		std::unique_ptr<ChangeDetector> change_detector;
+
+		// Batch job being filled with the frames waiting in the queue,
+		// submitted before loop() returns
+		InferenceJob *batch_job = NULL;
+
+		// Frames dispatched for the current batch request
+		unsigned int window_n = 0;
+		unsigned int window_request = 0;
+
+		// Change detection time of the frames dispatched since the last
+		// job, only accessed by the thread
+		uint64_t detect_us = 0;
+
+		// Profiling (enabled with the NN_PROFILE environment variable),
+		// accessed in onJobDone()
+		bool profile = false;
+		unsigned long profile_frames = 0;
+		unsigned long profile_classified = 0;
+		unsigned long profile_jobs = 0;
+		unsigned long profile_depth = 0;
+		unsigned long profile_pool_depth = 0;
+		uint64_t profile_detect_us = 0;
+		uint64_t profile_forward_us = 0;
+		uint64_t profile_start_us = 0;
 	};
 
 	class NNManager {
@@ -76,11 +170,45 @@ namespace Image {
 		NNManager(Camera::Camera *camera);
 		bool newResult(int src_id);
 		nnResult getResult(int src_id);
+
+		// Requests the classification of the next n frames (at most
+		// NN_MAX_BATCH) captured after since_us (see Time::getMicros).
+		// They are all classified (without change detection) and their
+		// results are appended to the batch in frame order as soon as they
+		// are available, so that a decision can be made before the batch
+		// is complete. The frames already prepared when they are dispatched
+		// share a single forward pass. A new request cancels the pending
+		// one.
+		void requestBatch(unsigned int n, uint64_t since_us = 0);
+		void cancelBatch();
+		// True when results were appended since the last getBatch()
+		bool newBatch();
+		nnBatch getBatch();
+
+		// Number of prepared frames waiting for the inference stage
+		unsigned int getQueueDepth();
+		// The sink (NULL for none) must outlive the NNManager
+		void setPreparedSink(PreparedSink *sink);
 	private:
+		// The preprocessing stage uses the queue of the inference stage,
+		// so it is declared last to be destroyed first.
 		NNManagerThread m_thread;
-		Thread::ConsumerTracker m_newresult_tracker;
+		PreprocessThread m_preprocess;
+		// Last result sequence number seen by each consumer, only accessed
+		// by the consumer thread
+		unsigned long m_last_seq[RESULTS_CLASER_ONSUMERS] = {0};
 	};
 
-	void resizeImageForDB(const cv::Mat &src, cv::Mat &dst);
+	// Resizes a camera frame to the classifier input size (BGR). Only the
+	// rows kept by the crop are downscaled when the frame width is a
+	// multiple of DB_RESIZED_IMAGE_WIDTH and the height a multiple of the
+	// resulting scale; for BGR frames, the result is then identical to
+	// resizeImageForDBGeneric, which resizes the whole frame.
+	// YUV420 frames are downscaled plane by plane before the conversion.
+	void resizeImageForDB(const cv::Mat &src, cv::Mat &dst, Camera::frameFormat format = Camera::FRAME_BGR);
+	void resizeImageForDBGeneric(const cv::Mat &src, cv::Mat &dst);
+	// Computes the size and position of a cols x rows image scaled to fit
+	// a width x height screen, keeping its aspect ratio.
+	void fitToScreen(int cols, int rows, int width, int height, int &w, int &h, int &x_pos, int &y_pos);
 	void resizeImageForScreen(const cv::Mat &src, cv::Mat &dst, int width, int height, int &x_pos, int &y_pos);
 }
@@ -1,132 +1,235 @@
 #include <iostream>
 #include <exception>
 #include <memory>
-#include <dirent.h>
-#include <cstdlib>
 #include <sstream>
+#include <csignal>
+#include <string>
+#include <SDL_thread.h>
 #include <cxcore.hpp>
 
 #include "camera.hh"
+#include "capture.hh"
+#include "dataset.hh"
 #include "gpio.hh"
 #include "gui.hh"
 #include "image.hh"
+#include "metrics.hh"
+#include "trace.hh"
 #include "util.hh"
 
-struct DBException : public std::exception {
-	const char* what() const noexcept {
-		return "Failed to save file to database.";
-	}
-};
-
-void captureToDb(GUI::GUI &gui, GUI::captureMode mode, const cv::Mat &image) {
-	std::ostringstream path;
-	path << "dataset/";
+// Dataset category of a capture mode
+int getCaptureCategory(GUI::captureMode mode) {
 	switch (mode) {
-	case GUI::CAPTURE_EMPTY:
-		path << "empty/";
-		break;
 	case GUI::CAPTURE_ASIAN:
-		path << "asian/";
-		break;
+		return Dataset::getCategory("asian");
 	case GUI::CAPTURE_EUROPEAN:
-		path << "european/";
-		break;
+		return Dataset::getCategory("european");
 	default:
-		break; // Warning avoidance
+		return Dataset::getCategory("empty");
 	}
+}
 
-	// Compute the index of the picture.
-	unsigned int image_n = 0;
+void captureToDb(GUI::GUI &gui, Capture::Writer &writer, GUI::captureMode mode, const Camera::Frame &frame) {
+	cv::Mat image_resized;
+	Image::resizeImageForDB(frame.getImage(), image_resized, frame.getFormat());
 
-	{
-		DIR *dpdf;
-		struct dirent *epdf;
+	Trace::FrameInfo info;
+	info.seq = frame.getSeq();
+	info.capture_us = frame.getTimestamp();
+	std::string path = writer.push(image_resized, getCaptureCategory(mode), info);
+	gui.updateCapturePath(path.empty() ? "Capture queue full, image dropped" : path);
+}
 
-		dpdf = opendir(path.str().c_str());
-		if (dpdf == NULL)
-			throw DBException();
+// Main loop rate of the GUI in window and observer mode
+#define GUI_FPS 30
+#define GUI_OBSERVER_FPS 5
+// Main loop period in headless mode, in milliseconds
+#define HEADLESS_PERIOD_MS 100
+// Default duration of a capture burst, in seconds
+#define CAPTURE_BURST_DEFAULT_TIME 10
+
+// Set by SIGUSR1 to dump the latency traces
+static volatile sig_atomic_t dump_trace = 0;
+// Set by SIGINT and SIGTERM in headless mode (SDL turns them into quit
+// events when there is a window)
+static volatile sig_atomic_t quit = 0;
+
+static void onSigusr1(int) {
+	dump_trace = 1;
+}
 
-		while ((epdf = readdir(dpdf))) {
-			unsigned int n = strtol(epdf->d_name, NULL, 10);
-			if (n > image_n)
-				image_n = n;
+static void onQuit(int) {
+	quit = 1;
+}
+
+// GUI_MODE: "window" (default), "observer" or "headless"
+enum guiMode { GUI_WINDOW, GUI_OBSERVER, GUI_HEADLESS };
+
+static guiMode getConfGUIMode() {
+	std::string name = Conf::getString("GUI_MODE", "window");
+	if (name == "window")
+		return GUI_WINDOW;
+	else if (name == "observer")
+		return GUI_OBSERVER;
+	else if (name == "headless")
+		return GUI_HEADLESS;
+	throw Conf::ConfException("GUI_MODE");
+}
+
+// Without SDL video nor SDL_ttf: the main thread only handles the signals
+// and logs the servo movements.
+static void runHeadless(GPIO::GPIO &gpio) {
+	signal(SIGINT, onQuit);
+	signal(SIGTERM, onQuit);
+
+	GPIO::servoState servo_state = GPIO::SERVO_LIFE;
+	while (!quit) {
+		if (dump_trace) {
+			dump_trace = 0;
+			Trace::dump(std::cerr);
 		}
 
-		closedir(dpdf);
+		GPIO::servoState new_servo_state = gpio.getServoState();
+		if (new_servo_state != servo_state) {
+			std::cout << "Servo: " << ((new_servo_state == GPIO::SERVO_DEATH) ? "death" : "life") << std::endl;
+			servo_state = new_servo_state;
+		}
+
+		Time::delay(HEADLESS_PERIOD_MS);
 	}
+}
 
-	++image_n;
+// In observer mode (without a capture writer), the GUI is redrawn less
+// often, at a low priority, and can't switch to capture mode.
+static void runGUI(GUI::GUI &gui, Camera::Camera &camera, Image::NNManager &nn_manager,
+		std::unique_ptr<GPIO::GPIO> &gpio, Capture::Writer *writer) {
+	const bool observer = (writer == NULL);
+	long burst_time = Conf::getInt("CAPTURE_BURST_TIME", CAPTURE_BURST_DEFAULT_TIME);
+	if (burst_time < 1)
+		throw Conf::ConfException("CAPTURE_BURST_TIME");
+	bool burst = false;
+	// Counters of the writer when the burst started
+	unsigned long burst_saved = 0, burst_dropped = 0;
+
+	// Threads inherit the priority of the thread creating them, it is
+	// lowered once all of them are started.
+	if (observer)
+		SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+	// The last retrieved frame is held until the next one, so it can
+	// be saved to the database.
+	Camera::Frame frame;
+
+	GUI::captureMode mode = GUI::NORMAL;
+
+	const int ms_wait = 1000 / (observer ? GUI_OBSERVER_FPS : GUI_FPS);
+
+	while (true) {
+		unsigned int start_ticks = Time::getTicks();
+
+		GUI::Event event = gui.pollEvent();
+		if (event.quit)
+			break;
+
+		if (camera.newImage(CAMERA_CLASER_ONSUMER_MAIN_ID)) {
+			camera.retrieve(frame, CAMERA_CLASER_ONSUMER_MAIN_ID);
+			if (!frame.empty())
+				gui.updateImage(frame.getImage(), frame.getFormat());
+		}
 
-	path << image_n << ".ppm";
+		if (nn_manager.newResult(RESULTS_CLASER_ONSUMER_MAIN_ID)) {
+			Image::nnResult result;
+			result = nn_manager.getResult(RESULTS_CLASER_ONSUMER_MAIN_ID);
+			gui.updateNNResult(result);
+		}
 
-	cv::Mat image_resized;
-	Image::resizeImageForDB(image, image_resized);
+		if (event.captureMode && !observer) {
+			mode = static_cast<GUI::captureMode>((mode + 1) % 4);
+			gui.setMode(mode);
+			writer->stopBurst();
+			if (mode == GUI::NORMAL)
+				gpio.reset(new GPIO::GPIO(&nn_manager));
+			else
+				gpio.reset();
+		}
+
+		if (mode == GUI::NORMAL) {
+			gui.updateLaser(gpio->getLaserState());
+			gui.updateServo(gpio->getServoState());
+			if (event.laserOn)
+				gpio->simLaserOn();
+			if (event.laserOff)
+				gpio->simLaserOff();
+	 	} else {
+			if (event.captureImage && !frame.empty())
+				captureToDb(gui, *writer, mode, frame);
+
+			// In burst mode, the preprocessing stage saves every frame
+			if (event.captureBurst) {
+				if (writer->isBursting()) {
+					writer->stopBurst();
+				} else {
+					burst_saved = writer->getSaved();
+					burst_dropped = writer->getDropped();
+					writer->startBurst(getCaptureCategory(mode), burst_time * 1000);
+				}
+			}
+			if (writer->isBursting()) {
+				std::ostringstream status;
+				status << "Burst: " << (writer->getBurstTime() + 999) / 1000 << " s left, "
+					<< writer->getSaved() - burst_saved << " saved, " << writer->getDropped() - burst_dropped << " dropped";
+				gui.updateCapturePath(status.str());
+				burst = true;
+			} else if (burst) {
+				std::ostringstream status;
+				status << "Burst done: " << writer->getSaved() - burst_saved << " saved, "
+					<< writer->getDropped() - burst_dropped << " dropped, last " << writer->getLastPath();
+				gui.updateCapturePath(status.str());
+				burst = false;
+			}
+		}
 
-	imwrite(path.str(), image_resized);
+		if (event.dumpTrace || dump_trace) {
+			dump_trace = 0;
+			Trace::dump(std::cerr);
+		}
+
+		gui.redraw();
 
-	gui.updateCapturePath(path.str());
+		int diffticks = Time::getTicks() - start_ticks;
+		if (ms_wait > diffticks)
+			Time::delay(ms_wait - diffticks);
+	}
 }
 
 int main() {
+	signal(SIGUSR1, onSigusr1);
+
 	try {
-		GUI::GUI gui;
+		guiMode gui_mode = getConfGUIMode();
+		std::unique_ptr<GUI::GUI> gui;
+		if (gui_mode != GUI_HEADLESS)
+			gui.reset(new GUI::GUI());
+		// The capture writer receives the prepared frames, so it is
+		// created before (and destroyed after) the NNManager.
+		std::unique_ptr<Capture::Writer> writer;
+		if (gui_mode == GUI_WINDOW)
+			writer.reset(new Capture::Writer(CAPTURE_DIR, Conf::getString("CAPTURE_PACK", "")));
+
 		Camera::Camera camera;
 		Image::NNManager nn_manager(&camera);
+		nn_manager.setPreparedSink(writer.get());
 		// By using a unique_ptr, it is easy to delete the GPIO
 		// thread in capture mode.
 		std::unique_ptr<GPIO::GPIO> gpio(new GPIO::GPIO(&nn_manager));
-
-		cv::Mat image;
-
-		GUI::captureMode mode;
-
-		// Run the loop 30 times a second.
-		const int ms_wait = 1000 / 30;
-
-		while (true) {
-			unsigned int start_ticks = Time::getTicks();
-
-			GUI::Event event = gui.pollEvent();
-			if (event.quit)
-				break;
-
-			if (camera.newImage(CAMERA_CLASER_ONSUMER_MAIN_ID)) {
-				camera.retrieve(image, CAMERA_CLASER_ONSUMER_MAIN_ID);
-				gui.updateImage(image);
-			}
-
-			if (nn_manager.newResult(RESULTS_CLASER_ONSUMER_MAIN_ID)) {
-				Image::nnResult result;
-				result = nn_manager.getResult(RESULTS_CLASER_ONSUMER_MAIN_ID);
-				gui.updateNNResult(result);
-			}
-
-			if (event.captureMode) {
-				mode = static_cast<GUI::captureMode>((mode + 1) % 4);
-				gui.setMode(mode);
-				if (mode == GUI::NORMAL)
-					gpio.reset(new GPIO::GPIO(&nn_manager));
-				else
-					gpio.reset();
-			}
-
-			if (mode == GUI::NORMAL) {
-				gui.updateLaser(gpio->getLaserState());
-				gui.updateServo(gpio->getServoState());
-				if (event.laserOn)
-					gpio->simLaserOn();
-				if (event.laserOff)
-					gpio->simLaserOff();
-		 	} else if (event.captureImage) {
-				captureToDb(gui, mode, image);
-			}
-
-			gui.redraw();
-
-			int diffticks = Time::getTicks() - start_ticks;
-			if (ms_wait > diffticks)
-				Time::delay(ms_wait - diffticks);
-		}
+		std::unique_ptr<Metrics::Server> metrics;
+		if (Metrics::isConfEnabled())
+			metrics.reset(new Metrics::Server());
+
+		if (gui_mode == GUI_HEADLESS)
+			runHeadless(*gpio);
+		else
+			runGUI(*gui, camera, nn_manager, gpio, writer.get());
 	} catch (std::exception& ex) {
 		std::cerr << ex.what() << std::endl;
 		return 1;
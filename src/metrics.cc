@@ -0,0 +1,319 @@
+#include <atomic>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <SDL_thread.h>
+
+#include "metrics.hh"
+#include "trace.hh"
+
+// Maximal waiting time for a connection, so the thread can be stopped
+#define SERVER_TIMEOUT_MS 100
+// Requests are read for at most this time, and only their first bytes
+#define REQUEST_TIMEOUT_MS 1000
+#define REQUEST_MAX_SIZE 4096
+
+namespace Metrics {
+	struct MetricInfo {
+		const char *name;
+		const char *labels;
+		// Only read for the first entry of each name
+		const char *help;
+	};
+
+	static const MetricInfo counter_info[COUNTER_COUNT] = {
+		{"vespid_camera_frames_total", "", "Frames captured by the camera."},
+		{"vespid_camera_frames_dropped_total", "", "Frames dropped because all the frame slots were held."},
+		{"vespid_consumer_frames_skipped_total", "consumer=\"main\"", "Camera frames not retrieved by a consumer."},
+		{"vespid_consumer_frames_skipped_total", "consumer=\"processing\"", ""},
+		{"vespid_inference_frames_total", "kind=\"single\"",
+			"Frames classified alone or for a decision, or unchanged frames which got the previous result."},
+		{"vespid_inference_frames_total", "kind=\"batch\"", ""},
+		{"vespid_inference_frames_total", "kind=\"reused\"", ""},
+		{"vespid_gpio_loops_total", "", "Loops of the GPIO thread."},
+		{"vespid_triggers_total", "", "Laser breaks starting a decision."},
+	};
+
+	static const MetricInfo summary_info[SUMMARY_COUNT] = {
+		{"vespid_decision_asian_probability", "outcome=\"asian\"",
+			"Average asian probability of the frames of each decision, by outcome."},
+		{"vespid_decision_asian_probability", "outcome=\"not_asian\"", ""},
+	};
+
+	// Quantiles of the latency summaries, as in the trace dump
+	static const double quantiles[] = {0.5, 0.95, 0.99};
+
+	// Aligned so that two shards never share a cache line. Static storage
+	// is zero-initialized.
+	struct alignas(64) Shard {
+		std::atomic<unsigned long> counters[COUNTER_COUNT];
+		std::atomic<unsigned long> counts[SUMMARY_COUNT];
+		std::atomic<double> sums[SUMMARY_COUNT];
+	};
+
+	static Shard shards[METRICS_SHARDS];
+	static std::atomic<unsigned int> next_shard{0};
+	static thread_local Shard *thread_shard = NULL;
+
+	static Shard& getShard() {
+		if (thread_shard == NULL)
+			thread_shard = &shards[next_shard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS];
+		return *thread_shard;
+	}
+
+	void increment(counter c, unsigned long n) {
+		getShard().counters[c].fetch_add(n, std::memory_order_relaxed);
+	}
+
+	void observe(summary s, double value) {
+		Shard &shard = getShard();
+		shard.counts[s].fetch_add(1, std::memory_order_relaxed);
+		double sum = shard.sums[s].load(std::memory_order_relaxed);
+		while (!shard.sums[s].compare_exchange_weak(sum, sum + value, std::memory_order_relaxed));
+	}
+
+	unsigned long getCounter(counter c) {
+		unsigned long total = 0;
+		for (int i = 0 ; i < METRICS_SHARDS ; ++i)
+			total += shards[i].counters[c].load(std::memory_order_relaxed);
+		return total;
+	}
+
+	unsigned long getCount(summary s) {
+		unsigned long total = 0;
+		for (int i = 0 ; i < METRICS_SHARDS ; ++i)
+			total += shards[i].counts[s].load(std::memory_order_relaxed);
+		return total;
+	}
+
+	double getSum(summary s) {
+		double total = 0;
+		for (int i = 0 ; i < METRICS_SHARDS ; ++i)
+			total += shards[i].sums[s].load(std::memory_order_relaxed);
+		return total;
+	}
+
+	// Sums grow for the whole run: they are written without rounding, so
+	// that rates computed from them stay exact.
+	static void writeExact(std::ostream &out, double value) {
+		std::streamsize precision = out.precision(std::numeric_limits<double>::max_digits10);
+		out << value;
+		out.precision(precision);
+	}
+
+	static void writeSeconds(std::ostream &out, uint64_t us) {
+		char str[32];
+		snprintf(str, sizeof(str), "%llu.%06llu", (unsigned long long) (us / 1000000), (unsigned long long) (us % 1000000));
+		out << str;
+	}
+
+	static void writeHeader(std::ostream &out, const char *name, const char *type, const char *help) {
+		out << "# HELP " << name << " " << help << "\n";
+		out << "# TYPE " << name << " " << type << "\n";
+	}
+
+	void write(std::ostream &out) {
+		for (int i = 0 ; i < COUNTER_COUNT ; ++i) {
+			const MetricInfo &info = counter_info[i];
+			if (i == 0 || strcmp(info.name, counter_info[i - 1].name) != 0)
+				writeHeader(out, info.name, "counter", info.help);
+			out << info.name;
+			if (info.labels[0] != '\0')
+				out << "{" << info.labels << "}";
+			out << " " << getCounter((counter) i) << "\n";
+		}
+
+		for (int i = 0 ; i < SUMMARY_COUNT ; ++i) {
+			const MetricInfo &info = summary_info[i];
+			if (i == 0 || strcmp(info.name, summary_info[i - 1].name) != 0)
+				writeHeader(out, info.name, "summary", info.help);
+			out << info.name << "_sum{" << info.labels << "} ";
+			writeExact(out, getSum((summary) i));
+			out << "\n";
+			out << info.name << "_count{" << info.labels << "} " << getCount((summary) i) << "\n";
+		}
+
+		const char *latency = "vespid_stage_latency_seconds";
+		writeHeader(out, latency, "summary", "Duration of the pipeline stages (see Trace).");
+		for (int i = 0 ; i < Trace::STAGE_COUNT ; ++i) {
+			const Trace::Histogram &h = Trace::getHistogram((Trace::stage) i);
+			const char *stage = Trace::getStageName((Trace::stage) i);
+			for (double q : quantiles) {
+				out << latency << "{stage=\"" << stage << "\",quantile=\"" << q << "\"} ";
+				writeSeconds(out, h.getPercentile(q));
+				out << "\n";
+			}
+			out << latency << "_sum{stage=\"" << stage << "\"} ";
+			writeSeconds(out, h.getSum());
+			out << "\n";
+			out << latency << "_count{stage=\"" << stage << "\"} " << h.getCount() << "\n";
+		}
+	}
+
+	ServerThread::~ServerThread() {
+		destruct();
+	}
+
+	void ServerThread::onStart() {
+		// Scrapes must not delay the pipeline
+		SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+		if (port > 0) {
+			int fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (fd < 0)
+				throw MetricsException("failed to create a socket");
+			m_listen_fds.push_back(fd);
+
+			int one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(port);
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+				throw MetricsException("failed to listen on port " + std::to_string(port));
+		}
+
+		if (!socket_path.empty()) {
+			struct sockaddr_un addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			if (socket_path.size() >= sizeof(addr.sun_path))
+				throw MetricsException("socket path too long: " + socket_path);
+			strcpy(addr.sun_path, socket_path.c_str());
+
+			int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0)
+				throw MetricsException("failed to create a socket");
+			m_listen_fds.push_back(fd);
+
+			// Remove the socket of a previous run, but nothing else
+			struct stat st;
+			if (lstat(socket_path.c_str(), &st) == 0) {
+				if (!S_ISSOCK(st.st_mode))
+					throw MetricsException(socket_path + " exists and is not a socket");
+				int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+				bool used = probe >= 0 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+				if (probe >= 0)
+					close(probe);
+				if (used)
+					throw MetricsException(socket_path + " is used by another instance");
+				unlink(socket_path.c_str());
+			}
+			if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+				throw MetricsException("failed to listen on " + socket_path);
+			m_socket_bound = true;
+			if (listen(fd, 4) != 0)
+				throw MetricsException("failed to listen on " + socket_path);
+		}
+	}
+
+	void ServerThread::onEnd() {
+		for (auto it = m_listen_fds.begin() ; it != m_listen_fds.end() ; ++it)
+			close(*it);
+		m_listen_fds.clear();
+		if (m_socket_bound)
+			unlink(socket_path.c_str());
+		m_socket_bound = false;
+	}
+
+	void ServerThread::loop() {
+		struct pollfd fds[2];
+		for (size_t i = 0 ; i < m_listen_fds.size() ; ++i) {
+			fds[i].fd = m_listen_fds[i];
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		if (poll(fds, m_listen_fds.size(), SERVER_TIMEOUT_MS) <= 0)
+			return;
+
+		for (size_t i = 0 ; i < m_listen_fds.size() ; ++i) {
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			int fd = accept(fds[i].fd, NULL, NULL);
+			if (fd < 0)
+				continue;
+			answer(fd);
+			close(fd);
+		}
+	}
+
+	void ServerThread::answer(int fd) {
+		// A slow client can't block the thread for long
+		struct timeval timeout = {REQUEST_TIMEOUT_MS / 1000, (REQUEST_TIMEOUT_MS % 1000) * 1000};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		// Only the request line is used
+		char request[REQUEST_MAX_SIZE];
+		size_t size = 0;
+		while (size < sizeof(request) - 1) {
+			ssize_t n = recv(fd, request + size, sizeof(request) - 1 - size, 0);
+			if (n <= 0)
+				break;
+			size += n;
+			request[size] = '\0';
+			if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+				break;
+		}
+		request[size] = '\0';
+		std::string line(request, strcspn(request, "\r\n"));
+
+		std::ostringstream body;
+		std::string status = "200 OK";
+		if (line.compare(0, 4, "GET ") != 0) {
+			status = "405 Method Not Allowed";
+		} else {
+			std::string path = line.substr(4, line.find(' ', 4) - 4);
+			if (path == "/metrics" || path == "/")
+				write(body);
+			else
+				status = "404 Not Found";
+		}
+		if (status != "200 OK")
+			body << status << "\n";
+
+		std::string content = body.str();
+		std::ostringstream response;
+		response << "HTTP/1.0 " << status << "\r\n"
+			<< "Content-Type: text/plain; version=0.0.4\r\n"
+			<< "Content-Length: " << content.size() << "\r\n"
+			<< "Connection: close\r\n\r\n" << content;
+
+		// Closed connections must not raise SIGPIPE
+		std::string data = response.str();
+		const char *p = data.data();
+		size_t remaining = data.size();
+		while (remaining > 0) {
+			ssize_t n = send(fd, p, remaining, MSG_NOSIGNAL);
+			if (n <= 0)
+				return;
+			p += n;
+			remaining -= n;
+		}
+	}
+
+	Server::Server() {
+		m_thread.port = Conf::getInt("METRICS_PORT", 0);
+		if (m_thread.port < 0 || m_thread.port > 65535)
+			throw Conf::ConfException("METRICS_PORT");
+		m_thread.socket_path = Conf::getString("METRICS_SOCKET", "");
+
+		m_thread.launch("MetricsThread");
+	}
+
+	bool isConfEnabled() {
+		return Conf::getInt("METRICS_PORT", 0) != 0 || !Conf::getString("METRICS_SOCKET", "").empty();
+	}
+}
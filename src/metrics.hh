@@ -0,0 +1,102 @@
+#pragma once
+
+#include <exception>
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "util.hh"
+
+// Number of counter shards, given to the threads in turn on their first
+// update
+#define METRICS_SHARDS 16
+
+// Pipeline metrics, served in the Prometheus text format. Counters are
+// sharded per thread so that updating them is a relaxed atomic addition to
+// a cache line which is not shared with other threads; reads sum the
+// shards. The latency histograms of Trace are served as summaries.
+namespace Metrics {
+	struct MetricsException : public std::exception {
+		MetricsException(std::string p_msg) : msg(p_msg) {}
+		const char* what() const noexcept {
+			static char ret[300];
+			snprintf(ret, 300, "Metrics server error: %s", msg.c_str());
+			return ret;
+		}
+
+		std::string msg;
+	};
+
+	enum counter {
+		// Frames captured, and frames dropped because all the slots of
+		// the ring were held
+		CAMERA_FRAMES,
+		CAMERA_DROPPED,
+		// Frames not retrieved by each consumer, in the order of the
+		// CAMERA_CLASER_ONSUMER_*_ID identifiers
+		CONSUMER_SKIPPED_MAIN,
+		CONSUMER_SKIPPED_PROCESSING,
+		// Frames classified by a forward pass, alone or for a decision,
+		// and unchanged frames which got the previous result
+		INFERENCE_SINGLE,
+		INFERENCE_BATCH,
+		INFERENCE_REUSED,
+		GPIO_LOOPS,
+		// Laser breaks (or simulated ones) starting the active mode
+		TRIGGERS,
+		COUNTER_COUNT
+	};
+
+	// Observations whose count and sum are exported
+	enum summary {
+		// Average asian probability of the frames of each decision
+		DECISION_ASIAN,
+		DECISION_NOT_ASIAN,
+		SUMMARY_COUNT
+	};
+
+	void increment(counter c, unsigned long n = 1);
+	void observe(summary s, double value);
+	unsigned long getCounter(counter c);
+	unsigned long getCount(summary s);
+	double getSum(summary s);
+
+	// Writes all the metrics in the Prometheus text format
+	void write(std::ostream &out);
+
+	// Answers HTTP requests with the metrics, on the listening sockets
+	class ServerThread : public Thread::ThreadBase {
+	public:
+		virtual void onStart();
+		virtual void onEnd();
+		virtual void loop();
+		~ServerThread();
+
+		// Loopback TCP port (0 if unused) and Unix socket path (empty if
+		// unused)
+		long port = 0;
+		std::string socket_path;
+
+	private:
+		void answer(int fd);
+
+		std::vector<int> m_listen_fds;
+		// True once socket_path is ours to remove
+		bool m_socket_bound = false;
+	};
+
+	// Serves the metrics on 127.0.0.1:METRICS_PORT and/or on the
+	// METRICS_SOCKET Unix socket, at low priority.
+	class Server {
+	public:
+		Server();
+
+	private:
+		ServerThread m_thread;
+	};
+
+	// True if METRICS_PORT or METRICS_SOCKET is set
+	bool isConfEnabled();
+}
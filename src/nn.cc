@@ -0,0 +1,780 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define NN_NEON
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#define NN_SSE
+#endif
+
+#include "nn.hh"
+
+#define NN_FILE_MAGIC "vespid-nn"
+#define NN_FILE_VERSION 1
+#define NN_CALIBRATION_MAGIC "vespid-calibration"
+#define NN_CALIBRATION_VERSION 1
+// Largest quantised value, -128 is not used so that the quantisation is
+// symmetric
+#define NN_QMAX 127
+
+namespace NN {
+	static void readValues(std::ifstream &file, std::vector<float> &values, size_t n) {
+		values.resize(n);
+		for (size_t i = 0 ; i < n ; ++i)
+			file >> values[i];
+	}
+
+	void Network::load(const std::string &path) {
+		std::ifstream file(path);
+		if (!file)
+			throw NNException("failed to open " + path);
+
+		std::string word;
+		int version;
+		file >> word >> version;
+		if (word != NN_FILE_MAGIC || version != NN_FILE_VERSION)
+			throw NNException(path + " is not a network file (run torchnn/export.lua)");
+
+		int n_categories;
+		file >> word >> n_categories;
+		m_categories.resize(n_categories);
+		for (int i = 0 ; i < n_categories ; ++i)
+			file >> m_categories[i];
+
+		file >> word >> m_in_c >> m_in_h >> m_in_w;
+		file >> word;
+		readValues(file, m_mean, m_in_c);
+		file >> word;
+		readValues(file, m_stdv, m_in_c);
+
+		int n_layers;
+		file >> word >> n_layers;
+		m_layers.clear();
+
+		int c = m_in_c, h = m_in_h, w = m_in_w;
+		for (int i = 0 ; i < n_layers && file ; ++i) {
+			Layer layer;
+			file >> word;
+			if (word == "conv") {
+				int in_c;
+				layer.type = LAYER_CONV;
+				file >> in_c >> layer.c >> layer.kh >> layer.kw;
+				if (in_c != c)
+					throw NNException("convolution input size mismatch in " + path);
+				readValues(file, layer.weight, layer.c * in_c * layer.kh * layer.kw);
+				readValues(file, layer.bias, layer.c);
+			} else if (word == "relu") {
+				layer.type = LAYER_RELU;
+			} else if (word == "maxpool") {
+				layer.type = LAYER_MAXPOOL;
+				file >> layer.kh >> layer.kw >> layer.dh >> layer.dw;
+			} else if (word == "view") {
+				layer.type = LAYER_VIEW;
+			} else if (word == "linear") {
+				int in_n;
+				layer.type = LAYER_LINEAR;
+				file >> in_n >> layer.c;
+				if (in_n != c * h * w)
+					throw NNException("linear input size mismatch in " + path);
+				readValues(file, layer.weight, layer.c * in_n);
+				readValues(file, layer.bias, layer.c);
+			} else if (word == "logsoftmax") {
+				layer.type = LAYER_LOGSOFTMAX;
+			} else {
+				throw NNException("unknown layer " + word + " in " + path);
+			}
+			if (!file)
+				break;
+
+			setOutputSize(layer, c, h, w);
+			c = layer.c; h = layer.h; w = layer.w;
+			m_layers.push_back(layer);
+		}
+
+		if (!file)
+			throw NNException("failed to read " + path);
+		setup(path);
+	}
+
+	void Network::create(const std::vector<std::string> &categories, int in_c, int in_h, int in_w,
+			const std::vector<float> &mean, const std::vector<float> &stdv, const std::vector<Layer> &layers) {
+		m_categories = categories;
+		m_in_c = in_c; m_in_h = in_h; m_in_w = in_w;
+		m_mean = mean;
+		m_stdv = stdv;
+		m_layers = layers;
+		if ((int) mean.size() != in_c || (int) stdv.size() != in_c)
+			throw NNException("normalization size mismatch");
+
+		int c = in_c, h = in_h, w = in_w;
+		for (auto it = m_layers.begin() ; it != m_layers.end() ; ++it) {
+			size_t weights = 0, biases = 0;
+			if (it->type == LAYER_CONV) {
+				weights = it->c * c * it->kh * it->kw;
+				biases = it->c;
+			} else if (it->type == LAYER_LINEAR) {
+				weights = it->c * c * h * w;
+				biases = it->c;
+			}
+			if (it->weight.size() != weights || it->bias.size() != biases)
+				throw NNException("layer weights size mismatch");
+
+			setOutputSize(*it, c, h, w);
+			c = it->c; h = it->h; w = it->w;
+		}
+		setup("the new network");
+	}
+
+	void Network::setup(const std::string &path) {
+		if (m_layers.empty() || getOutputSize() != (int) m_categories.size())
+			throw NNException("output size does not match categories in " + path);
+
+		size_t max_size = m_in_c * m_in_h * m_in_w;
+		for (auto it = m_layers.begin() ; it != m_layers.end() ; ++it)
+			max_size = std::max(max_size, (size_t) (it->c * it->h * it->w));
+		m_max_size = max_size;
+		m_buf_a.resize(max_size);
+		m_buf_b.resize(max_size);
+	}
+
+	static void writeValues(std::ofstream &file, const std::vector<float> &values) {
+		for (auto it = values.begin() ; it != values.end() ; ++it)
+			file << *it << "\n";
+	}
+
+	void Network::save(const std::string &path) const {
+		std::ofstream file(path);
+		file.precision(9);
+		file << NN_FILE_MAGIC << " " << NN_FILE_VERSION << "\n";
+		file << "categories " << m_categories.size();
+		for (auto it = m_categories.begin() ; it != m_categories.end() ; ++it)
+			file << " " << *it;
+		file << "\ninput " << m_in_c << " " << m_in_h << " " << m_in_w << "\n";
+		file << "mean";
+		for (auto it = m_mean.begin() ; it != m_mean.end() ; ++it)
+			file << " " << *it;
+		file << "\nstdv";
+		for (auto it = m_stdv.begin() ; it != m_stdv.end() ; ++it)
+			file << " " << *it;
+		file << "\nlayers " << m_layers.size() << "\n";
+
+		int c = m_in_c, h = m_in_h, w = m_in_w;
+		for (auto it = m_layers.begin() ; it != m_layers.end() ; ++it) {
+			switch (it->type) {
+			case LAYER_CONV:
+				file << "conv " << c << " " << it->c << " " << it->kh << " " << it->kw << "\n";
+				break;
+			case LAYER_RELU:
+				file << "relu\n";
+				break;
+			case LAYER_MAXPOOL:
+				file << "maxpool " << it->kh << " " << it->kw << " " << it->dh << " " << it->dw << "\n";
+				break;
+			case LAYER_VIEW:
+				file << "view\n";
+				break;
+			case LAYER_LINEAR:
+				file << "linear " << c * h * w << " " << it->c << "\n";
+				break;
+			case LAYER_LOGSOFTMAX:
+				file << "logsoftmax\n";
+				break;
+			}
+			writeValues(file, it->weight);
+			writeValues(file, it->bias);
+			c = it->c; h = it->h; w = it->w;
+		}
+
+		if (!file)
+			throw NNException("failed to write " + path);
+	}
+
+	void setOutputSize(Layer &layer, int c, int h, int w) {
+		switch (layer.type) {
+		case LAYER_CONV:
+			layer.h = h - layer.kh + 1;
+			layer.w = w - layer.kw + 1;
+			break;
+		case LAYER_MAXPOOL:
+			if (layer.dh < 1 || layer.dw < 1)
+				throw NNException("invalid pooling stride");
+			layer.c = c;
+			layer.h = (h - layer.kh) / layer.dh + 1;
+			layer.w = (w - layer.kw) / layer.dw + 1;
+			break;
+		case LAYER_LINEAR:
+			layer.h = layer.w = 1;
+			break;
+		case LAYER_RELU:
+			layer.c = c; layer.h = h; layer.w = w;
+			break;
+		case LAYER_VIEW:
+		case LAYER_LOGSOFTMAX:
+			layer.c = c * h * w; layer.h = layer.w = 1;
+			break;
+		}
+
+		if (layer.c < 1 || layer.h < 1 || layer.w < 1
+				|| ((layer.type == LAYER_CONV || layer.type == LAYER_MAXPOOL) && (layer.kh < 1 || layer.kw < 1)))
+			throw NNException("layer does not fit its input");
+	}
+
+	void Network::normalize(float *input) const {
+		const int plane_size = m_in_h * m_in_w;
+		for (int c = 0 ; c < m_in_c ; ++c) {
+			const float mean = m_mean[c], inv_stdv = 1.f / m_stdv[c];
+			for (int i = 0 ; i < plane_size ; ++i, ++input)
+				*input = (*input - mean) * inv_stdv;
+		}
+	}
+
+	void Network::forward(const float *input, float *output) {
+		forwardBatch(input, 1, output);
+	}
+
+	void Network::forwardBatch(const float *inputs, int n, float *outputs) {
+		forwardLayers(inputs, n, outputs, NULL);
+	}
+
+	void Network::measureRanges(const float *inputs, int n, Calibration &calibration) {
+		if (calibration.ranges.size() != m_layers.size())
+			calibration.ranges.assign(m_layers.size(), 0.f);
+
+		std::vector<float> outputs(n * getOutputSize());
+		forwardLayers(inputs, n, outputs.data(), &calibration);
+		calibration.images += n;
+	}
+
+	void Network::forwardLayers(const float *inputs, int n, float *outputs, Calibration *calibration) {
+		if (m_buf_a.size() < m_max_size * n) {
+			m_buf_a.resize(m_max_size * n);
+			m_buf_b.resize(m_max_size * n);
+		}
+
+		const float *in = inputs;
+		float *out = m_buf_a.data();
+		int c = m_in_c, h = m_in_h, w = m_in_w;
+
+		for (auto it = m_layers.begin() ; it != m_layers.end() ; ++it) {
+			const int in_size = c * h * w, out_size = it->c * it->h * it->w;
+			if (calibration != NULL) {
+				float &range = calibration->ranges[it - m_layers.begin()];
+				for (int i = 0 ; i < n * in_size ; ++i)
+					range = std::max(range, std::fabs(in[i]));
+			}
+
+			switch (it->type) {
+			case LAYER_CONV:
+				for (int i = 0 ; i < n ; ++i)
+					Kernel::conv(in + i * in_size, c, h, w, *it, out + i * out_size);
+				break;
+			case LAYER_RELU:
+				std::copy(in, in + n * in_size, out);
+				Kernel::relu(out, n * in_size);
+				break;
+			case LAYER_MAXPOOL:
+				for (int i = 0 ; i < n ; ++i)
+					Kernel::maxpool(in + i * in_size, h, w, *it, out + i * out_size);
+				break;
+			case LAYER_VIEW:
+				std::copy(in, in + n * in_size, out);
+				break;
+			case LAYER_LINEAR:
+				Kernel::linear(in, in_size, n, *it, out);
+				break;
+			case LAYER_LOGSOFTMAX:
+				for (int i = 0 ; i < n ; ++i)
+					Kernel::softmax(in + i * in_size, in_size, out + i * out_size);
+				break;
+			}
+
+			c = it->c; h = it->h; w = it->w;
+			in = out;
+			out = (out == m_buf_a.data()) ? m_buf_b.data() : m_buf_a.data();
+		}
+
+		std::copy(in, in + n * c * h * w, outputs);
+	}
+
+	void Calibration::load(const std::string &path) {
+		std::ifstream file(path);
+		if (!file)
+			throw NNException("failed to open " + path);
+
+		std::string word;
+		int version;
+		size_t n_layers;
+		file >> word >> version;
+		if (word != NN_CALIBRATION_MAGIC || version != NN_CALIBRATION_VERSION)
+			throw NNException(path + " is not a calibration file (run vespid-calibrate)");
+		file >> word >> images >> word >> n_layers;
+		readValues(file, ranges, n_layers);
+		if (!file)
+			throw NNException("failed to read " + path);
+	}
+
+	void Calibration::save(const std::string &path) const {
+		std::ofstream file(path);
+		file << NN_CALIBRATION_MAGIC << " " << NN_CALIBRATION_VERSION << "\n";
+		file << "images " << images << "\n";
+		file << "layers " << ranges.size() << "\n";
+		file.precision(9);
+		for (auto it = ranges.begin() ; it != ranges.end() ; ++it)
+			file << *it << "\n";
+		if (!file)
+			throw NNException("failed to write " + path);
+	}
+
+	static bool isWeighted(const Layer &layer) {
+		return layer.type == LAYER_CONV || layer.type == LAYER_LINEAR;
+	}
+
+	// Scale of the activations whose largest absolute value is range
+	static float activationScale(float range) {
+		return (range > 0.f) ? range / NN_QMAX : 1.f;
+	}
+
+	void QuantizedNetwork::load(const Network &net, const Calibration &calibration) {
+		const std::vector<Layer> &layers = net.getLayers();
+		if (calibration.ranges.size() != layers.size())
+			throw NNException("the calibration does not match the network");
+
+		m_in_c = net.getInputChannels();
+		m_in_h = net.getInputHeight();
+		m_in_w = net.getInputWidth();
+		m_layers.clear();
+
+		// Scale of the input of each weighted layer, the activations keep
+		// it until the next one.
+		std::vector<float> scales(layers.size() + 1, 0.f);
+		float scale = 0.f;
+		for (size_t i = layers.size() ; i-- > 0 ; ) {
+			if (isWeighted(layers[i]))
+				scale = activationScale(calibration.ranges[i]);
+			scales[i] = scale;
+		}
+		if (scales[0] == 0.f)
+			throw NNException("the network has no convolution or linear layer");
+		m_in_scale = scales[0];
+
+		bool float_output = false;
+		size_t max_size = m_in_c * m_in_h * m_in_w;
+		int in_c = m_in_c, in_h = m_in_h, in_w = m_in_w;
+		for (size_t i = 0 ; i < layers.size() ; ++i) {
+			const Layer &layer = layers[i];
+			if (float_output && layer.type != LAYER_LOGSOFTMAX)
+				throw NNException("only LogSoftMax can follow the last linear layer");
+			if (layer.type == LAYER_LOGSOFTMAX && !float_output)
+				throw NNException("LogSoftMax must follow a linear layer");
+
+			QuantizedLayer q;
+			static_cast<Layer&>(q) = layer;
+			q.weight.clear();
+			q.bias.clear();
+
+			if (isWeighted(layer)) {
+				// Scale of the output: input scale of the next weighted
+				// layer, if any
+				float out_scale = scales[i + 1];
+				q.float_output = float_output = (out_scale == 0.f);
+				if (q.float_output && layer.type != LAYER_LINEAR)
+					throw NNException("the last weighted layer must be linear");
+
+				const size_t per_output = layer.weight.size() / layer.c;
+				q.qweight.resize(layer.weight.size());
+				if (layer.type == LAYER_CONV) {
+					for (int ci = 0 ; ci < in_c ; ++ci)
+						for (int ky = 0 ; ky < layer.kh ; ++ky)
+							for (int kx = 0 ; kx < layer.kw ; ++kx)
+								q.offsets.push_back((ci * in_h + ky) * in_w + kx);
+					if (q.taps() % 2 != 0)
+						q.offsets.push_back(0);
+					q.cweight.assign(layer.c * q.taps(), 0);
+				}
+				q.multiplier.resize(layer.c);
+				q.offset.resize(layer.c);
+				for (int o = 0 ; o < layer.c ; ++o) {
+					const float *w = layer.weight.data() + o * per_output;
+					float w_max = 0.f;
+					for (size_t k = 0 ; k < per_output ; ++k)
+						w_max = std::max(w_max, std::fabs(w[k]));
+					float w_scale = activationScale(w_max);
+					Kernel::quantize(w, 1.f / w_scale, per_output, q.qweight.data() + o * per_output);
+					if (layer.type == LAYER_CONV)
+						std::copy(q.qweight.begin() + o * per_output, q.qweight.begin() + (o + 1) * per_output,
+							q.cweight.begin() + o * q.taps());
+
+					float div = q.float_output ? 1.f : out_scale;
+					q.multiplier[o] = w_scale * scales[i] / div;
+					q.offset[o] = layer.bias[o] / div;
+				}
+			}
+
+			if (layer.type == LAYER_CONV) {
+				q.qweight.clear();
+				m_wide.resize(std::max(m_wide.size(), (size_t) (in_c * in_h * in_w + 8)));
+				m_acc.resize(std::max(m_acc.size(), (size_t) ((layer.h - 1) * in_w + layer.w + 7)));
+			}
+
+			max_size = std::max(max_size, (size_t) (layer.c * layer.h * layer.w));
+			in_c = layer.c; in_h = layer.h; in_w = layer.w;
+			m_layers.push_back(q);
+		}
+
+		if (!float_output)
+			throw NNException("the network must end with a linear layer");
+		m_max_size = max_size;
+	}
+
+	void QuantizedNetwork::forwardBatch(const float *inputs, int n, float *outputs) {
+		if (m_buf_a.size() < m_max_size * n) {
+			m_buf_a.resize(m_max_size * n);
+			m_buf_b.resize(m_max_size * n);
+			m_float_a.resize(m_max_size * n);
+			m_float_b.resize(m_max_size * n);
+		}
+
+		int c = m_in_c, h = m_in_h, w = m_in_w;
+		int8_t *in = m_buf_a.data(), *out = m_buf_b.data();
+		Kernel::quantize(inputs, 1.f / m_in_scale, n * c * h * w, in);
+		// Set once the last linear layer has been computed
+		float *fin = NULL, *fout = m_float_a.data();
+
+		for (auto it = m_layers.begin() ; it != m_layers.end() ; ++it) {
+			const int in_size = c * h * w, out_size = it->c * it->h * it->w;
+			switch (it->type) {
+			case LAYER_CONV:
+				// The rows of the accumulators have the width of the
+				// input rows, so that all the kernel coefficients apply
+				// to the same contiguous range of the input. The last
+				// kw - 1 columns are not part of the output.
+				for (int i = 0 ; i < n ; ++i) {
+					std::copy(in + i * in_size, in + (i + 1) * in_size, m_wide.begin());
+					const int acc_size = (it->h - 1) * w + it->w;
+					for (int o = 0 ; o < it->c ; ++o) {
+						Kernel::conv(m_wide.data(), *it, o, acc_size, m_acc.data());
+						int8_t *out_plane = out + i * out_size + o * it->h * it->w;
+						for (int y = 0 ; y < it->h ; ++y)
+							Kernel::requantize(m_acc.data() + y * w, it->w, it->multiplier[o], it->offset[o],
+								out_plane + y * it->w);
+					}
+				}
+				break;
+			case LAYER_RELU:
+				std::copy(in, in + n * in_size, out);
+				Kernel::relu(out, n * in_size);
+				break;
+			case LAYER_MAXPOOL:
+				for (int i = 0 ; i < n ; ++i)
+					Kernel::maxpool(in + i * in_size, h, w, *it, out + i * out_size);
+				break;
+			case LAYER_VIEW:
+				std::copy(in, in + n * in_size, out);
+				break;
+			case LAYER_LINEAR: {
+				const int8_t *weight = it->qweight.data();
+				for (int o = 0 ; o < it->c ; ++o, weight += in_size) {
+					for (int i = 0 ; i < n ; ++i) {
+						int32_t acc = Kernel::dot(weight, in + i * in_size, in_size);
+						if (it->float_output)
+							fout[i * it->c + o] = acc * it->multiplier[o] + it->offset[o];
+						else
+							Kernel::requantize(&acc, 1, it->multiplier[o], it->offset[o], out + i * it->c + o);
+					}
+				}
+				if (it->float_output) {
+					fin = fout;
+					fout = m_float_b.data();
+				}
+				break;
+			}
+			case LAYER_LOGSOFTMAX:
+				for (int i = 0 ; i < n ; ++i)
+					Kernel::softmax(fin + i * in_size, in_size, fout + i * out_size);
+				std::swap(fin, fout);
+				break;
+			}
+
+			c = it->c; h = it->h; w = it->w;
+			std::swap(in, out);
+		}
+
+		std::copy(fin, fin + n * c * h * w, outputs);
+	}
+
+	namespace Kernel {
+		void axpy(float *y, const float *x, float a, int n) {
+			int i = 0;
+#if defined(NN_NEON)
+			float32x4_t va = vdupq_n_f32(a);
+			for ( ; i + 4 <= n ; i += 4)
+				vst1q_f32(y + i, vmlaq_f32(vld1q_f32(y + i), va, vld1q_f32(x + i)));
+#elif defined(NN_SSE)
+			__m128 va = _mm_set1_ps(a);
+			for ( ; i + 4 <= n ; i += 4)
+				_mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i))));
+#endif
+			for ( ; i < n ; ++i)
+				y[i] += a * x[i];
+		}
+
+		float dot(const float *x, const float *y, int n) {
+			int i = 0;
+			float sum = 0.f;
+#if defined(NN_NEON)
+			float32x4_t acc = vdupq_n_f32(0.f);
+			for ( ; i + 4 <= n ; i += 4)
+				acc = vmlaq_f32(acc, vld1q_f32(x + i), vld1q_f32(y + i));
+			float32x2_t acc2 = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+			sum = vget_lane_f32(vpadd_f32(acc2, acc2), 0);
+#elif defined(NN_SSE)
+			__m128 acc = _mm_setzero_ps();
+			for ( ; i + 4 <= n ; i += 4)
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+			float part[4];
+			_mm_storeu_ps(part, acc);
+			sum = (part[0] + part[1]) + (part[2] + part[3]);
+#endif
+			for ( ; i < n ; ++i)
+				sum += x[i] * y[i];
+			return sum;
+		}
+
+		void relu(float *x, int n) {
+			int i = 0;
+#if defined(NN_NEON)
+			float32x4_t zero = vdupq_n_f32(0.f);
+			for ( ; i + 4 <= n ; i += 4)
+				vst1q_f32(x + i, vmaxq_f32(vld1q_f32(x + i), zero));
+#elif defined(NN_SSE)
+			__m128 zero = _mm_setzero_ps();
+			for ( ; i + 4 <= n ; i += 4)
+				_mm_storeu_ps(x + i, _mm_max_ps(_mm_loadu_ps(x + i), zero));
+#endif
+			for ( ; i < n ; ++i)
+				x[i] = (x[i] > 0.f) ? x[i] : 0.f;
+		}
+
+		void conv(const float *in, int in_c, int in_h, int in_w, const Layer &layer, float *out) {
+			// Valid convolution with stride 1: each output row is a sum
+			// of shifted input rows scaled by a kernel coefficient, which
+			// maps directly to axpy.
+			const float *weight = layer.weight.data();
+			for (int o = 0 ; o < layer.c ; ++o) {
+				float *out_plane = out + o * layer.h * layer.w;
+				std::fill(out_plane, out_plane + layer.h * layer.w, layer.bias[o]);
+
+				for (int i = 0 ; i < in_c ; ++i) {
+					const float *in_plane = in + i * in_h * in_w;
+					for (int ky = 0 ; ky < layer.kh ; ++ky) {
+						for (int kx = 0 ; kx < layer.kw ; ++kx) {
+							float k = *weight++;
+							for (int y = 0 ; y < layer.h ; ++y)
+								axpy(out_plane + y * layer.w, in_plane + (y + ky) * in_w + kx, k, layer.w);
+						}
+					}
+				}
+			}
+		}
+
+		template<typename T>
+		static void maxpoolT(const T *in, int in_h, int in_w, const Layer &layer, T *out) {
+			for (int c = 0 ; c < layer.c ; ++c) {
+				const T *in_plane = in + c * in_h * in_w;
+				for (int y = 0 ; y < layer.h ; ++y) {
+					for (int x = 0 ; x < layer.w ; ++x) {
+						const T *window = in_plane + y * layer.dh * in_w + x * layer.dw;
+						T m = window[0];
+						for (int ky = 0 ; ky < layer.kh ; ++ky)
+							for (int kx = 0 ; kx < layer.kw ; ++kx)
+								m = std::max(m, window[ky * in_w + kx]);
+						*out++ = m;
+					}
+				}
+			}
+		}
+
+		void maxpool(const float *in, int in_h, int in_w, const Layer &layer, float *out) {
+			maxpoolT(in, in_h, in_w, layer, out);
+		}
+
+		void linear(const float *in, int in_n, int n, const Layer &layer, float *out) {
+			const float *weight = layer.weight.data();
+			for (int o = 0 ; o < layer.c ; ++o, weight += in_n)
+				for (int i = 0 ; i < n ; ++i)
+					out[i * layer.c + o] = layer.bias[o] + dot(weight, in + i * in_n, in_n);
+		}
+
+		void softmax(const float *in, int n, float *out) {
+			float m = *std::max_element(in, in + n);
+			float sum = 0.f;
+			for (int i = 0 ; i < n ; ++i) {
+				out[i] = std::exp(in[i] - m);
+				sum += out[i];
+			}
+			for (int i = 0 ; i < n ; ++i)
+				out[i] /= sum;
+		}
+
+		void conv(const int16_t *in, const QuantizedLayer &layer, int o, int n, int32_t *acc) {
+			// Blocks of 8 accumulators stay in registers for all the taps
+			const int taps = layer.taps();
+			const int *offsets = layer.offsets.data();
+			const int16_t *weight = layer.cweight.data() + o * taps;
+			for (int p = 0 ; p < n ; p += 8) {
+				const int16_t *src = in + p;
+#if defined(NN_NEON)
+				int32x4_t lo = vdupq_n_s32(0), hi = vdupq_n_s32(0);
+				for (int t = 0 ; t < taps ; ++t) {
+					int16x8_t x = vld1q_s16(src + offsets[t]);
+					lo = vmlal_n_s16(lo, vget_low_s16(x), weight[t]);
+					hi = vmlal_n_s16(hi, vget_high_s16(x), weight[t]);
+				}
+				vst1q_s32(acc + p, lo);
+				vst1q_s32(acc + p + 4, hi);
+#elif defined(NN_SSE)
+				// Pairs of taps: interleave their inputs and multiply
+				// them by (w0, w1) with pmaddwd
+				__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+				for (int t = 0 ; t < taps ; t += 2) {
+					__m128i a = _mm_loadu_si128((const __m128i*) (src + offsets[t]));
+					__m128i b = _mm_loadu_si128((const __m128i*) (src + offsets[t + 1]));
+					__m128i k = _mm_set1_epi32((uint16_t) weight[t] | ((uint32_t) (uint16_t) weight[t + 1] << 16));
+					lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k));
+					hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k));
+				}
+				_mm_storeu_si128((__m128i*) (acc + p), lo);
+				_mm_storeu_si128((__m128i*) (acc + p + 4), hi);
+#else
+				for (int j = 0 ; j < 8 ; ++j) {
+					int32_t sum = 0;
+					for (int t = 0 ; t < taps ; ++t)
+						sum += weight[t] * src[offsets[t] + j];
+					acc[p + j] = sum;
+				}
+#endif
+			}
+		}
+
+		int32_t dot(const int8_t *x, const int8_t *y, int n) {
+			int i = 0;
+			int32_t sum = 0;
+#if defined(NN_NEON)
+			int32x4_t acc = vdupq_n_s32(0);
+			for ( ; i + 8 <= n ; i += 8)
+				acc = vpadalq_s16(acc, vmull_s8(vld1_s8(x + i), vld1_s8(y + i)));
+			int32x2_t acc2 = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+			sum = vget_lane_s32(vpadd_s32(acc2, acc2), 0);
+#elif defined(NN_SSE)
+			__m128i acc = _mm_setzero_si128();
+			for ( ; i + 8 <= n ; i += 8) {
+				__m128i vx = _mm_loadl_epi64((const __m128i*) (x + i));
+				__m128i vy = _mm_loadl_epi64((const __m128i*) (y + i));
+				vx = _mm_srai_epi16(_mm_unpacklo_epi8(vx, vx), 8);
+				vy = _mm_srai_epi16(_mm_unpacklo_epi8(vy, vy), 8);
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(vx, vy));
+			}
+			int32_t part[4];
+			_mm_storeu_si128((__m128i*) part, acc);
+			sum = (part[0] + part[1]) + (part[2] + part[3]);
+#endif
+			for ( ; i < n ; ++i)
+				sum += x[i] * y[i];
+			return sum;
+		}
+
+		void relu(int8_t *x, int n) {
+			int i = 0;
+#if defined(NN_NEON)
+			int8x16_t zero = vdupq_n_s8(0);
+			for ( ; i + 16 <= n ; i += 16)
+				vst1q_s8(x + i, vmaxq_s8(vld1q_s8(x + i), zero));
+#elif defined(NN_SSE)
+			__m128i zero = _mm_setzero_si128();
+			for ( ; i + 16 <= n ; i += 16) {
+				__m128i *vx = (__m128i*) (x + i);
+				__m128i v = _mm_loadu_si128(vx);
+				_mm_storeu_si128(vx, _mm_and_si128(v, _mm_cmpgt_epi8(v, zero)));
+			}
+#endif
+			for ( ; i < n ; ++i)
+				x[i] = (x[i] > 0) ? x[i] : 0;
+		}
+
+		void maxpool(const int8_t *in, int in_h, int in_w, const Layer &layer, int8_t *out) {
+			maxpoolT(in, in_h, in_w, layer, out);
+		}
+
+		// Rounds half away from zero and saturates, in the same way on all
+		// platforms.
+		static inline int8_t saturate(float v) {
+			v = std::min(std::max(v, (float) -NN_QMAX), (float) NN_QMAX);
+			return (int8_t) (int) (v + ((v >= 0.f) ? 0.5f : -0.5f));
+		}
+
+#if defined(NN_NEON)
+		static inline int8x8_t saturate(float32x4_t lo, float32x4_t hi) {
+			const float32x4_t half = vdupq_n_f32(0.5f);
+			const uint32x4_t sign = vdupq_n_u32(0x80000000);
+			// +-0.5 with the sign of the value, then truncate
+			lo = vaddq_f32(lo, vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(half),
+				vandq_u32(vreinterpretq_u32_f32(lo), sign))));
+			hi = vaddq_f32(hi, vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(half),
+				vandq_u32(vreinterpretq_u32_f32(hi), sign))));
+			int16x8_t v = vcombine_s16(vqmovn_s32(vcvtq_s32_f32(lo)), vqmovn_s32(vcvtq_s32_f32(hi)));
+			return vmax_s8(vqmovn_s16(v), vdup_n_s8(-NN_QMAX));
+		}
+#elif defined(NN_SSE)
+		static inline __m128i saturate(__m128 lo, __m128 hi) {
+			const __m128 half = _mm_set1_ps(0.5f), sign = _mm_set1_ps(-0.f);
+			lo = _mm_add_ps(lo, _mm_or_ps(half, _mm_and_ps(lo, sign)));
+			hi = _mm_add_ps(hi, _mm_or_ps(half, _mm_and_ps(hi, sign)));
+			__m128i v = _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi));
+			v = _mm_max_epi16(v, _mm_set1_epi16(-NN_QMAX));
+			return _mm_packs_epi16(v, v);
+		}
+#endif
+
+		void quantize(const float *in, float inv_scale, int n, int8_t *out) {
+			int i = 0;
+#if defined(NN_NEON)
+			for ( ; i + 8 <= n ; i += 8)
+				vst1_s8(out + i, saturate(vmulq_n_f32(vld1q_f32(in + i), inv_scale),
+					vmulq_n_f32(vld1q_f32(in + i + 4), inv_scale)));
+#elif defined(NN_SSE)
+			__m128 vs = _mm_set1_ps(inv_scale);
+			for ( ; i + 8 <= n ; i += 8)
+				_mm_storel_epi64((__m128i*) (out + i), saturate(_mm_mul_ps(_mm_loadu_ps(in + i), vs),
+					_mm_mul_ps(_mm_loadu_ps(in + i + 4), vs)));
+#endif
+			for ( ; i < n ; ++i)
+				out[i] = saturate(in[i] * inv_scale);
+		}
+
+		void requantize(const int32_t *acc, int n, float multiplier, float offset, int8_t *out) {
+			int i = 0;
+#if defined(NN_NEON)
+			float32x4_t vo = vdupq_n_f32(offset);
+			for ( ; i + 8 <= n ; i += 8)
+				vst1_s8(out + i, saturate(vmlaq_n_f32(vo, vcvtq_f32_s32(vld1q_s32(acc + i)), multiplier),
+					vmlaq_n_f32(vo, vcvtq_f32_s32(vld1q_s32(acc + i + 4)), multiplier)));
+#elif defined(NN_SSE)
+			__m128 vm = _mm_set1_ps(multiplier), vo = _mm_set1_ps(offset);
+			for ( ; i + 8 <= n ; i += 8) {
+				const __m128i *va = (const __m128i*) (acc + i);
+				__m128 lo = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(va)), vm), vo);
+				__m128 hi = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(va + 1)), vm), vo);
+				_mm_storel_epi64((__m128i*) (out + i), saturate(lo, hi));
+			}
+#endif
+			for ( ; i < n ; ++i)
+				out[i] = saturate(acc[i] * multiplier + offset);
+		}
+	}
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <exception>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+// Native implementation of the forward pass of the networks built by
+// torchnn/train.lua. Weights are read from the text file written by
+// torchnn/export.lua or vespid-train. Computations are made in single
+// precision; the resulting probabilities match the Torch ones within
+// NN_TOLERANCE.
+// QuantizedNetwork runs the same network with 8 bit integers.
+#define NN_TOLERANCE 1e-4
+
+namespace NN {
+	struct NNException : public std::exception {
+		NNException(std::string p_msg) : msg(p_msg) {}
+		const char* what() const noexcept {
+			static char ret[300];
+			snprintf(ret, 300, "Neural network error: %s", msg.c_str());
+			return ret;
+		}
+
+		std::string msg;
+	};
+
+	enum layerType { LAYER_CONV, LAYER_RELU, LAYER_MAXPOOL, LAYER_VIEW, LAYER_LINEAR, LAYER_LOGSOFTMAX };
+
+	struct Layer {
+		layerType type;
+		// Kernel size and stride (convolution and pooling layers)
+		int kh = 0, kw = 0, dh = 1, dw = 1;
+		// Output size, channels x height x width
+		int c = 0, h = 0, w = 0;
+		std::vector<float> weight;
+		std::vector<float> bias;
+	};
+
+	// Activation ranges of a network, measured by Network::measureRanges
+	// on calibration images (see vespid-calibrate).
+	struct Calibration {
+		// Largest absolute input value of each layer
+		std::vector<float> ranges;
+		// Number of images measured
+		unsigned long images = 0;
+
+		// Throw NNException if the file can't be read or written.
+		void load(const std::string &path);
+		void save(const std::string &path) const;
+	};
+
+	// Sets the output size of a layer from the size of its input, the number
+	// of output channels of convolution and linear layers being already set.
+	// Throws NNException if the input is too small.
+	void setOutputSize(Layer &layer, int c, int h, int w);
+
+	class Network {
+	public:
+		// Throws NNException if the file can't be read.
+		void load(const std::string &path);
+		// Sets up the network from layers whose type, parameters and
+		// weights are set (see vespid-train). Throws NNException if they do
+		// not match the input or the categories.
+		void create(const std::vector<std::string> &categories, int in_c, int in_h, int in_w,
+			const std::vector<float> &mean, const std::vector<float> &stdv, const std::vector<Layer> &layers);
+		// Writes the network in the format of torchnn/export.lua. Throws
+		// NNException if the file can't be written.
+		void save(const std::string &path) const;
+
+		// input: planar channels x height x width, already normalized
+		// (see normalize()). output: getOutputSize() probabilities.
+		// Not thread-safe: scratch buffers are shared.
+		void forward(const float *input, float *output);
+		// Same as forward() for n consecutive inputs and outputs. Linear
+		// layers are computed for the whole batch at once so that their
+		// weights are only loaded into the cache once.
+		void forwardBatch(const float *inputs, int n, float *outputs);
+		// Runs forwardBatch() and widens the ranges of calibration with
+		// the layer inputs.
+		void measureRanges(const float *inputs, int n, Calibration &calibration);
+
+		// Subtracts the training mean and divides by the standard
+		// deviation of each channel, in place.
+		void normalize(float *input) const;
+
+		int getInputSize() const { return m_in_c * m_in_h * m_in_w; }
+		int getInputChannels() const { return m_in_c; }
+		int getInputHeight() const { return m_in_h; }
+		int getInputWidth() const { return m_in_w; }
+		int getOutputSize() const { return m_layers.empty() ? 0 : m_layers.back().c; }
+		const std::vector<std::string>& getCategories() const { return m_categories; }
+		const std::vector<float>& getMean() const { return m_mean; }
+		const std::vector<float>& getStdv() const { return m_stdv; }
+		const std::vector<Layer>& getLayers() const { return m_layers; }
+
+	private:
+		void forwardLayers(const float *inputs, int n, float *outputs, Calibration *calibration);
+		// Checks the output size and allocates the scratch buffers
+		void setup(const std::string &path);
+
+		int m_in_c = 0, m_in_h = 0, m_in_w = 0;
+		std::vector<std::string> m_categories;
+		std::vector<float> m_mean, m_stdv;
+		std::vector<Layer> m_layers;
+		// Scratch buffers, m_max_size floats per batch element
+		size_t m_max_size = 0;
+		std::vector<float> m_buf_a, m_buf_b;
+	};
+
+	// Layer of a QuantizedNetwork. Weights are quantised per output channel;
+	// the output is requantised to the input scale of the next weighted layer,
+	// or converted back to floats after the last one.
+	struct QuantizedLayer : Layer {
+		// Linear layers
+		std::vector<int8_t> qweight;
+		// Convolutions: offset of each kernel coefficient in the input, and
+		// coefficients widened to 16 bits, taps() per output channel. The
+		// number of taps is even, padded with a null coefficient.
+		std::vector<int> offsets;
+		std::vector<int16_t> cweight;
+		int taps() const { return offsets.size(); }
+		// Output = accumulator * multiplier[o] + offset[o]
+		std::vector<float> multiplier;
+		std::vector<float> offset;
+		bool float_output = false;
+	};
+
+	// 8 bit version of a network: activations and weights are symmetrically
+	// quantised, products are accumulated in 32 bits. ReLU and max pooling
+	// commute with the quantisation, so the activations are only requantised
+	// by the convolution and linear layers.
+	class QuantizedNetwork {
+	public:
+		// Throws NNException if the calibration does not match the network
+		// or if layers other than LogSoftMax follow the last linear layer.
+		void load(const Network &net, const Calibration &calibration);
+
+		// Same interface as Network. Not thread-safe.
+		void forwardBatch(const float *inputs, int n, float *outputs);
+
+	private:
+		int m_in_c = 0, m_in_h = 0, m_in_w = 0;
+		float m_in_scale = 1.f;
+		std::vector<QuantizedLayer> m_layers;
+		size_t m_max_size = 0;
+		std::vector<int8_t> m_buf_a, m_buf_b;
+		// Convolution input widened to 16 bits, and accumulators
+		std::vector<int16_t> m_wide;
+		std::vector<int32_t> m_acc;
+		std::vector<float> m_float_a, m_float_b;
+	};
+
+	// Vectorized kernels (NEON on ARM, SSE on x86, scalar otherwise)
+	namespace Kernel {
+		// y += a * x
+		void axpy(float *y, const float *x, float a, int n);
+		float dot(const float *x, const float *y, int n);
+		void relu(float *x, int n);
+		void conv(const float *in, int in_c, int in_h, int in_w, const Layer &layer, float *out);
+		void maxpool(const float *in, int in_h, int in_w, const Layer &layer, float *out);
+		// in: n consecutive inputs of in_n values
+		void linear(const float *in, int in_n, int n, const Layer &layer, float *out);
+		// Computes the probabilities, i.e. exp(LogSoftMax(x))
+		void softmax(const float *in, int n, float *out);
+
+		// 8 bit versions, accumulated in 32 bits
+		// in: input of the layer widened to 16 bits, followed by 8 padding
+		// values. Computes the n accumulators of output channel o, with
+		// the width of the input rows (see QuantizedNetwork::forwardBatch).
+		// n is rounded up to a multiple of 8.
+		void conv(const int16_t *in, const QuantizedLayer &layer, int o, int n, int32_t *acc);
+		int32_t dot(const int8_t *x, const int8_t *y, int n);
+		void relu(int8_t *x, int n);
+		void maxpool(const int8_t *in, int in_h, int in_w, const Layer &layer, int8_t *out);
+		// Convert to the nearest value in [-127, 127]
+		void quantize(const float *in, float inv_scale, int n, int8_t *out);
+		void requantize(const int32_t *acc, int n, float multiplier, float offset, int8_t *out);
+	}
+}
@@ -0,0 +1,235 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <cxcore.hpp>
+
+#include "pack.hh"
+
+namespace Pack {
+	// Checks the header of a pack and maps its categories to the Dataset ones
+	static void checkHeader(const FileHeader &header, const std::string &path, int *categories) {
+		if (memcmp(header.magic, PACK_MAGIC, 8) != 0 || header.version != PACK_VERSION)
+			throw PackException(path + " is not a pack");
+		if (header.header_size != sizeof(FileHeader) || header.record_size != sizeof(Record)
+				|| header.height != DB_RESIZED_IMAGE_HEIGHT || header.width != DB_RESIZED_IMAGE_WIDTH
+				|| header.channels != 3 || header.n_categories > PACK_MAX_CATEGORIES)
+			throw PackException("unexpected record format in " + path);
+
+		for (int i = 0 ; i < header.n_categories ; ++i) {
+			std::string name(header.categories[i], strnlen(header.categories[i], PACK_NAME_SIZE));
+			if ((categories[i] = Dataset::getCategory(name)) < 0)
+				throw PackException("unknown category " + name + " in " + path);
+		}
+	}
+
+	bool isPack(const std::string &path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		char magic[8];
+		bool ret = read(fd, magic, 8) == 8 && memcmp(magic, PACK_MAGIC, 8) == 0;
+		::close(fd);
+		return ret;
+	}
+
+	uint64_t getTimestamp() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * (uint64_t) 1000000 + tv.tv_usec;
+	}
+
+	Reader::Reader(const std::string &path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw PackException("failed to open " + path);
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(FileHeader)) {
+			::close(fd);
+			throw PackException(path + " is not a pack");
+		}
+
+		// The whole file is read ahead at once
+		m_map_size = st.st_size;
+		m_map = mmap(NULL, m_map_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+		::close(fd);
+		if (m_map == MAP_FAILED) {
+			m_map = NULL;
+			throw PackException("failed to map " + path);
+		}
+		madvise(m_map, m_map_size, MADV_SEQUENTIAL);
+
+		const char *data = (const char*) m_map;
+		const FileHeader *header = (const FileHeader*) data;
+		try {
+			checkHeader(*header, path, m_categories);
+		} catch (...) {
+			munmap(m_map, m_map_size);
+			throw;
+		}
+		m_records = (const Record*) (data + sizeof(FileHeader));
+		m_dataset_order = header->n_categories == DATASET_CATEGORIES;
+		for (int i = 0 ; i < header->n_categories ; ++i)
+			m_dataset_order &= m_categories[i] == i;
+
+		// With a valid footer, the records end where the index starts
+		const IndexTrailer *trailer = (const IndexTrailer*) (data + m_map_size - sizeof(IndexTrailer));
+		if (m_map_size >= sizeof(FileHeader) + sizeof(IndexTrailer)) {
+			uint64_t n = trailer->n_records;
+			m_closed = memcmp(trailer->magic, PACK_INDEX_MAGIC, 8) == 0
+				&& sizeof(FileHeader) + n * (sizeof(Record) + sizeof(uint32_t)) + sizeof(IndexTrailer) == m_map_size;
+			if (m_closed)
+				m_n_records = n;
+		}
+		if (!m_closed)
+			m_n_records = (m_map_size - sizeof(FileHeader)) / sizeof(Record);
+
+		// getCategory() indexes m_categories with the record category
+		for (size_t i = 0 ; i < m_n_records ; ++i) {
+			if (m_records[i].category >= header->n_categories) {
+				munmap(m_map, m_map_size);
+				throw PackException("invalid category in " + path);
+			}
+		}
+
+		if (m_closed) {
+			const uint32_t *index = (const uint32_t*) (data + sizeof(FileHeader) + m_n_records * sizeof(Record));
+			uint64_t total = 0;
+			for (int i = 0 ; i < header->n_categories ; ++i)
+				total += trailer->counts[i];
+			for (int i = 0 ; i < header->n_categories && total == m_n_records ; ++i) {
+				for (uint32_t j = 0 ; j < trailer->counts[i] ; ++j) {
+					if (*index >= m_n_records || m_records[*index].category != i)
+						total = 0;
+					m_index[m_categories[i]].push_back(*index++);
+				}
+			}
+			if (total != m_n_records) {
+				munmap(m_map, m_map_size);
+				throw PackException("invalid index in " + path);
+			}
+		} else {
+			for (size_t i = 0 ; i < m_n_records ; ++i)
+				m_index[getCategory(i)].push_back(i);
+		}
+	}
+
+	Reader::~Reader() {
+		if (m_map != NULL)
+			munmap(m_map, m_map_size);
+	}
+
+	cv::Mat Reader::getImage(size_t i) const {
+		return cv::Mat(DB_RESIZED_IMAGE_HEIGHT, DB_RESIZED_IMAGE_WIDTH, CV_8UC3, (void*) m_records[i].pixels);
+	}
+
+	Writer::Writer(const std::string &path) : m_path(path) {
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0) {
+			// Append: keep the records and drop the footer
+			{
+				Reader reader(path);
+				if (!reader.isDatasetOrder())
+					throw PackException("can't append to " + path + ", its categories are in another order");
+				m_n_records = reader.size();
+				for (int i = 0 ; i < DATASET_CATEGORIES ; ++i) {
+					m_index[i] = reader.getIndex(i);
+					for (size_t j = 0 ; j < m_index[i].size() ; ++j)
+						m_max_number[i] = std::max(m_max_number[i], getNumber(reader.get(m_index[i][j]), j));
+				}
+			}
+			if ((m_fd = open(path.c_str(), O_WRONLY)) < 0)
+				throw PackException("failed to open " + path);
+			off_t end = sizeof(FileHeader) + m_n_records * sizeof(Record);
+			if (ftruncate(m_fd, end) != 0 || lseek(m_fd, end, SEEK_SET) != end) {
+				::close(m_fd);
+				m_fd = -1;
+				throw PackException("failed to write " + path);
+			}
+			return;
+		}
+
+		if ((m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+			throw PackException("failed to create " + path);
+
+		FileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, PACK_MAGIC, 8);
+		header.version = PACK_VERSION;
+		header.header_size = sizeof(FileHeader);
+		header.record_size = sizeof(Record);
+		header.height = DB_RESIZED_IMAGE_HEIGHT;
+		header.width = DB_RESIZED_IMAGE_WIDTH;
+		header.channels = 3;
+		header.n_categories = DATASET_CATEGORIES;
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i)
+			strncpy(header.categories[i], Dataset::getCategoryName(i), PACK_NAME_SIZE - 1);
+		writeAll(&header, sizeof(header));
+	}
+
+	Writer::~Writer() {
+		try {
+			close();
+		} catch (std::exception&) {}
+	}
+
+	void Writer::writeAll(const void *data, size_t size) {
+		const char *p = (const char*) data;
+		while (size > 0) {
+			ssize_t n = write(m_fd, p, size);
+			if (n < 0)
+				throw PackException("failed to write " + m_path);
+			p += n;
+			size -= n;
+		}
+	}
+
+	void Writer::append(const cv::Mat &image, int category, uint32_t number, uint64_t timestamp_us,
+			uint32_t seq, recordSource source) {
+		if (m_fd < 0)
+			throw PackException(m_path + " is closed");
+		if (image.rows != DB_RESIZED_IMAGE_HEIGHT || image.cols != DB_RESIZED_IMAGE_WIDTH || image.type() != CV_8UC3)
+			throw PackException("not a classifier input");
+
+		Record record;
+		memset(&record, 0, sizeof(record));
+		const int row_size = DB_RESIZED_IMAGE_WIDTH * 3;
+		for (int y = 0 ; y < DB_RESIZED_IMAGE_HEIGHT ; ++y)
+			memcpy(record.pixels + y * row_size, image.ptr<unsigned char>(y), row_size);
+		record.timestamp_us = timestamp_us;
+		record.seq = seq;
+		record.number = number;
+		record.category = category;
+		record.source = source;
+		writeAll(&record, sizeof(record));
+
+		m_max_number[category] = std::max(m_max_number[category], getNumber(record, m_index[category].size()));
+		m_index[category].push_back(m_n_records++);
+	}
+
+	void Writer::close() {
+		if (m_fd < 0)
+			return;
+
+		IndexTrailer trailer;
+		memset(&trailer, 0, sizeof(trailer));
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i) {
+			writeAll(m_index[i].data(), m_index[i].size() * sizeof(uint32_t));
+			trailer.counts[i] = m_index[i].size();
+		}
+		trailer.n_records = m_n_records;
+		memcpy(trailer.magic, PACK_INDEX_MAGIC, 8);
+		writeAll(&trailer, sizeof(trailer));
+
+		int fd = m_fd;
+		m_fd = -1;
+		if (::close(fd) != 0)
+			throw PackException("failed to write " + m_path);
+	}
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <exception>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cxcore.hpp>
+
+#include "classifier.hh"
+#include "dataset.hh"
+
+#define PACK_MAGIC "VSPDPACK"
+#define PACK_INDEX_MAGIC "VSPDINDX"
+#define PACK_VERSION 1
+#define PACK_MAX_CATEGORIES 8
+#define PACK_NAME_SIZE 16
+
+// Packed datasets: a single append-only file holding the classifier inputs of
+// a dataset, read with one mapping instead of a file per image. Layout
+// (little-endian): a FileHeader, fixed-size Records in capture order, then a
+// footer index made of the record numbers grouped by category and an
+// IndexTrailer. Appending removes the footer and writes it again on close; a
+// pack whose footer is missing (e.g. after a crash) is still readable, the
+// index is then rebuilt from the records. torchnn/pack.lua reads the same
+// format.
+namespace Pack {
+	struct PackException : public std::exception {
+		PackException(std::string p_msg) : msg(p_msg) {}
+		const char* what() const noexcept {
+			static char ret[300];
+			snprintf(ret, 300, "Pack error: %s", msg.c_str());
+			return ret;
+		}
+
+		std::string msg;
+	};
+
+	// Origin of a record
+	enum recordSource { SOURCE_UNKNOWN, SOURCE_CAMERA, SOURCE_BURST, SOURCE_DIRECTORY };
+
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		uint32_t record_size;
+		uint16_t height, width, channels;
+		uint16_t n_categories;
+		char categories[PACK_MAX_CATEGORIES][PACK_NAME_SIZE];
+		uint32_t reserved;
+	};
+
+	struct Record {
+		// BGR pixels, row by row, as in a cv::Mat
+		uint8_t pixels[DB_RESIZED_IMAGE_SIZE];
+		// Capture time in microseconds since the epoch, 0 if unknown
+		uint64_t timestamp_us;
+		// Camera frame sequence number, 0 if unknown
+		uint32_t seq;
+		// Number of the image in its category (the file name in dataset
+		// directories)
+		uint32_t number;
+		uint8_t category;
+		uint8_t source;
+		uint8_t reserved[6];
+	};
+
+	struct IndexTrailer {
+		uint32_t counts[PACK_MAX_CATEGORIES];
+		uint64_t n_records;
+		char magic[8];
+	};
+
+	static_assert(sizeof(FileHeader) == 160, "unexpected pack header size");
+	static_assert(sizeof(Record) == DB_RESIZED_IMAGE_SIZE + 24, "unexpected pack record size");
+	static_assert(sizeof(IndexTrailer) == 48, "unexpected pack trailer size");
+
+	bool isPack(const std::string &path);
+
+	// Maps a whole pack in memory. Categories are numbered as in Dataset.
+	class Reader {
+	public:
+		Reader(const std::string &path);
+		~Reader();
+		Reader(const Reader&) = delete;
+		Reader& operator=(const Reader&) = delete;
+
+		size_t size() const { return m_n_records; }
+		const Record& get(size_t i) const { return m_records[i]; }
+		int getCategory(size_t i) const { return m_categories[m_records[i].category]; }
+		// Wraps the record, without copy
+		cv::Mat getImage(size_t i) const;
+		// Record numbers of a category, in capture order
+		const std::vector<uint32_t>& getIndex(int category) const { return m_index[category]; }
+		// False if the footer is missing
+		bool isClosed() const { return m_closed; }
+		// True if the categories of the file are numbered as in Dataset
+		bool isDatasetOrder() const { return m_dataset_order; }
+
+	private:
+		void* m_map = NULL;
+		size_t m_map_size = 0;
+		const Record *m_records = NULL;
+		size_t m_n_records = 0;
+		bool m_closed = false;
+		bool m_dataset_order = false;
+		// Dataset category of each category of the file
+		int m_categories[PACK_MAX_CATEGORIES];
+		std::vector<uint32_t> m_index[DATASET_CATEGORIES];
+	};
+
+	// Creates a pack, or appends to an existing one. The footer is written
+	// by close() (or on destruction).
+	class Writer {
+	public:
+		Writer(const std::string &path);
+		~Writer();
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+		// image: a classifier input (see resizeImageForDB)
+		void append(const cv::Mat &image, int category, uint32_t number, uint64_t timestamp_us = 0,
+			uint32_t seq = 0, recordSource source = SOURCE_UNKNOWN);
+		// Records of a category, including those already in the file
+		size_t getCount(int category) const { return m_index[category].size(); }
+		// Greatest record number of a category (records without a number
+		// count as numbered in capture order, see getNumber), 0 if empty
+		uint32_t getMaxNumber(int category) const { return m_max_number[category]; }
+		void close();
+
+	private:
+		void writeAll(const void *data, size_t size);
+
+		std::string m_path;
+		int m_fd = -1;
+		uint64_t m_n_records = 0;
+		std::vector<uint32_t> m_index[DATASET_CATEGORIES];
+		uint32_t m_max_number[DATASET_CATEGORIES] = {0};
+	};
+
+	// Number of the i-th record of a category: its number, or i + 1 if it
+	// has none
+	inline uint32_t getNumber(const Record &record, size_t i) {
+		return (record.number != 0) ? record.number : i + 1;
+	}
+
+	// Wall-clock time in microseconds, for Record::timestamp_us
+	uint64_t getTimestamp();
+}
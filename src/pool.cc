@@ -0,0 +1,137 @@
+#include <SDL_mutex.h>
+#include <cxcore.hpp>
+
+#include "pool.hh"
+#include "classifier.hh"
+#include "util.hh"
+
+// Jobs in flight per worker: one being classified, one waiting
+#define POOL_JOBS_PER_WORKER 2
+// Maximal waiting time of the workers, so they can be stopped
+#define POOL_TIMEOUT_MS 100
+#define POOL_DEFAULT_WORKERS 2
+
+namespace Image {
+	InferenceWorker::~InferenceWorker() {
+		destruct();
+	}
+
+	void InferenceWorker::onStart() {
+		classifier.reset(createClassifier());
+	}
+
+	void InferenceWorker::onEnd() {
+		classifier.reset();
+	}
+
+	void InferenceWorker::loop() {
+		InferenceJob *job = pool->takeJob(POOL_TIMEOUT_MS);
+		if (job == NULL)
+			return;
+
+		uint64_t start_us = Time::getMicros();
+		classifier->classifyBatch(job->images, job->n, job->results);
+		job->forward_us = Time::getMicros() - start_us;
+
+		pool->complete(job);
+	}
+
+	InferencePool::InferencePool(unsigned int n_workers, JobSink *sink) :
+		m_jobs(n_workers * POOL_JOBS_PER_WORKER + 1),
+		m_done(m_jobs.size(), false),
+		m_queue(m_jobs.size()),
+		m_sink(sink)
+	{
+		m_free_jobs = SDL_CreateSemaphore(m_jobs.size());
+		m_take_mutex = SDL_CreateMutex();
+		m_done_mutex = SDL_CreateMutex();
+
+		for (unsigned int i = 0 ; i < n_workers ; ++i) {
+			m_workers.emplace_back(new InferenceWorker());
+			m_workers.back()->pool = this;
+			m_workers.back()->launch("InferenceWorker");
+		}
+	}
+
+	InferencePool::~InferencePool() {
+		// Stop the workers before destroying what they use
+		m_workers.clear();
+
+		SDL_DestroySemaphore(m_free_jobs);
+		SDL_DestroyMutex(m_take_mutex);
+		SDL_DestroyMutex(m_done_mutex);
+	}
+
+	InferenceJob* InferencePool::beginJob(unsigned int timeout_ms) {
+		if (SDL_SemWaitTimeout(m_free_jobs, timeout_ms) != 0)
+			return NULL;
+
+		InferenceJob *job = &m_jobs[m_next_seq % m_jobs.size()];
+		job->seq = m_next_seq++;
+		job->reuse = job->batch = false;
+		job->n = 0;
+		job->forward_us = job->detect_us = 0;
+		return job;
+	}
+
+	void InferencePool::endJob(InferenceJob *job) {
+		if (job->reuse) {
+			complete(job);
+			return;
+		}
+
+		// There is room for all the jobs in the queue
+		*m_queue.beginPush(SDL_MUTEX_MAXWAIT) = job;
+		m_queue.endPush();
+	}
+
+	void InferencePool::checkDeath() {
+		for (auto it = m_workers.begin() ; it != m_workers.end() ; ++it)
+			(*it)->checkDeath();
+	}
+
+	InferenceJob* InferencePool::takeJob(unsigned int timeout_ms) {
+		// The queue has a single consumer: workers take turns, and copy the
+		// job pointer out before releasing the queue item.
+		InferenceJob *job = NULL;
+		SDL_LockMutex(m_take_mutex);
+		InferenceJob **item = m_queue.beginPop(timeout_ms);
+		if (item != NULL) {
+			job = *item;
+			m_queue.endPop();
+		}
+		SDL_UnlockMutex(m_take_mutex);
+		return job;
+	}
+
+	void InferencePool::complete(InferenceJob *job) {
+		SDL_LockMutex(m_done_mutex);
+		m_done[job->seq % m_jobs.size()] = true;
+
+		// Hand the consecutive completed jobs to the sink
+		while (true) {
+			size_t slot = m_next_done % m_jobs.size();
+			InferenceJob &next = m_jobs[slot];
+			if (!m_done[slot] || next.seq != m_next_done)
+				break;
+
+			if (next.reuse)
+				next.results[0] = m_last_result;
+			else
+				m_last_result = next.results[next.n - 1];
+			m_sink->onJobDone(next);
+
+			m_done[slot] = false;
+			m_next_done++;
+			SDL_SemPost(m_free_jobs);
+		}
+		SDL_UnlockMutex(m_done_mutex);
+	}
+
+	unsigned int getConfWorkers() {
+		long workers = Conf::getInt("NN_WORKERS", POOL_DEFAULT_WORKERS);
+		if (workers < 1 || workers > POOL_MAX_WORKERS)
+			throw Conf::ConfException("NN_WORKERS");
+		return workers;
+	}
+}
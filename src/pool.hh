@@ -0,0 +1,111 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <SDL_mutex.h>
+#include <cxcore.hpp>
+
+#include "classifier.hh"
+#include "trace.hh"
+#include "util.hh"
+
+// Maximal number of inference workers
+#define POOL_MAX_WORKERS 8
+
+namespace Image {
+	// A classification request: n frames classified in a single forward
+	// pass, or a frame that gets the result of the previous job.
+	struct InferenceJob {
+		// Job number, jobs are completed in this order
+		unsigned long seq = 0;
+		// Unchanged frame: no forward pass, results[0] is set to the last
+		// result of the previous job on completion.
+		bool reuse = false;
+		// Batch requested with NNManager::requestBatch
+		bool batch = false;
+		unsigned int batch_request = 0;
+
+		unsigned int n = 0;
+		cv::Mat images[NN_MAX_BATCH];
+		Trace::FrameInfo frames[NN_MAX_BATCH];
+		nnResult results[NN_MAX_BATCH];
+		// Forward pass duration
+		uint64_t forward_us = 0;
+		// Change detection duration of the frames since the previous job
+		uint64_t detect_us = 0;
+	};
+
+	// Receives the completed jobs, in job order
+	class JobSink {
+	public:
+		virtual ~JobSink() {}
+		// Called by a worker or by the thread calling endJob(), with the
+		// pool lock held: calls are serialized.
+		virtual void onJobDone(const InferenceJob &job) = 0;
+	};
+
+	class InferencePool;
+
+	// Runs the jobs with its own classifier (see createClassifier)
+	class InferenceWorker : public Thread::ThreadBase {
+	public:
+		virtual void onStart();
+		virtual void onEnd();
+		virtual void loop();
+		~InferenceWorker();
+
+		InferencePool *pool;
+
+	private:
+		std::unique_ptr<Classifier> classifier;
+	};
+
+	// Pool of workers fed by a single producer. Jobs are classified in
+	// parallel and reordered before they reach the sink.
+	class InferencePool {
+	public:
+		InferencePool(unsigned int n_workers, JobSink *sink);
+		~InferencePool();
+
+		// Producer side: waits at most timeout_ms for a free job and
+		// returns it, or NULL. The job must then be filled and given to
+		// endJob().
+		InferenceJob* beginJob(unsigned int timeout_ms);
+		void endJob(InferenceJob *job);
+
+		unsigned int getWorkers() const { return m_workers.size(); }
+		// Number of jobs waiting for a worker
+		unsigned int getDepth() const { return m_queue.getDepth(); }
+		// Throws the exception of a dead worker
+		void checkDeath();
+
+	private:
+		friend class InferenceWorker;
+		// Worker side: waits for a job
+		InferenceJob* takeJob(unsigned int timeout_ms);
+		void complete(InferenceJob *job);
+
+		// Jobs in flight, job seq uses slot seq % size. A slot is free once
+		// the job that used it reached the sink, which happens in order.
+		std::vector<InferenceJob> m_jobs;
+		std::vector<bool> m_done;
+		SDL_sem *m_free_jobs = NULL;
+		unsigned long m_next_seq = 0;
+
+		// Jobs waiting for a worker. Workers take them under m_take_mutex.
+		Thread::SPSCQueue<InferenceJob*> m_queue;
+		SDL_mutex *m_take_mutex = NULL;
+
+		// Reordering (protected by m_done_mutex)
+		SDL_mutex *m_done_mutex = NULL;
+		unsigned long m_next_done = 0;
+		nnResult m_last_result;
+
+		JobSink *m_sink;
+		std::vector<std::unique_ptr<InferenceWorker>> m_workers;
+	};
+
+	// Number of workers given by NN_WORKERS
+	unsigned int getConfWorkers();
+}
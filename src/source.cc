@@ -0,0 +1,285 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cxcore.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "source.hh"
+#include "camera.hh"
+#include "util.hh"
+
+// Replay rate of image directories when no rate is given
+#define REPLAY_DEFAULT_FPS 10
+
+namespace Camera {
+#ifdef HAVE_RASPICAM
+	void RaspiCamSource::open() {
+		m_camera.set(CV_CAP_PROP_FORMAT, CV_8UC3);
+		if (m_width > 0 && m_height > 0) {
+			m_camera.set(CV_CAP_PROP_FRAME_WIDTH, m_width);
+			m_camera.set(CV_CAP_PROP_FRAME_HEIGHT, m_height);
+		}
+		if (!m_camera.open())
+			throw CameraException();
+	}
+
+	cv::Size RaspiCamSource::getSize() const {
+		return cv::Size(m_camera.get(CV_CAP_PROP_FRAME_WIDTH), m_camera.get(CV_CAP_PROP_FRAME_HEIGHT));
+	}
+
+	void RaspiCamSource::close() {
+		m_camera.release();
+	}
+
+	bool RaspiCamSource::grab() {
+		return m_camera.grab();
+	}
+
+	void RaspiCamSource::retrieve(cv::Mat &image) {
+		m_camera.retrieve(image);
+	}
+
+	void RaspiCamYUVSource::open() {
+		m_camera.setFormat(raspicam::RASPICAM_FORMAT_YUV420);
+		if (m_width > 0 && m_height > 0)
+			m_camera.setCaptureSize(m_width, m_height);
+		if (!m_camera.open())
+			throw CameraException();
+		// The planes must be tightly packed (width multiple of 32)
+		if (m_camera.getImageBufferSize() != m_camera.getWidth() * m_camera.getHeight() * 3 / 2)
+			throw CameraException();
+	}
+
+	cv::Size RaspiCamYUVSource::getSize() const {
+		return cv::Size(m_camera.getWidth(), m_camera.getHeight());
+	}
+
+	void RaspiCamYUVSource::close() {
+		m_camera.release();
+	}
+
+	bool RaspiCamYUVSource::grab() {
+		return m_camera.grab();
+	}
+
+	void RaspiCamYUVSource::retrieve(cv::Mat &image) {
+		image.create(m_camera.getHeight() * 3 / 2, m_camera.getWidth(), CV_8UC1);
+		m_camera.retrieve(image.data);
+	}
+#endif
+
+	ReplaySource::ReplaySource(const std::string &path, double fps, bool loop, frameFormat format, int width, int height) :
+		m_path(path), m_fps(fps), m_loop(loop), m_format(format), m_width(width), m_height(height) {}
+
+	static bool compareFileNames(const std::string &a, const std::string &b) {
+		long na = strtol(a.c_str(), NULL, 10), nb = strtol(b.c_str(), NULL, 10);
+		if (na != nb)
+			return na < nb;
+		return a < b;
+	}
+
+	void ReplaySource::open() {
+		struct stat st;
+		if (stat(m_path.c_str(), &st) != 0)
+			throw CameraException();
+
+		double fps = m_fps;
+		if (S_ISDIR(st.st_mode)) {
+			DIR *dpdf;
+			struct dirent *epdf;
+
+			dpdf = opendir(m_path.c_str());
+			if (dpdf == NULL)
+				throw CameraException();
+
+			std::vector<std::string> names;
+			while ((epdf = readdir(dpdf))) {
+				if (epdf->d_name[0] != '.')
+					names.push_back(epdf->d_name);
+			}
+			closedir(dpdf);
+
+			std::sort(names.begin(), names.end(), compareFileNames);
+			for (auto it = names.begin() ; it != names.end() ; ++it)
+				m_files.push_back(m_path + "/" + *it);
+			if (m_files.empty())
+				throw CameraException();
+
+			if (fps < 0)
+				fps = REPLAY_DEFAULT_FPS;
+			for (auto it = m_files.begin() ; it != m_files.end() && m_size.area() == 0 ; ++it)
+				m_size = cv::imread(*it, cv::IMREAD_COLOR).size();
+			if (m_size.area() == 0)
+				throw CameraException();
+		} else {
+			if (!m_video.open(m_path))
+				throw CameraException();
+
+			if (fps < 0)
+				fps = m_video.get(CV_CAP_PROP_FPS);
+			if (fps <= 0)
+				fps = REPLAY_DEFAULT_FPS;
+			m_size = cv::Size(m_video.get(CV_CAP_PROP_FRAME_WIDTH), m_video.get(CV_CAP_PROP_FRAME_HEIGHT));
+		}
+		if (m_width > 0 && m_height > 0)
+			m_size = cv::Size(m_width, m_height);
+
+		m_period_us = (fps > 0) ? 1000000.0 / fps : 0;
+		m_next_us = Time::getMicros();
+	}
+
+	void ReplaySource::close() {
+		m_video.release();
+		m_files.clear();
+	}
+
+	bool ReplaySource::grabNext() {
+		if (!m_files.empty()) {
+			// Files which are not images are skipped
+			for (size_t tries = 0 ; tries < m_files.size() ; ++tries) {
+				if (m_next_file == m_files.size()) {
+					if (!m_loop)
+						return false;
+					m_next_file = 0;
+				}
+				m_decoded = cv::imread(m_files[m_next_file++], cv::IMREAD_COLOR);
+				if (!m_decoded.empty())
+					return true;
+			}
+			return false;
+		}
+
+		if (m_video.grab())
+			return true;
+		if (!m_loop || !m_video.open(m_path))
+			return false;
+		return m_video.grab();
+	}
+
+	bool ReplaySource::grab() {
+		if (m_period_us > 0) {
+			uint64_t now = Time::getMicros();
+			if (now < m_next_us)
+				Time::delay((m_next_us - now) / 1000);
+			// Don't try to catch up if the consumers were too slow
+			m_next_us = std::max(m_next_us, now) + m_period_us;
+		}
+
+		return grabNext();
+	}
+
+	void ReplaySource::retrieve(cv::Mat &image) {
+		const bool resize = (m_width > 0 && m_height > 0);
+		cv::Mat &bgr = (m_format == FRAME_BGR && !resize) ? image : m_bgr;
+		if (!m_files.empty())
+			m_decoded.copyTo(bgr);
+		else
+			m_video.retrieve(bgr);
+
+		if (resize) {
+			cv::Mat &resized = (m_format == FRAME_BGR) ? image : m_resized;
+			cv::resize(bgr, resized, cv::Size(m_width, m_height), 0, 0, cv::INTER_AREA);
+			if (m_format == FRAME_YUV420)
+				cv::cvtColor(resized, image, cv::COLOR_BGR2YUV_I420);
+			return;
+		}
+
+		if (m_format == FRAME_YUV420)
+			cv::cvtColor(bgr, image, cv::COLOR_BGR2YUV_I420);
+	}
+
+	void getConfFormat(frameFormat &format, int &width, int &height) {
+		std::string format_name = Conf::getString("CAMERA_FORMAT", "bgr");
+		if (format_name == "bgr")
+			format = FRAME_BGR;
+		else if (format_name == "yuv420")
+			format = FRAME_YUV420;
+		else
+			throw Conf::ConfException("CAMERA_FORMAT");
+
+		width = Conf::getInt("CAMERA_WIDTH", 0);
+		height = Conf::getInt("CAMERA_HEIGHT", 0);
+		if (width < 0 || height < 0 || (width > 0) != (height > 0))
+			throw Conf::ConfException("CAMERA_WIDTH");
+	}
+
+	Source* createSource() {
+		frameFormat format;
+		int width, height;
+		getConfFormat(format, width, height);
+
+		std::string replay = Conf::getString("CAMERA_REPLAY", "");
+		if (!replay.empty())
+			return new ReplaySource(replay, Conf::getDouble("CAMERA_REPLAY_FPS", -1), Conf::getInt("CAMERA_REPLAY_LOOP", 1) != 0, format, width, height);
+
+#ifdef HAVE_RASPICAM
+		if (format == FRAME_YUV420)
+			return new RaspiCamYUVSource(width, height);
+		return new RaspiCamSource(width, height);
+#else
+		// Built without RaspiCam: a replay is the only possible source.
+		throw Conf::ConfException("CAMERA_REPLAY");
+#endif
+	}
+
+	cv::Rect getConfROI() {
+		std::string str = Conf::getString("CAMERA_ROI", "");
+		if (str.empty())
+			return cv::Rect();
+
+		cv::Rect roi;
+		char end;
+		if (sscanf(str.c_str(), "%d,%d,%d,%d%c", &roi.x, &roi.y, &roi.width, &roi.height, &end) != 4
+				|| roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0)
+			throw Conf::ConfException("CAMERA_ROI");
+		return roi;
+	}
+
+	cv::Rect clipROI(const cv::Rect &roi, const cv::Size &size, frameFormat format) {
+		cv::Rect r(0, 0, size.width, size.height);
+		if (roi.area() > 0)
+			r &= roi;
+		if (format == FRAME_YUV420) {
+			r.x &= ~1;
+			r.y &= ~1;
+			r.width &= ~1;
+			r.height &= ~1;
+		}
+
+		const char *name = (roi.area() > 0) ? "CAMERA_ROI" : "CAMERA_WIDTH";
+		if (r.area() == 0)
+			throw Conf::ConfException(name);
+		// The region can't be wider than the classifier input
+		if (r.width > 2 * r.height)
+			throw Conf::ConfException(name);
+		return r;
+	}
+
+	void cropFrame(const cv::Mat &src, frameFormat format, const cv::Rect &roi, cv::Mat &dst) {
+		const int width = src.cols, height = (format == FRAME_YUV420) ? src.rows * 2 / 3 : src.rows;
+		cv::Rect r = clipROI(roi, cv::Size(width, height), format);
+
+		if (format == FRAME_BGR) {
+			src(r).copyTo(dst);
+			return;
+		}
+
+		// I420: the chroma planes have half the resolution
+		dst.create(r.height * 3 / 2, r.width, CV_8UC1);
+		unsigned char *out = dst.data;
+		for (int y = 0 ; y < r.height ; ++y, out += r.width)
+			memcpy(out, src.data + (r.y + y) * width + r.x, r.width);
+
+		for (int plane = 0 ; plane < 2 ; ++plane) {
+			const unsigned char *in = src.data + width * height + plane * (width / 2) * (height / 2);
+			for (int y = 0 ; y < r.height / 2 ; ++y, out += r.width / 2)
+				memcpy(out, in + (r.y / 2 + y) * (width / 2) + r.x / 2, r.width / 2);
+		}
+	}
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cxcore.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "cmake_config.h"
+
+#ifdef HAVE_RASPICAM
+#include <raspicam/raspicam.h>
+#include <raspicam/raspicam_cv.h>
+#endif
+
+namespace Camera {
+	// Pixel layout of the frames.
+	// FRAME_YUV420: planar I420 in a single channel image of height * 3 / 2
+	// rows (the OpenCV convention): the luma plane followed by the U and V
+	// planes at half the resolution.
+	enum frameFormat { FRAME_BGR, FRAME_YUV420 };
+
+	// A source of frames for the camera thread
+	class Source {
+	public:
+		virtual ~Source() {}
+		// Throws CameraException on failure.
+		virtual void open() = 0;
+		virtual void close() = 0;
+		// Waits for the next frame. Returns false if there is none (end of
+		// a replay).
+		virtual bool grab() = 0;
+		// Retrieves the grabbed frame in the format of the source, reusing
+		// the image buffer when possible.
+		virtual void retrieve(cv::Mat &image) = 0;
+		virtual frameFormat getFormat() const = 0;
+		// Size of the frames (of the luma plane for YUV420), after open()
+		virtual cv::Size getSize() const = 0;
+	};
+
+#ifdef HAVE_RASPICAM
+	// width, height: capture resolution, 0 for the camera default
+	class RaspiCamSource : public Source {
+	public:
+		RaspiCamSource(int width, int height) : m_width(width), m_height(height) {}
+		virtual void open();
+		virtual void close();
+		virtual bool grab();
+		virtual void retrieve(cv::Mat &image);
+		virtual frameFormat getFormat() const { return FRAME_BGR; }
+		virtual cv::Size getSize() const;
+
+	private:
+		raspicam::RaspiCam_Cv m_camera;
+		int m_width, m_height;
+	};
+
+	// Captures the native YUV420 output of the camera, without the BGR
+	// conversion of RaspiCam_Cv.
+	class RaspiCamYUVSource : public Source {
+	public:
+		RaspiCamYUVSource(int width, int height) : m_width(width), m_height(height) {}
+		virtual void open();
+		virtual void close();
+		virtual bool grab();
+		virtual void retrieve(cv::Mat &image);
+		virtual frameFormat getFormat() const { return FRAME_YUV420; }
+		virtual cv::Size getSize() const;
+
+	private:
+		raspicam::RaspiCam m_camera;
+		int m_width, m_height;
+	};
+#endif
+
+	// Replays a video file or a directory of images (read in numerical
+	// then alphabetical order of their names, skipping the files which
+	// can't be decoded).
+	class ReplaySource : public Source {
+	public:
+		// fps < 0: the video rate (10 FPS for directories),
+		// fps = 0: as fast as possible.
+		// Images are converted to format (the size must be even for YUV420)
+		// and resized to width x height if they are not 0.
+		ReplaySource(const std::string &path, double fps, bool loop, frameFormat format = FRAME_BGR, int width = 0, int height = 0);
+		virtual void open();
+		virtual void close();
+		virtual bool grab();
+		virtual void retrieve(cv::Mat &image);
+		virtual frameFormat getFormat() const { return m_format; }
+		virtual cv::Size getSize() const { return m_size; }
+
+	private:
+		bool grabNext();
+
+		std::string m_path;
+		double m_fps;
+		bool m_loop;
+		frameFormat m_format;
+		int m_width, m_height;
+		cv::Size m_size;
+		// Decoded and resized images, when they have to be converted
+		cv::Mat m_bgr, m_resized;
+
+		// Directory replay, m_decoded is the grabbed image
+		std::vector<std::string> m_files;
+		cv::Mat m_decoded;
+		size_t m_next_file = 0;
+		// Video replay
+		cv::VideoCapture m_video;
+
+		// Pacing
+		uint64_t m_period_us = 0;
+		uint64_t m_next_us = 0;
+	};
+
+	// Creates the source selected by the environment: the replay source
+	// if CAMERA_REPLAY is set, the Raspberry Pi camera otherwise, in the
+	// format given by CAMERA_FORMAT ("bgr" by default or "yuv420") and at
+	// the resolution given by CAMERA_WIDTH and CAMERA_HEIGHT.
+	Source* createSource();
+
+	// Frame format given by CAMERA_FORMAT and resolution given by
+	// CAMERA_WIDTH and CAMERA_HEIGHT (0 for the source default).
+	void getConfFormat(frameFormat &format, int &width, int &height);
+
+	// Region of interest given by CAMERA_ROI ("x,y,width,height"), or an
+	// empty rectangle for the whole frame.
+	cv::Rect getConfROI();
+
+	// Part of a frame of the given size inside roi (the whole frame if roi
+	// is empty), clipped to the frame. For YUV420 frames, the region is
+	// aligned on even coordinates. resizeImageForDB crops the rows, so
+	// ConfException is thrown if the region is empty or more than twice as
+	// wide as high.
+	cv::Rect clipROI(const cv::Rect &roi, const cv::Size &size, frameFormat format);
+
+	// Copies the part of src inside roi (see clipROI) to dst.
+	void cropFrame(const cv::Mat &src, frameFormat format, const cv::Rect &roi, cv::Mat &dst);
+}
@@ -0,0 +1,167 @@
+// Calibrates the 8 bit inference mode (NN_ENGINE=int8) and reports its
+// accuracy and throughput against the single precision engine.
+// Usage: vespid-calibrate [dataset [nnhornet.net [nnhornet.cal]]]
+// The activation ranges are measured on dataset/train.vpk or dataset/train
+// (or on the dataset itself before it is split) and the report is made on
+// dataset/test.vpk or dataset/test.
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <cxcore.hpp>
+
+#include "classifier.hh"
+#include "dataset.hh"
+#include "nn.hh"
+#include "pack.hh"
+#include "util.hh"
+
+// Minimal duration of the throughput measurements
+#define BENCH_MS 1000
+
+namespace Calibrate {
+	struct Report {
+		Dataset::Accuracy accuracy;
+		std::vector<int> predictions;
+		std::vector<Image::nnResult> results;
+	};
+
+	// Reads path.vpk, or path if it is a pack or a directory. Returns false
+	// if none exists.
+	bool loadSet(const std::string &path, std::vector<cv::Mat> &images, std::vector<int> &labels) {
+		std::string pack_path = Pack::isPack(path + ".vpk") ? path + ".vpk" : path;
+		if (Pack::isPack(pack_path)) {
+			Pack::Reader reader(pack_path);
+			for (size_t i = 0 ; i < reader.size() ; ++i) {
+				// The images only wrap the mapping of the reader
+				images.push_back(reader.getImage(i).clone());
+				labels.push_back(reader.getCategory(i));
+			}
+			return true;
+		}
+
+		if (!Dataset::isDirectory(path))
+			return false;
+		std::vector<Dataset::Sample> samples = Dataset::list(path);
+		for (auto it = samples.begin() ; it != samples.end() ; ++it) {
+			images.push_back(Dataset::load(*it));
+			labels.push_back(it->category);
+		}
+		return true;
+	}
+
+	void measure(NN::Network &net, const std::vector<cv::Mat> &images, NN::Calibration &calibration) {
+		std::vector<float> inputs(NN_MAX_BATCH * DB_RESIZED_IMAGE_SIZE);
+		for (size_t i = 0 ; i < images.size() ; i += NN_MAX_BATCH) {
+			int n = std::min(images.size() - i, (size_t) NN_MAX_BATCH);
+			for (int j = 0 ; j < n ; ++j) {
+				float *input = inputs.data() + j * DB_RESIZED_IMAGE_SIZE;
+				Image::imageToInput(images[i + j], input);
+				net.normalize(input);
+			}
+			net.measureRanges(inputs.data(), n, calibration);
+		}
+	}
+
+	// Prints the results as torchnn/train.lua does
+	Report test(Image::Classifier &classifier, const std::vector<cv::Mat> &images, const std::vector<int> &labels) {
+		Report report;
+		for (size_t i = 0 ; i < images.size() ; ++i) {
+			Image::nnResult result = classifier.classify(images[i]);
+			int prediction = Dataset::getPrediction(result);
+			report.results.push_back(result);
+			report.predictions.push_back(prediction);
+
+			report.accuracy.add(labels[i], prediction, Dataset::getProb(result, prediction));
+		}
+		report.accuracy.print(std::cout);
+
+		return report;
+	}
+
+	// Single frame classifications per second
+	double throughput(Image::Classifier &classifier, const std::vector<cv::Mat> &images) {
+		unsigned long frames = 0;
+		uint64_t start = Time::getMicros(), elapsed;
+		do {
+			for (auto it = images.begin() ; it != images.end() ; ++it)
+				classifier.classify(*it);
+			frames += images.size();
+			elapsed = Time::getMicros() - start;
+		} while (elapsed < BENCH_MS * 1000);
+		return frames * 1000000.0 / elapsed;
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string dataset = (argc > 1) ? argv[1] : "dataset";
+	std::string net_path = (argc > 2) ? argv[2] : "nnhornet.net";
+	std::string calibration_path = (argc > 3) ? argv[3] : "nnhornet.cal";
+
+	try {
+		NN::Network net;
+		net.load(net_path);
+
+		std::string train_dir = dataset + "/train", test_dir = dataset + "/test";
+		std::vector<cv::Mat> train_images;
+		std::vector<int> train_labels;
+		if (!Calibrate::loadSet(train_dir, train_images, train_labels)) {
+			train_dir = dataset;
+			if (!Calibrate::loadSet(train_dir, train_images, train_labels))
+				throw Dataset::DatasetException("no dataset " + dataset);
+		}
+		if (train_images.empty())
+			throw Dataset::DatasetException("no image in " + train_dir);
+
+		std::cout << "Measuring the activation ranges on " << train_images.size() << " images of "
+			<< train_dir << "..." << std::endl;
+		NN::Calibration calibration;
+		Calibrate::measure(net, train_images, calibration);
+		calibration.save(calibration_path);
+		std::cout << "Saved the calibration to " << calibration_path << "." << std::endl;
+
+		std::vector<cv::Mat> images;
+		std::vector<int> labels;
+		if (!Calibrate::loadSet(test_dir, images, labels)) {
+			std::cout << "No " << test_dir << ".vpk or " << test_dir << " directory, skipping the accuracy report." << std::endl;
+			return 0;
+		}
+		if (images.empty()) {
+			std::cout << "No image in " << test_dir << ", skipping the accuracy report." << std::endl;
+			return 0;
+		}
+
+		Image::NativeClassifier native(net_path);
+		Image::QuantizedClassifier quantized(net_path, calibration_path);
+
+		std::cout << "\n-- Results (float32) --" << std::endl;
+		Calibrate::Report native_report = Calibrate::test(native, images, labels);
+		std::cout << "\n-- Results (int8) --" << std::endl;
+		Calibrate::Report quantized_report = Calibrate::test(quantized, images, labels);
+
+		unsigned int agree = 0;
+		double max_diff = 0;
+		for (size_t i = 0 ; i < images.size() ; ++i) {
+			if (native_report.predictions[i] == quantized_report.predictions[i])
+				agree++;
+			for (int j = 0 ; j < DATASET_CATEGORIES ; ++j)
+				max_diff = std::max(max_diff, std::fabs(Dataset::getProb(native_report.results[i], j)
+					- Dataset::getProb(quantized_report.results[i], j)));
+		}
+		std::cout << "\nint8 and float32 predictions agree on " << agree << " images out of " << images.size()
+			<< ", largest probability difference " << max_diff << std::endl;
+
+		double native_fps = Calibrate::throughput(native, images);
+		double quantized_fps = Calibrate::throughput(quantized, images);
+		std::cout << std::setprecision(1) << "Throughput: float32 " << native_fps << " frames/s, int8 "
+			<< quantized_fps << " frames/s (" << std::setprecision(2) << quantized_fps / native_fps
+			<< "x)" << std::endl;
+	} catch (std::exception &ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
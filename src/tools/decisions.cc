@@ -0,0 +1,285 @@
+// Replays labelled sessions through the classifier and the decision test,
+// and reports the decision latency and error rates.
+// Usage: vespid-decisions [category=replay ...]
+// Each argument is a session: a video or a directory of images (as for
+// CAMERA_REPLAY) in which all the frames show a hornet of the category
+// (asian, european or empty). Without arguments, the directories of
+// dataset/test are used as sessions. A laser break is simulated at every
+// frame, and the decision of the fixed rule (average of DECISION_FRAMES
+// frames) is reported for comparison. Asian sessions are also replayed with
+// an empty frame (from the empty sessions) before the first one, as when the
+// hornet is not in view yet just after the break. The classifier, the
+// decision test and the camera frames (CAMERA_FORMAT, CAMERA_WIDTH,
+// CAMERA_HEIGHT and CAMERA_ROI) are configured as in VESPID. The latency adds
+// the measured preprocessing and inference time to the capture time of the
+// frames at CAMERA_REPLAY_FPS.
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cxcore.hpp>
+
+#include "classifier.hh"
+#include "dataset.hh"
+#include "decision.hh"
+#include "image.hh"
+#include "source.hh"
+#include "util.hh"
+
+#define DEFAULT_FPS 10
+
+namespace Decisions {
+	struct Session {
+		std::string path;
+		int category;
+		std::vector<Image::nnResult> results;
+		// Total preprocessing and inference time
+		uint64_t process_us;
+	};
+
+	struct Stats {
+		unsigned long decisions = 0;
+		unsigned long asian = 0;
+		std::vector<unsigned int> frames;
+
+		void add(bool is_asian, unsigned int n) {
+			decisions++;
+			if (is_asian)
+				asian++;
+			frames.push_back(n);
+		}
+
+		double getMeanFrames() const {
+			double sum = 0;
+			for (auto it = frames.begin() ; it != frames.end() ; ++it)
+				sum += *it;
+			return frames.empty() ? 0 : sum / frames.size();
+		}
+
+		unsigned int getPercentile(double p) {
+			if (frames.empty())
+				return 0;
+			std::sort(frames.begin(), frames.end());
+			return frames[std::min((size_t) (p * frames.size()), frames.size() - 1)];
+		}
+	};
+
+	// Classifies the frames of a session as the camera, preprocessing and
+	// inference stages do. Sessions of database images are classified
+	// directly.
+	void classify(Session &session, Image::Classifier &classifier, const cv::Rect &roi) {
+		Camera::frameFormat format;
+		int width, height;
+		Camera::getConfFormat(format, width, height);
+
+		std::unique_ptr<Camera::ReplaySource> source(new Camera::ReplaySource(session.path, 0, false));
+		source->open();
+		const bool database = source->getSize() == cv::Size(DB_RESIZED_IMAGE_WIDTH, DB_RESIZED_IMAGE_HEIGHT);
+		if (!database) {
+			source->close();
+			source.reset(new Camera::ReplaySource(session.path, 0, false, format, width, height));
+			source->open();
+			Camera::clipROI(roi, source->getSize(), format);
+		}
+
+		cv::Mat frame, cropped, resized;
+		while (source->grab()) {
+			source->retrieve(frame);
+			uint64_t start = Time::getMicros();
+			if (database) {
+				session.results.push_back(classifier.classify(frame));
+			} else if (roi.area() > 0) {
+				Camera::cropFrame(frame, format, roi, cropped);
+				Image::resizeImageForDB(cropped, resized, format);
+				session.results.push_back(classifier.classify(resized));
+			} else {
+				Image::resizeImageForDB(frame, resized, format);
+				session.results.push_back(classifier.classify(resized));
+			}
+			session.process_us += Time::getMicros() - start;
+		}
+		source->close();
+	}
+
+	// Decision after a break at frame start with the test, or with the
+	// fixed rule. If lead is not NULL, it is the result of a frame taken
+	// before the frame start (e.g. an empty frame). Returns false if the
+	// session ends first.
+	bool decideSPRT(const Session &session, size_t start, const Decision::Settings &settings,
+			bool &is_asian, unsigned int &n, const Image::nnResult *lead = NULL) {
+		Decision::SPRT test(settings);
+		Decision::ResultWindow window;
+		if (lead != NULL) {
+			window.push(*lead, 0);
+			Decision::outcome outcome = test.evaluate(window);
+			if (outcome != Decision::UNDECIDED) {
+				is_asian = outcome == Decision::ASIAN;
+				n = window.getCount();
+				return true;
+			}
+		}
+		for (size_t i = start ; i < session.results.size() ; ++i) {
+			window.push(session.results[i], 0);
+			Decision::outcome outcome = test.evaluate(window);
+			if (outcome != Decision::UNDECIDED) {
+				is_asian = outcome == Decision::ASIAN;
+				n = window.getCount();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool decideFixed(const Session &session, size_t start, const Decision::Settings &settings, bool &is_asian,
+			const Image::nnResult *lead = NULL) {
+		const size_t frames = (lead != NULL) ? settings.max_frames - 1 : settings.max_frames;
+		if (start + frames > session.results.size())
+			return false;
+		double sum = (lead != NULL) ? lead->asian_prob : 0;
+		for (size_t i = start ; i < start + frames ; ++i)
+			sum += session.results[i].asian_prob;
+		is_asian = sum / settings.max_frames > settings.min_prob;
+		return true;
+	}
+
+	// A decision after n frames waits for the capture of the frames, and for
+	// the processing of the last one (of all of them if the processing is
+	// slower than the capture).
+	void printRow(const char *name, Stats &stats, double frame_ms, double process_ms) {
+		double latency = (stats.decisions > 0)
+			? (stats.getMeanFrames() - 1) * std::max(frame_ms, process_ms) + process_ms : 0;
+		std::cout << std::left << std::setw(10) << name << std::right << std::setw(10) << stats.decisions
+			<< std::setw(9) << std::setprecision(1)
+			<< ((stats.decisions > 0) ? 100.0 * stats.asian / stats.decisions : 0) << " %"
+			<< std::setw(10) << std::setprecision(2) << stats.getMeanFrames()
+			<< std::setw(6) << stats.getPercentile(0.5) << std::setw(6) << stats.getPercentile(0.95)
+			<< std::setw(12) << std::setprecision(0) << latency << std::endl;
+	}
+
+	double percent(unsigned long n, unsigned long total) {
+		return (total > 0) ? 100.0 * n / total : 0;
+	}
+}
+
+int main(int argc, char **argv) {
+	try {
+		std::vector<Decisions::Session> sessions;
+		if (argc > 1) {
+			for (int i = 1 ; i < argc ; ++i) {
+				std::string arg = argv[i];
+				size_t eq = arg.find('=');
+				int category = (eq == std::string::npos) ? -1 : Dataset::getCategory(arg.substr(0, eq));
+				if (category < 0) {
+					std::cerr << "Sessions must be given as category=replay, with category asian, european or empty" << std::endl;
+					return 1;
+				}
+				sessions.push_back({arg.substr(eq + 1), category, {}, 0});
+			}
+		} else {
+			for (int category = 0 ; category < DATASET_CATEGORIES ; ++category) {
+				std::string path = std::string("dataset/test/") + Dataset::getCategoryName(category);
+				if (Dataset::isDirectory(path))
+					sessions.push_back({path, category, {}, 0});
+			}
+			if (sessions.empty())
+				throw Dataset::DatasetException("no session given and no dataset/test directory");
+		}
+
+		Decision::Settings settings = Decision::getConfSettings();
+		double fps = Conf::getDouble("CAMERA_REPLAY_FPS", DEFAULT_FPS);
+		double frame_ms = (fps > 0) ? 1000.0 / fps : 0;
+		cv::Rect roi = Camera::getConfROI();
+
+		std::unique_ptr<Image::Classifier> classifier(Image::createClassifier());
+		unsigned long frames = 0;
+		uint64_t process_us = 0;
+		for (auto it = sessions.begin() ; it != sessions.end() ; ++it) {
+			Decisions::classify(*it, *classifier, roi);
+			frames += it->results.size();
+			process_us += it->process_us;
+		}
+		double process_ms = (frames > 0) ? process_us / (1000.0 * frames) : 0;
+
+		// Empty frames for the asian sessions which start with one: those
+		// of the empty sessions, or a certain empty result without any
+		int asian = Dataset::getCategory("asian"), empty = Dataset::getCategory("empty");
+		std::vector<Image::nnResult> empty_results;
+		for (auto it = sessions.begin() ; it != sessions.end() ; ++it) {
+			if (it->category == empty)
+				empty_results.insert(empty_results.end(), it->results.begin(), it->results.end());
+		}
+		if (empty_results.empty())
+			empty_results.push_back({1, 0, 0});
+
+		Decisions::Stats stats[DATASET_CATEGORIES], fixed[DATASET_CATEGORIES];
+		Decisions::Stats asian_lead, asian_lead_fixed;
+		for (auto it = sessions.begin() ; it != sessions.end() ; ++it) {
+			for (size_t start = 0 ; start < it->results.size() ; ++start) {
+				bool is_asian;
+				unsigned int n;
+				if (Decisions::decideSPRT(*it, start, settings, is_asian, n))
+					stats[it->category].add(is_asian, n);
+				if (Decisions::decideFixed(*it, start, settings, is_asian))
+					fixed[it->category].add(is_asian, settings.max_frames);
+				if (it->category != asian)
+					continue;
+
+				const Image::nnResult &lead = empty_results[start % empty_results.size()];
+				if (Decisions::decideSPRT(*it, start, settings, is_asian, n, &lead))
+					asian_lead.add(is_asian, n);
+				if (Decisions::decideFixed(*it, start, settings, is_asian, &lead))
+					asian_lead_fixed.add(is_asian, settings.max_frames);
+			}
+		}
+
+		std::cout << std::fixed << sessions.size() << " sessions, " << frames << " frames. Decision test: alpha "
+			<< settings.alpha << ", beta " << settings.beta << ", at most " << settings.max_frames
+			<< " frames, MIN_PROB " << settings.min_prob << ". Latency at " << fps << " frames/s, with "
+			<< std::setprecision(2) << process_ms << " ms of processing per frame." << std::endl;
+
+		std::cout << "\n-- Sequential test --" << std::endl;
+		std::cout << std::left << std::setw(10) << "truth" << std::right << std::setw(10) << "decisions"
+			<< std::setw(11) << "asian" << std::setw(10) << "frames" << std::setw(6) << "p50"
+			<< std::setw(6) << "p95" << std::setw(12) << "latency ms" << std::endl;
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i)
+			Decisions::printRow(Dataset::getCategoryName(i), stats[i], frame_ms, process_ms);
+		Decisions::printRow("asian+1", asian_lead, frame_ms, process_ms);
+
+		std::cout << "\n-- Fixed rule (" << settings.max_frames << " frames) --" << std::endl;
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i)
+			Decisions::printRow(Dataset::getCategoryName(i), fixed[i], frame_ms, process_ms);
+		Decisions::printRow("asian+1", asian_lead_fixed, frame_ms, process_ms);
+		std::cout << "(asian+1: asian sessions whose first frame is empty)" << std::endl;
+
+		// Error rates: a hornet which is not asian is killed, an asian
+		// hornet is released
+		Decisions::Stats others, others_fixed;
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i) {
+			if (i == asian)
+				continue;
+			others.decisions += stats[i].decisions;
+			others.asian += stats[i].asian;
+			others_fixed.decisions += fixed[i].decisions;
+			others_fixed.asian += fixed[i].asian;
+		}
+
+		std::cout << std::setprecision(2) << "\nWrong kills: sequential " << Decisions::percent(others.asian, others.decisions)
+			<< " % (bound " << 100 * settings.alpha << " %), fixed " << Decisions::percent(others_fixed.asian, others_fixed.decisions)
+			<< " %" << std::endl;
+		std::cout << "Missed asian hornets: sequential "
+			<< Decisions::percent(stats[asian].decisions - stats[asian].asian, stats[asian].decisions)
+			<< " % (bound " << 100 * settings.beta << " %), fixed "
+			<< Decisions::percent(fixed[asian].decisions - fixed[asian].asian, fixed[asian].decisions) << " %" << std::endl;
+		std::cout << "Missed asian hornets after an empty frame: sequential "
+			<< Decisions::percent(asian_lead.decisions - asian_lead.asian, asian_lead.decisions) << " %, fixed "
+			<< Decisions::percent(asian_lead_fixed.decisions - asian_lead_fixed.asian, asian_lead_fixed.decisions)
+			<< " %" << std::endl;
+	} catch (std::exception &ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,155 @@
+// Converts datasets between directories of images and packs.
+// Usage:
+//   vespid-pack pack dataset_dir file.vpk    appends the images of a dataset
+//   vespid-pack unpack file.vpk dataset_dir  writes the images of a pack
+//                                            (never overwrites images)
+//   vespid-pack info file.vpk                prints the content of a pack
+// Split datasets (with train and test subdirectories) are packed one split
+// at a time, e.g. `vespid-pack pack dataset/train dataset/train.vpk`.
+#include <iostream>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <string>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/stat.h>
+#include <cxcore.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "dataset.hh"
+#include "pack.hh"
+
+namespace PackTool {
+	const char* getSourceName(int source) {
+		switch (source) {
+		case Pack::SOURCE_CAMERA:
+			return "camera";
+		case Pack::SOURCE_BURST:
+			return "burst";
+		case Pack::SOURCE_DIRECTORY:
+			return "directory";
+		default:
+			return "unknown";
+		}
+	}
+
+	void makeDirectory(const std::string &path) {
+		if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+			throw Dataset::DatasetException("failed to create " + path);
+	}
+
+	void pack(const std::string &dir, const std::string &path) {
+		std::vector<Dataset::Sample> samples = Dataset::list(dir);
+		if (samples.empty())
+			throw Dataset::DatasetException("no image in " + dir);
+
+		Pack::Writer writer(path);
+		for (auto it = samples.begin() ; it != samples.end() ; ++it) {
+			// The image number is its file name, its capture time the
+			// modification time of the file
+			std::string name = it->path.substr(it->path.rfind('/') + 1);
+			uint32_t number = strtoul(name.c_str(), NULL, 10);
+			uint64_t timestamp_us = 0;
+			struct stat st;
+			if (stat(it->path.c_str(), &st) == 0)
+				timestamp_us = st.st_mtime * (uint64_t) 1000000;
+
+			writer.append(Dataset::load(*it), it->category, number, timestamp_us, 0, Pack::SOURCE_DIRECTORY);
+		}
+		writer.close();
+
+		std::cout << "Packed " << samples.size() << " images of " << dir << " to " << path << "." << std::endl;
+	}
+
+	void unpack(const std::string &path, const std::string &dir) {
+		Pack::Reader reader(path);
+		makeDirectory(dir);
+		for (int category = 0 ; category < DATASET_CATEGORIES ; ++category) {
+			if (reader.getIndex(category).empty())
+				continue;
+			makeDirectory(dir + "/" + Dataset::getCategoryName(category));
+		}
+
+		unsigned int renamed = 0;
+		for (int category = 0 ; category < DATASET_CATEGORIES ; ++category) {
+			const std::vector<uint32_t> &index = reader.getIndex(category);
+			uint32_t max_number = 0;
+			for (size_t i = 0 ; i < index.size() ; ++i)
+				max_number = std::max(max_number, Pack::getNumber(reader.get(index[i]), i));
+
+			// Packs built from several directories may number several
+			// records alike: the later ones are renumbered after the last.
+			std::set<uint32_t> numbers;
+			for (size_t i = 0 ; i < index.size() ; ++i) {
+				uint32_t number = Pack::getNumber(reader.get(index[i]), i);
+				if (!numbers.insert(number).second) {
+					number = ++max_number;
+					numbers.insert(number);
+					renamed++;
+				}
+
+				std::string image_path = dir + "/" + Dataset::getCategoryName(category) + "/"
+					+ std::to_string(number) + ".ppm";
+				struct stat st;
+				if (stat(image_path.c_str(), &st) == 0)
+					throw Dataset::DatasetException(image_path + " already exists");
+				if (!cv::imwrite(image_path, reader.getImage(index[i])))
+					throw Dataset::DatasetException("failed to write " + image_path);
+			}
+		}
+
+		std::cout << "Unpacked " << reader.size() << " images of " << path << " to " << dir << "." << std::endl;
+		if (renamed > 0)
+			std::cout << renamed << " images were renumbered, their numbers were already used." << std::endl;
+	}
+
+	void info(const std::string &path) {
+		Pack::Reader reader(path);
+		std::cout << path << ": " << reader.size() << " records"
+			<< (reader.isClosed() ? "" : " (no index, the pack was not closed)") << std::endl;
+
+		for (int category = 0 ; category < DATASET_CATEGORIES ; ++category)
+			std::cout << "  " << Dataset::getCategoryName(category) << ": " << reader.getIndex(category).size() << std::endl;
+
+		unsigned int sources[Pack::SOURCE_DIRECTORY + 1] = {0};
+		uint64_t first_us = 0, last_us = 0;
+		for (size_t i = 0 ; i < reader.size() ; ++i) {
+			const Pack::Record &record = reader.get(i);
+			if (record.source <= Pack::SOURCE_DIRECTORY)
+				sources[record.source]++;
+			if (record.timestamp_us != 0 && (first_us == 0 || record.timestamp_us < first_us))
+				first_us = record.timestamp_us;
+			if (record.timestamp_us > last_us)
+				last_us = record.timestamp_us;
+		}
+		for (int source = 0 ; source <= Pack::SOURCE_DIRECTORY ; ++source) {
+			if (sources[source] > 0)
+				std::cout << "  from " << getSourceName(source) << ": " << sources[source] << std::endl;
+		}
+		if (first_us != 0)
+			std::cout << "  captured over " << (last_us - first_us) / 1000000 << " s" << std::endl;
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string command = (argc > 1) ? argv[1] : "";
+	if (!((command == "pack" || command == "unpack") && argc == 4) && !(command == "info" && argc == 3)) {
+		std::cerr << "Usage: vespid-pack pack dataset_dir file.vpk | unpack file.vpk dataset_dir | info file.vpk" << std::endl;
+		return 1;
+	}
+
+	try {
+		if (command == "pack")
+			PackTool::pack(argv[2], argv[3]);
+		else if (command == "unpack")
+			PackTool::unpack(argv[2], argv[3]);
+		else
+			PackTool::info(argv[2]);
+	} catch (std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
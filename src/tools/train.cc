@@ -0,0 +1,141 @@
+// Trains the network of torchnn/train.lua on all the cores and saves it in
+// the format read by the native engines (no Torch needed).
+// Usage: vespid-train [dataset [nnhornet.net]]
+// Training images are read from dataset/train.vpk or dataset/train, test
+// images from dataset/test.vpk or dataset/test. The results on the test
+// images are printed as train.lua does. See Train::getConfSettings for the
+// training parameters.
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <cxcore.hpp>
+
+#include "classifier.hh"
+#include "dataset.hh"
+#include "nn.hh"
+#include "pack.hh"
+#include "train.hh"
+#include "util.hh"
+
+namespace TrainTool {
+	void addImage(Train::Set &set, const cv::Mat &image, int category, const std::string &name) {
+		size_t offset = set.inputs.size();
+		set.inputs.resize(offset + set.getInputSize());
+		Image::imageToInput(image, set.inputs.data() + offset);
+		set.labels.push_back(category);
+		set.names.push_back(name);
+	}
+
+	// Reads path.vpk, or the path directory. Returns false if neither
+	// exists.
+	bool loadSet(const std::string &path, Train::Set &set) {
+		set.h = DB_RESIZED_IMAGE_HEIGHT;
+		set.w = DB_RESIZED_IMAGE_WIDTH;
+
+		if (Pack::isPack(path + ".vpk")) {
+			Pack::Reader reader(path + ".vpk");
+			for (size_t i = 0 ; i < reader.size() ; ++i) {
+				int category = reader.getCategory(i);
+				addImage(set, reader.getImage(i), category, path + ".vpk:" + Dataset::getCategoryName(category)
+					+ "/" + std::to_string(reader.get(i).number));
+			}
+			return true;
+		}
+
+		if (!Dataset::isDirectory(path))
+			return false;
+		std::vector<Dataset::Sample> samples = Dataset::list(path);
+		for (auto it = samples.begin() ; it != samples.end() ; ++it)
+			addImage(set, Dataset::load(*it), it->category, it->path);
+		return true;
+	}
+
+	// Prints the results as torchnn/train.lua does
+	void test(NN::Network &net, const Train::Set &set) {
+		Dataset::Accuracy accuracy;
+
+		std::vector<float> inputs(NN_MAX_BATCH * set.getInputSize()), outputs(NN_MAX_BATCH * DATASET_CATEGORIES);
+		for (size_t i = 0 ; i < set.size() ; i += NN_MAX_BATCH) {
+			int n = std::min(set.size() - i, (size_t) NN_MAX_BATCH);
+			for (int j = 0 ; j < n ; ++j) {
+				float *input = inputs.data() + j * set.getInputSize();
+				std::copy(set.getInput(i + j), set.getInput(i + j) + set.getInputSize(), input);
+				net.normalize(input);
+			}
+			net.forwardBatch(inputs.data(), n, outputs.data());
+
+			for (int j = 0 ; j < n ; ++j) {
+				const float *probs = outputs.data() + j * DATASET_CATEGORIES;
+				int truth = set.labels[i + j];
+				int prediction = std::max_element(probs, probs + DATASET_CATEGORIES) - probs;
+				accuracy.add(truth, prediction, probs[prediction]);
+				if (prediction != truth)
+					std::cout << "Incorrect\t" << set.names[i + j] << std::endl;
+			}
+		}
+
+		std::cout << "\n-- Results --" << std::endl;
+		accuracy.print(std::cout);
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string dataset = (argc > 1) ? argv[1] : "dataset";
+	std::string net_path = (argc > 2) ? argv[2] : "nnhornet.net";
+
+	try {
+		Train::Settings settings = Train::getConfSettings();
+
+		std::cout << "Building datasets..." << std::endl;
+		Train::Set train_set, test_set;
+		if (!TrainTool::loadSet(dataset + "/train", train_set))
+			throw Dataset::DatasetException("no " + dataset + "/train.vpk or " + dataset + "/train directory");
+		if (train_set.size() == 0)
+			throw Dataset::DatasetException("no image in " + dataset + "/train");
+		bool has_test = TrainTool::loadSet(dataset + "/test", test_set) && test_set.size() > 0;
+
+		std::vector<std::string> categories;
+		for (int i = 0 ; i < DATASET_CATEGORIES ; ++i)
+			categories.push_back(Dataset::getCategoryName(i));
+		Train::Trainer trainer(settings, train_set, categories);
+
+		NN::Network net;
+		trainer.getNetwork(net);
+		for (int i = 0 ; i < train_set.c ; ++i) {
+			std::cout << "Channel " << i + 1 << ", Mean: " << net.getMean()[i] << std::endl;
+			std::cout << "Channel " << i + 1 << ", Standard Deviation: " << net.getStdv()[i] << std::endl;
+		}
+		std::cout << "Done." << std::endl;
+
+		std::cout << "\nTraining network on " << train_set.size() << " images with " << settings.workers
+			<< " threads..." << std::endl;
+		uint64_t start = Time::getMicros();
+		for (unsigned int epoch = 1 ; epoch <= settings.epochs ; ++epoch) {
+			double loss = trainer.runEpoch();
+			std::cout << std::fixed << "# epoch " << epoch << "/" << settings.epochs << ": current error = "
+				<< std::setprecision(6) << loss << ", accuracy " << std::setprecision(2)
+				<< trainer.getAccuracy() * 100 << "%, " << std::setprecision(1)
+				<< (Time::getMicros() - start) / 1e6 << " s" << std::endl;
+			std::cout.unsetf(std::ios::floatfield);
+		}
+
+		trainer.getNetwork(net);
+		if (has_test) {
+			std::cout << "\nTesting network..." << std::endl;
+			TrainTool::test(net, test_set);
+		} else {
+			std::cout << "\nNo image in " << dataset << "/test, skipping the test." << std::endl;
+		}
+
+		net.save(net_path);
+		std::cout << "\nSaved model to " << net_path << "." << std::endl;
+	} catch (std::exception &ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+
+#include "trace.hh"
+
+namespace Trace {
+	static const char *stage_names[STAGE_COUNT] = {
+		"frame age",
+		"resize",
+		"queue wait",
+		"change detection",
+		"forward pass",
+		"decision forward pass",
+		"capture -> result",
+		"result -> GPIO thread",
+		"servo command",
+		"laser break -> decision",
+		"capture -> decision",
+		"GPIO loop period",
+	};
+
+	static Histogram histograms[STAGE_COUNT];
+
+	// Last decision (only used by dump(), a lock is fine). std::mutex is
+	// constant-initialized, so it is usable before main() and never freed.
+	static std::mutex decision_mutex;
+	static FrameInfo decision_first, decision_last;
+	static uint64_t decision_time = 0;
+
+	static unsigned int bucketIndex(uint64_t value) {
+		if (value < TRACE_SUB_BUCKETS)
+			return value;
+
+		unsigned int exponent = 63 - __builtin_clzll(value);
+		unsigned int sub = (value >> (exponent - TRACE_SUB_BUCKETS_BITS)) & (TRACE_SUB_BUCKETS - 1);
+		unsigned int index = (exponent - TRACE_SUB_BUCKETS_BITS + 1) * TRACE_SUB_BUCKETS + sub;
+		return (index < TRACE_BUCKETS) ? index : TRACE_BUCKETS - 1;
+	}
+
+	// Middle value of a bucket
+	static uint64_t bucketValue(unsigned int index) {
+		if (index < TRACE_SUB_BUCKETS)
+			return index;
+
+		unsigned int shift = index / TRACE_SUB_BUCKETS - 1;
+		uint64_t sub = index % TRACE_SUB_BUCKETS;
+		return ((TRACE_SUB_BUCKETS + sub) << shift) + ((1ull << shift) >> 1);
+	}
+
+	Histogram::Histogram() : m_count(0), m_max(0), m_sum(0) {
+		for (unsigned int i = 0 ; i < TRACE_BUCKETS ; ++i)
+			m_buckets[i].store(0, std::memory_order_relaxed);
+	}
+
+	void Histogram::record(uint64_t value) {
+		m_buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(value, std::memory_order_relaxed);
+
+		uint64_t max = m_max.load(std::memory_order_relaxed);
+		while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed));
+	}
+
+	unsigned long Histogram::getCount() const {
+		return m_count.load(std::memory_order_relaxed);
+	}
+
+	uint64_t Histogram::getPercentile(double p) const {
+		// Buckets are read one by one, the result may be slightly off if
+		// values are recorded meanwhile.
+		unsigned long total = 0;
+		for (unsigned int i = 0 ; i < TRACE_BUCKETS ; ++i)
+			total += m_buckets[i].load(std::memory_order_relaxed);
+		if (total == 0)
+			return 0;
+
+		unsigned long rank = p * (total - 1) + 1, seen = 0;
+		for (unsigned int i = 0 ; i < TRACE_BUCKETS ; ++i) {
+			seen += m_buckets[i].load(std::memory_order_relaxed);
+			if (seen >= rank)
+				return std::min(bucketValue(i), getMax());
+		}
+		return getMax();
+	}
+
+	uint64_t Histogram::getMax() const {
+		return m_max.load(std::memory_order_relaxed);
+	}
+
+	uint64_t Histogram::getSum() const {
+		return m_sum.load(std::memory_order_relaxed);
+	}
+
+	void record(stage s, uint64_t us) {
+		histograms[s].record(us);
+	}
+
+	void recordDecision(const FrameInfo &first, const FrameInfo &last, uint64_t decision_us) {
+		std::lock_guard<std::mutex> lock(decision_mutex);
+		decision_first = first;
+		decision_last = last;
+		decision_time = decision_us;
+	}
+
+	void dump(std::ostream &out) {
+		out << "-- Latency (microseconds) --" << std::endl;
+		out << std::left << std::setw(26) << "stage" << std::right
+			<< std::setw(10) << "count" << std::setw(10) << "p50" << std::setw(10) << "p95"
+			<< std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+		for (int i = 0 ; i < STAGE_COUNT ; ++i) {
+			const Histogram &h = histograms[i];
+			out << std::left << std::setw(26) << stage_names[i] << std::right
+				<< std::setw(10) << h.getCount() << std::setw(10) << h.getPercentile(0.5)
+				<< std::setw(10) << h.getPercentile(0.95) << std::setw(10) << h.getPercentile(0.99)
+				<< std::setw(10) << h.getMax() << std::endl;
+		}
+
+		std::lock_guard<std::mutex> lock(decision_mutex);
+		if (decision_time != 0) {
+			out << "Last decision: frames " << decision_first.seq << " to " << decision_last.seq
+				<< ", " << decision_time - decision_first.capture_us << " us after the first capture" << std::endl;
+		}
+	}
+
+	const char* getStageName(stage s) {
+		return stage_names[s];
+	}
+
+	const Histogram& getHistogram(stage s) {
+		return histograms[s];
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+#include <cstdint>
+
+// Histograms use 8 buckets per power of two, the relative error of
+// percentiles is at most 12.5 %.
+#define TRACE_SUB_BUCKETS_BITS 3
+#define TRACE_SUB_BUCKETS (1 << TRACE_SUB_BUCKETS_BITS)
+#define TRACE_BUCKETS (TRACE_SUB_BUCKETS * 40)
+
+namespace Trace {
+	// Pipeline stages whose duration is traced, in microseconds
+	enum stage {
+		// Capture -> retrieval by the image processing thread
+		STAGE_FRAME_AGE,
+		STAGE_RESIZE,
+		// Preprocessing -> inference stage
+		STAGE_QUEUE_WAIT,
+		// Change detection in front of the classifier
+		STAGE_CHANGE_DETECT,
+		// Forward pass of a single frame
+		STAGE_FORWARD,
+		// Forward pass of a frame requested for a decision
+		STAGE_FORWARD_BATCH,
+		// Capture -> result published
+		STAGE_CAPTURE_TO_RESULT,
+		// Batch published -> received by the GPIO thread
+		STAGE_RESULT_TO_GPIO,
+		// set_servo_pulsewidth call
+		STAGE_SERVO_COMMAND,
+		// Laser break -> decision
+		STAGE_BREAK_TO_DECISION,
+		// Capture of the first frame of the decision window -> decision
+		STAGE_CAPTURE_TO_DECISION,
+		// Between two loops of the GPIO thread in active mode
+		STAGE_GPIO_PERIOD,
+		STAGE_COUNT
+	};
+
+	// Frame identification, carried along the pipeline
+	struct FrameInfo {
+		unsigned long seq = 0;
+		// Capture time, see Time::getMicros
+		uint64_t capture_us = 0;
+	};
+
+	// Lock-free log-linear histogram
+	class Histogram {
+	public:
+		Histogram();
+		void record(uint64_t value);
+		unsigned long getCount() const;
+		// p between 0 and 1
+		uint64_t getPercentile(double p) const;
+		uint64_t getMax() const;
+		// Sum of the recorded values
+		uint64_t getSum() const;
+
+	private:
+		std::atomic<unsigned long> m_buckets[TRACE_BUCKETS];
+		std::atomic<unsigned long> m_count;
+		std::atomic<uint64_t> m_max;
+		std::atomic<uint64_t> m_sum;
+	};
+
+	void record(stage s, uint64_t us);
+	// Records the frames used for the last decision, for dump()
+	void recordDecision(const FrameInfo &first, const FrameInfo &last, uint64_t decision_us);
+	// Prints the count, p50, p95, p99 and max of each stage
+	void dump(std::ostream &out);
+
+	const char* getStageName(stage s);
+	const Histogram& getHistogram(stage s);
+}
@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <string>
+#include <vector>
+#include <SDL_cpuinfo.h>
+
+#include "train.hh"
+
+// Maximal waiting time for a worker, so that its death is noticed
+#define TRAIN_WAIT_MS 100
+// Augmentation: largest shifts in pixels, and largest relative change of the
+// brightness
+#define TRAIN_SHIFT_X 2
+#define TRAIN_SHIFT_Y 1
+#define TRAIN_BRIGHTNESS 0.2f
+
+namespace Train {
+	Settings getConfSettings() {
+		Settings settings;
+		long epochs = Conf::getInt("TRAIN_EPOCHS", settings.epochs);
+		long batch = Conf::getInt("TRAIN_BATCH", settings.batch);
+		settings.learning_rate = Conf::getDouble("TRAIN_LEARNING_RATE", settings.learning_rate);
+		settings.momentum = Conf::getDouble("TRAIN_MOMENTUM", settings.momentum);
+		settings.augment = Conf::getInt("TRAIN_AUGMENT", settings.augment) != 0;
+		long workers = Conf::getInt("TRAIN_WORKERS", SDL_GetCPUCount());
+		settings.seed = Conf::getInt("TRAIN_SEED", settings.seed);
+
+		if (epochs < 1)
+			throw Conf::ConfException("TRAIN_EPOCHS");
+		if (batch < 1)
+			throw Conf::ConfException("TRAIN_BATCH");
+		if (settings.learning_rate <= 0)
+			throw Conf::ConfException("TRAIN_LEARNING_RATE");
+		if (settings.momentum < 0 || settings.momentum >= 1)
+			throw Conf::ConfException("TRAIN_MOMENTUM");
+		if (workers < 1 || workers > TRAIN_MAX_WORKERS)
+			throw Conf::ConfException("TRAIN_WORKERS");
+		settings.epochs = epochs;
+		settings.batch = batch;
+		settings.workers = workers;
+		return settings;
+	}
+
+	// Layers of torchnn/train.lua
+	static std::vector<NN::Layer> buildLayers(int c, int h, int w, int n_categories) {
+		std::vector<NN::Layer> layers;
+		auto add = [&](NN::layerType type, int out_c, int k) {
+			NN::Layer layer;
+			layer.type = type;
+			layer.c = out_c;
+			layer.kh = layer.kw = k;
+			if (type == NN::LAYER_MAXPOOL)
+				layer.dh = layer.dw = k;
+			NN::setOutputSize(layer, c, h, w);
+			c = layer.c; h = layer.h; w = layer.w;
+			layers.push_back(layer);
+		};
+
+		add(NN::LAYER_CONV, 6, 3);
+		add(NN::LAYER_RELU, 0, 0);
+		add(NN::LAYER_MAXPOOL, 0, 2);
+		add(NN::LAYER_CONV, 16, 3);
+		add(NN::LAYER_RELU, 0, 0);
+		add(NN::LAYER_MAXPOOL, 0, 2);
+		add(NN::LAYER_VIEW, 0, 0);
+		add(NN::LAYER_LINEAR, 100, 0);
+		add(NN::LAYER_RELU, 0, 0);
+		add(NN::LAYER_LINEAR, 30, 0);
+		add(NN::LAYER_RELU, 0, 0);
+		add(NN::LAYER_LINEAR, n_categories, 0);
+		add(NN::LAYER_LOGSOFTMAX, 0, 0);
+		return layers;
+	}
+
+	void TrainWorker::construct() {
+		start = SDL_CreateSemaphore(0);
+		done = SDL_CreateSemaphore(0);
+		m_rng.seed(trainer->m_settings.seed * TRAIN_MAX_WORKERS + index);
+
+		const Set &set = trainer->m_set;
+		size_t max_size = set.getInputSize();
+		m_acts.assign(1, std::vector<float>(set.getInputSize()));
+		for (auto it = trainer->m_layers.begin() ; it != trainer->m_layers.end() ; ++it) {
+			m_acts.push_back(std::vector<float>(it->c * it->h * it->w));
+			max_size = std::max(max_size, m_acts.back().size());
+			weight_grads.push_back(std::vector<float>(it->weight.size()));
+			bias_grads.push_back(std::vector<float>(it->bias.size()));
+		}
+		m_grad_a.resize(max_size);
+		m_grad_b.resize(max_size);
+	}
+
+	TrainWorker::~TrainWorker() {
+		destruct();
+
+		if (start != NULL)
+			SDL_DestroySemaphore(start);
+		if (done != NULL)
+			SDL_DestroySemaphore(done);
+	}
+
+	void TrainWorker::loop() {
+		if (SDL_SemWaitTimeout(start, TRAIN_WAIT_MS) == SDL_MUTEX_TIMEDOUT)
+			return;
+
+		for (size_t i = 0 ; i < weight_grads.size() ; ++i) {
+			std::fill(weight_grads[i].begin(), weight_grads[i].end(), 0.f);
+			std::fill(bias_grads[i].begin(), bias_grads[i].end(), 0.f);
+		}
+		loss = 0;
+		correct = 0;
+		for (size_t i = first ; i < last ; ++i)
+			process(trainer->m_order[trainer->m_batch_first + i]);
+
+		SDL_SemPost(done);
+	}
+
+	void TrainWorker::process(size_t sample) {
+		const Trainer &t = *trainer;
+		const Set &set = t.m_set;
+		const std::vector<NN::Layer> &layers = t.m_layers;
+		const int plane_size = set.h * set.w;
+		const float *src = set.getInput(sample);
+		float *x = m_acts[0].data();
+
+		if (t.m_settings.augment) {
+			// Nearest pixel of the shifted (and possibly mirrored) image,
+			// scaled by the gain
+			std::uniform_int_distribution<int> shift_x(-TRAIN_SHIFT_X, TRAIN_SHIFT_X), shift_y(-TRAIN_SHIFT_Y, TRAIN_SHIFT_Y);
+			std::uniform_real_distribution<float> gain_dist(1.f - TRAIN_BRIGHTNESS, 1.f + TRAIN_BRIGHTNESS);
+			int dx = shift_x(m_rng), dy = shift_y(m_rng);
+			bool flip = m_rng() & 1;
+			float gain = gain_dist(m_rng);
+			for (int c = 0 ; c < set.c ; ++c) {
+				for (int y = 0 ; y < set.h ; ++y) {
+					int sy = std::min(std::max(y + dy, 0), set.h - 1);
+					for (int px = 0 ; px < set.w ; ++px) {
+						int sx = std::min(std::max(px + dx, 0), set.w - 1);
+						if (flip)
+							sx = set.w - 1 - sx;
+						*x++ = std::min(src[(c * set.h + sy) * set.w + sx] * gain, 1.f);
+					}
+				}
+			}
+			x = m_acts[0].data();
+		} else {
+			std::copy(src, src + set.getInputSize(), x);
+		}
+		for (int c = 0 ; c < set.c ; ++c) {
+			const float mean = t.m_mean[c], inv_stdv = 1.f / t.m_stdv[c];
+			for (int i = 0 ; i < plane_size ; ++i, ++x)
+				*x = (*x - mean) * inv_stdv;
+		}
+
+		// Forward pass, keeping the output of each layer
+		int c = set.c, h = set.h, w = set.w;
+		for (size_t i = 0 ; i < layers.size() ; ++i) {
+			const NN::Layer &layer = layers[i];
+			const float *in = m_acts[i].data();
+			float *out = m_acts[i + 1].data();
+			const int in_size = c * h * w;
+			switch (layer.type) {
+			case NN::LAYER_CONV:
+				NN::Kernel::conv(in, c, h, w, layer, out);
+				break;
+			case NN::LAYER_RELU:
+				std::copy(in, in + in_size, out);
+				NN::Kernel::relu(out, in_size);
+				break;
+			case NN::LAYER_MAXPOOL:
+				NN::Kernel::maxpool(in, h, w, layer, out);
+				break;
+			case NN::LAYER_VIEW:
+				std::copy(in, in + in_size, out);
+				break;
+			case NN::LAYER_LINEAR:
+				NN::Kernel::linear(in, in_size, 1, layer, out);
+				break;
+			case NN::LAYER_LOGSOFTMAX:
+				NN::Kernel::softmax(in, in_size, out);
+				break;
+			}
+			c = layer.c; h = layer.h; w = layer.w;
+		}
+
+		// Negative log-likelihood. Through the LogSoftMax, its gradient is
+		// the probabilities minus the one-hot label.
+		const int label = set.labels[sample];
+		const int n_out = layers.back().c;
+		const float *probs = m_acts.back().data();
+		loss -= std::log(std::max(probs[label], 1e-30f));
+		if (std::max_element(probs, probs + n_out) - probs == label)
+			correct++;
+		float *g = m_grad_a.data(), *g_in = m_grad_b.data();
+		for (int k = 0 ; k < n_out ; ++k)
+			g[k] = probs[k] - (k == label ? 1.f : 0.f);
+
+		// Backward pass, from the layer before the LogSoftMax. The gradient
+		// of the input of the first layer is not needed.
+		for (size_t i = layers.size() - 1 ; i-- > 0 ; ) {
+			const NN::Layer &layer = layers[i];
+			const int in_c = (i > 0) ? layers[i - 1].c : set.c;
+			const int in_h = (i > 0) ? layers[i - 1].h : set.h;
+			const int in_w = (i > 0) ? layers[i - 1].w : set.w;
+			const int in_size = in_c * in_h * in_w;
+			const float *in = m_acts[i].data(), *out = m_acts[i + 1].data();
+			const bool need_input_grad = (i > 0);
+
+			switch (layer.type) {
+			case NN::LAYER_CONV: {
+				float *dw = weight_grads[i].data();
+				const float *weight = layer.weight.data();
+				if (need_input_grad)
+					std::fill(g_in, g_in + in_size, 0.f);
+				for (int o = 0 ; o < layer.c ; ++o) {
+					const float *g_plane = g + o * layer.h * layer.w;
+					bias_grads[i][o] += std::accumulate(g_plane, g_plane + layer.h * layer.w, 0.f);
+					for (int ci = 0 ; ci < in_c ; ++ci) {
+						for (int ky = 0 ; ky < layer.kh ; ++ky) {
+							for (int kx = 0 ; kx < layer.kw ; ++kx) {
+								const float k = *weight++;
+								float acc = 0.f;
+								for (int y = 0 ; y < layer.h ; ++y) {
+									const int offset = (ci * in_h + y + ky) * in_w + kx;
+									acc += NN::Kernel::dot(g_plane + y * layer.w, in + offset, layer.w);
+									if (need_input_grad)
+										NN::Kernel::axpy(g_in + offset, g_plane + y * layer.w, k, layer.w);
+								}
+								*dw++ += acc;
+							}
+						}
+					}
+				}
+				break;
+			}
+			case NN::LAYER_RELU:
+				for (int k = 0 ; k < in_size ; ++k)
+					g_in[k] = (out[k] > 0.f) ? g[k] : 0.f;
+				break;
+			case NN::LAYER_MAXPOOL:
+				// The gradient goes to the first maximum of each window,
+				// as chosen by Kernel::maxpool
+				std::fill(g_in, g_in + in_size, 0.f);
+				for (int ci = 0 ; ci < layer.c ; ++ci) {
+					const float *in_plane = in + ci * in_h * in_w;
+					for (int y = 0 ; y < layer.h ; ++y) {
+						for (int px = 0 ; px < layer.w ; ++px) {
+							int best = y * layer.dh * in_w + px * layer.dw;
+							for (int ky = 0 ; ky < layer.kh ; ++ky) {
+								for (int kx = 0 ; kx < layer.kw ; ++kx) {
+									int pos = (y * layer.dh + ky) * in_w + px * layer.dw + kx;
+									if (in_plane[pos] > in_plane[best])
+										best = pos;
+								}
+							}
+							g_in[ci * in_h * in_w + best] += g[(ci * layer.h + y) * layer.w + px];
+						}
+					}
+				}
+				break;
+			case NN::LAYER_VIEW:
+				std::copy(g, g + in_size, g_in);
+				break;
+			case NN::LAYER_LINEAR: {
+				float *dw = weight_grads[i].data();
+				const float *weight = layer.weight.data();
+				if (need_input_grad)
+					std::fill(g_in, g_in + in_size, 0.f);
+				for (int o = 0 ; o < layer.c ; ++o, dw += in_size, weight += in_size) {
+					bias_grads[i][o] += g[o];
+					NN::Kernel::axpy(dw, in, g[o], in_size);
+					if (need_input_grad)
+						NN::Kernel::axpy(g_in, weight, g[o], in_size);
+				}
+				break;
+			}
+			case NN::LAYER_LOGSOFTMAX:
+				throw NN::NNException("LogSoftMax must be the last layer");
+			}
+			std::swap(g, g_in);
+		}
+	}
+
+	Trainer::Trainer(const Settings &settings, const Set &set, const std::vector<std::string> &categories) :
+			m_settings(settings), m_set(set), m_categories(categories), m_rng(settings.seed) {
+		if (set.size() == 0)
+			throw NN::NNException("no training image");
+
+		// Normalization of each channel, as train.lua does
+		const int plane_size = set.h * set.w;
+		for (int c = 0 ; c < set.c ; ++c) {
+			double sum = 0, sum_sq = 0;
+			for (size_t i = 0 ; i < set.size() ; ++i) {
+				const float *plane = set.getInput(i) + c * plane_size;
+				for (int k = 0 ; k < plane_size ; ++k) {
+					sum += plane[k];
+					sum_sq += plane[k] * (double) plane[k];
+				}
+			}
+			double n = (double) set.size() * plane_size;
+			double mean = sum / n;
+			double var = (n > 1) ? (sum_sq - n * mean * mean) / (n - 1) : 0;
+			m_mean.push_back(mean);
+			m_stdv.push_back(var > 0 ? std::sqrt(var) : 1.0);
+		}
+
+		// Weights are initialized as Torch does, uniformly in
+		// [-1/sqrt(fan_in), 1/sqrt(fan_in)]
+		m_layers = buildLayers(set.c, set.h, set.w, categories.size());
+		int c = set.c, h = set.h, w = set.w;
+		for (auto it = m_layers.begin() ; it != m_layers.end() ; ++it) {
+			int fan_in = 0;
+			if (it->type == NN::LAYER_CONV)
+				fan_in = c * it->kh * it->kw;
+			else if (it->type == NN::LAYER_LINEAR)
+				fan_in = c * h * w;
+			if (fan_in > 0) {
+				std::uniform_real_distribution<float> init(-1.f / std::sqrt((float) fan_in), 1.f / std::sqrt((float) fan_in));
+				it->weight.resize(it->c * fan_in);
+				it->bias.resize(it->c);
+				for (auto v = it->weight.begin() ; v != it->weight.end() ; ++v)
+					*v = init(m_rng);
+				for (auto v = it->bias.begin() ; v != it->bias.end() ; ++v)
+					*v = init(m_rng);
+			}
+			m_weight_vel.push_back(std::vector<float>(it->weight.size()));
+			m_bias_vel.push_back(std::vector<float>(it->bias.size()));
+			c = it->c; h = it->h; w = it->w;
+		}
+
+		m_order.resize(set.size());
+		std::iota(m_order.begin(), m_order.end(), 0);
+
+		for (unsigned int i = 0 ; i < settings.workers ; ++i) {
+			m_workers.emplace_back(new TrainWorker());
+			m_workers.back()->trainer = this;
+			m_workers.back()->index = i;
+			m_workers.back()->launch("TrainWorker");
+		}
+	}
+
+	Trainer::~Trainer() {
+		m_workers.clear();
+	}
+
+	double Trainer::runEpoch() {
+		std::shuffle(m_order.begin(), m_order.end(), m_rng);
+
+		double loss = 0;
+		unsigned long correct = 0;
+		for (size_t first = 0 ; first < m_order.size() ; first += m_settings.batch) {
+			runBatch(first, std::min((size_t) m_settings.batch, m_order.size() - first));
+			for (auto it = m_workers.begin() ; it != m_workers.end() ; ++it) {
+				loss += (*it)->loss;
+				correct += (*it)->correct;
+			}
+		}
+
+		m_accuracy = correct / (double) m_order.size();
+		return loss / m_order.size();
+	}
+
+	void Trainer::runBatch(size_t first, size_t n) {
+		m_batch_first = first;
+		const size_t per_worker = (n + m_workers.size() - 1) / m_workers.size();
+		for (size_t i = 0 ; i < m_workers.size() ; ++i) {
+			m_workers[i]->first = std::min(i * per_worker, n);
+			m_workers[i]->last = std::min((i + 1) * per_worker, n);
+			SDL_SemPost(m_workers[i]->start);
+		}
+		for (auto it = m_workers.begin() ; it != m_workers.end() ; ++it) {
+			while (SDL_SemWaitTimeout((*it)->done, TRAIN_WAIT_MS) == SDL_MUTEX_TIMEDOUT)
+				(*it)->checkDeath();
+		}
+
+		// Momentum SGD on the mean gradient of the minibatch
+		const float rate = m_settings.learning_rate / n, momentum = m_settings.momentum;
+		for (size_t l = 0 ; l < m_layers.size() ; ++l) {
+			std::vector<float> &weight = m_layers[l].weight, &bias = m_layers[l].bias;
+			for (size_t k = 0 ; k < weight.size() ; ++k) {
+				float g = 0.f;
+				for (auto it = m_workers.begin() ; it != m_workers.end() ; ++it)
+					g += (*it)->weight_grads[l][k];
+				m_weight_vel[l][k] = momentum * m_weight_vel[l][k] - rate * g;
+				weight[k] += m_weight_vel[l][k];
+			}
+			for (size_t k = 0 ; k < bias.size() ; ++k) {
+				float g = 0.f;
+				for (auto it = m_workers.begin() ; it != m_workers.end() ; ++it)
+					g += (*it)->bias_grads[l][k];
+				m_bias_vel[l][k] = momentum * m_bias_vel[l][k] - rate * g;
+				bias[k] += m_bias_vel[l][k];
+			}
+		}
+	}
+
+	void Trainer::getNetwork(NN::Network &net) const {
+		net.create(m_categories, m_set.c, m_set.h, m_set.w, m_mean, m_stdv, m_layers);
+	}
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <SDL_mutex.h>
+
+#include "nn.hh"
+#include "util.hh"
+
+// Maximal number of training threads
+#define TRAIN_MAX_WORKERS 64
+
+// Native training of the network of torchnn/train.lua: minibatch SGD with
+// momentum, the minibatches being split between worker threads which
+// compute the gradients of their samples in parallel. Samples are augmented
+// on the fly (horizontal flip, brightness jitter and shifts of a few pixels).
+namespace Train {
+	struct Settings {
+		unsigned int epochs = 40;
+		unsigned int batch = 32;
+		double learning_rate = 0.01;
+		double momentum = 0.9;
+		bool augment = true;
+		unsigned int workers = 1;
+		unsigned int seed = 1;
+	};
+
+	// Settings given by TRAIN_EPOCHS, TRAIN_BATCH, TRAIN_LEARNING_RATE,
+	// TRAIN_MOMENTUM, TRAIN_AUGMENT, TRAIN_WORKERS (default: the number of
+	// cores) and TRAIN_SEED
+	Settings getConfSettings();
+
+	// Images as planar RGB values in [0, 1] (see Image::imageToInput), and
+	// their category
+	struct Set {
+		int c = 3, h = 0, w = 0;
+		std::vector<float> inputs;
+		std::vector<int> labels;
+		// Description of each image, for the reports
+		std::vector<std::string> names;
+
+		size_t size() const { return labels.size(); }
+		int getInputSize() const { return c * h * w; }
+		const float* getInput(size_t i) const { return inputs.data() + i * getInputSize(); }
+	};
+
+	class Trainer;
+
+	// Computes the gradients of a part of the minibatch
+	class TrainWorker : public Thread::ThreadBase {
+	public:
+		virtual void onStart() {}
+		virtual void onEnd() {}
+		virtual void loop();
+		virtual void construct();
+		~TrainWorker();
+
+		Trainer *trainer;
+		unsigned int index;
+		// Samples [first, last) of the minibatch
+		size_t first = 0, last = 0;
+		SDL_sem *start = NULL;
+		SDL_sem *done = NULL;
+
+		// Gradients of the weights and biases of each layer
+		std::vector<std::vector<float>> weight_grads, bias_grads;
+		double loss = 0;
+		unsigned int correct = 0;
+
+	private:
+		void process(size_t sample);
+
+		std::mt19937 m_rng;
+		// Input and outputs of each layer, and gradients of the outputs
+		std::vector<std::vector<float>> m_acts;
+		std::vector<float> m_grad_a, m_grad_b;
+	};
+
+	class Trainer {
+	public:
+		// categories: names of the labels of set, which must outlive the
+		// trainer. The normalization is computed on set.
+		Trainer(const Settings &settings, const Set &set, const std::vector<std::string> &categories);
+		~Trainer();
+
+		// Returns the mean loss (negative log-likelihood) over the epoch
+		double runEpoch();
+		// Accuracy of the last epoch on the augmented samples
+		double getAccuracy() const { return m_accuracy; }
+		void getNetwork(NN::Network &net) const;
+
+	private:
+		friend class TrainWorker;
+		void runBatch(size_t first, size_t n);
+
+		Settings m_settings;
+		const Set &m_set;
+		std::vector<std::string> m_categories;
+		std::vector<float> m_mean, m_stdv;
+		std::vector<NN::Layer> m_layers;
+		// Momentum of the weights and biases
+		std::vector<std::vector<float>> m_weight_vel, m_bias_vel;
+
+		std::mt19937 m_rng;
+		std::vector<size_t> m_order;
+		// Samples of the running minibatch, in m_order
+		size_t m_batch_first = 0;
+		double m_accuracy = 0;
+
+		std::vector<std::unique_ptr<TrainWorker>> m_workers;
+	};
+}
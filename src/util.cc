@@ -1,4 +1,5 @@
 #include <cstdlib>
+#include <string>
 #include <SDL_thread.h>
 #include <SDL_mutex.h>
 #include <SDL_timer.h>
@@ -50,41 +51,80 @@ namespace Conf {
 			return defau;
 		}
 	}
+
+	std::string getString(const char *name) {
+		char *value = getenv(name);
+		if (value == NULL || *value == '\0')
+			throw ConfException(name);
+		return value;
+	}
+
+	std::string getString(const char *name, std::string defau) {
+		try {
+			return getString(name);
+		} catch (ConfException &ex) {
+			return defau;
+		}
+	}
 }
 
 namespace Thread {
-	ConsumerTracker::ConsumerTracker(int n) : n_consumers(n) {
-		mutex = SDL_CreateMutex();
-		newval_table = new bool[n_consumers];
-		for (int i = 0 ; i < n_consumers ; ++i)
-			newval_table[i] = false;
+	SequenceCounter::SequenceCounter() : m_seq(0), m_waiters(0) {
+		m_mutex = SDL_CreateMutex();
+		m_cond = SDL_CreateCond();
 	}
 
-	ConsumerTracker::~ConsumerTracker() {
-		delete[] newval_table;
-		SDL_DestroyMutex(mutex);
-		mutex = NULL;
+	SequenceCounter::~SequenceCounter() {
+		SDL_DestroyCond(m_cond);
+		SDL_DestroyMutex(m_mutex);
 	}
 
-	bool ConsumerTracker::getSingle(int src_id) {
-		bool v;
-		SDL_LockMutex(mutex);
-		v = newval_table[src_id];
-		SDL_UnlockMutex(mutex);
-		return v;
+	void SequenceCounter::publish(unsigned long seq) {
+		m_seq.store(seq);
+		// Both m_seq and m_waiters use sequentially consistent accesses:
+		// either the waiter sees the new number, or we see the waiter.
+		if (m_waiters.load() > 0) {
+			SDL_LockMutex(m_mutex);
+			SDL_CondBroadcast(m_cond);
+			SDL_UnlockMutex(m_mutex);
+		}
+	}
+
+	unsigned long SequenceCounter::get() const {
+		return m_seq.load(std::memory_order_acquire);
 	}
 
-	void ConsumerTracker::setSingleFalse(int src_id) {
-		SDL_LockMutex(mutex);
-		newval_table[src_id] = false;
-		SDL_UnlockMutex(mutex);
+	unsigned long SequenceCounter::wait(unsigned long last_seen) {
+		unsigned long seq = get();
+		if (seq > last_seen)
+			return seq;
+
+		SDL_LockMutex(m_mutex);
+		m_waiters++;
+		while ((seq = m_seq.load()) <= last_seen)
+			SDL_CondWait(m_cond, m_mutex);
+		m_waiters--;
+		SDL_UnlockMutex(m_mutex);
+		return seq;
 	}
 
-	void ConsumerTracker::setAllTrue() {
-		SDL_LockMutex(mutex);
-		for (int i = 0 ; i < n_consumers ; ++i)
-			newval_table[i] = true;
-		SDL_UnlockMutex(mutex);
+	unsigned long SequenceCounter::wait(unsigned long last_seen, unsigned int timeout_ms) {
+		unsigned long seq = get();
+		if (seq > last_seen)
+			return seq;
+
+		unsigned int start_ticks = Time::getTicks();
+		SDL_LockMutex(m_mutex);
+		m_waiters++;
+		while ((seq = m_seq.load()) <= last_seen) {
+			unsigned int elapsed = Time::getTicks() - start_ticks;
+			if (elapsed >= timeout_ms)
+				break;
+			SDL_CondWaitTimeout(m_cond, m_mutex, timeout_ms - elapsed);
+		}
+		m_waiters--;
+		SDL_UnlockMutex(m_mutex);
+		return seq;
 	}
 
 	void ThreadBase::destruct() {
@@ -93,6 +133,7 @@ namespace Thread {
 
 		if (SDL_SemValue(m_end_sem) == 0) {
 			SDL_SemPost(m_kill_sem);
+			wake();
 			SDL_SemWait(m_end_sem);
 		}
 
@@ -168,6 +209,13 @@ namespace Time {
 		return SDL_GetTicks();
 	}
 
+	uint64_t getMicros() {
+		// Split the computation to avoid overflowing with nanosecond counters
+		uint64_t counter = SDL_GetPerformanceCounter();
+		uint64_t freq = SDL_GetPerformanceFrequency();
+		return counter / freq * 1000000 + counter % freq * 1000000 / freq;
+	}
+
 	void delay(unsigned int ms) {
 		SDL_Delay(ms);
 	}
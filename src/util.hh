@@ -2,6 +2,9 @@
 
 #include <exception>
 #include <cstring>
+#include <cstdint>
+#include <string>
+#include <atomic>
 #include <SDL_thread.h>
 #include <SDL_mutex.h>
 
@@ -21,21 +24,103 @@ namespace Conf {
 	long getInt(const char* name, long defau);
 	double getDouble(const char* name);
 	double getDouble(const char* name, double defau);
+	std::string getString(const char* name);
+	std::string getString(const char* name, std::string defau);
 }
 
 namespace Thread {
-	class ConsumerTracker {
+	// Sequence number of the last value published by a producer. Each
+	// consumer keeps the last sequence number it has seen: checking for a
+	// new value is wait-free, and wait() can't miss a publication.
+	// Consumers may read a value before its number is published, so a
+	// value is new only if its number is greater than the last seen one.
+	class SequenceCounter {
 	public:
-		ConsumerTracker(int n);
-		~ConsumerTracker();
-		bool getSingle(int src_id);
-		void setSingleFalse(int src_id);
-		void setAllTrue();
+		SequenceCounter();
+		~SequenceCounter();
+		// seq must be greater than all previously published numbers.
+		void publish(unsigned long seq);
+		unsigned long get() const;
+		bool isNewer(unsigned long last_seen) const { return get() > last_seen; }
+		// Blocks until a number greater than last_seen is published and
+		// returns it.
+		unsigned long wait(unsigned long last_seen);
+		// Same as above, but returns after at most timeout_ms: the result
+		// is not greater than last_seen if nothing was published.
+		unsigned long wait(unsigned long last_seen, unsigned int timeout_ms);
 
 	private:
-		int n_consumers;
-		SDL_mutex *mutex;
-		bool *newval_table;
+		std::atomic<unsigned long> m_seq;
+		// The producer only takes the mutex when a consumer is waiting
+		std::atomic<int> m_waiters;
+		SDL_mutex *m_mutex;
+		SDL_cond *m_cond;
+	};
+
+	// Bounded single-producer single-consumer queue of preallocated items,
+	// filled and read in place. The semaphores count the free and filled
+	// slots and order the accesses to them; each index is only used by one
+	// side.
+	template<typename T>
+	class SPSCQueue {
+	public:
+		SPSCQueue(unsigned int capacity) : m_capacity(capacity) {
+			m_items = new T[capacity];
+			m_free = SDL_CreateSemaphore(capacity);
+			m_filled = SDL_CreateSemaphore(0);
+		}
+
+		~SPSCQueue() {
+			SDL_DestroySemaphore(m_free);
+			SDL_DestroySemaphore(m_filled);
+			delete[] m_items;
+		}
+
+		SPSCQueue(const SPSCQueue&) = delete;
+		SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+		// Producer side: waits at most timeout_ms for a free item and
+		// returns it, or NULL. endPush() makes it available to the consumer.
+		T* beginPush(unsigned int timeout_ms) {
+			if (SDL_SemWaitTimeout(m_free, timeout_ms) != 0)
+				return NULL;
+			return &m_items[m_tail];
+		}
+
+		void endPush() {
+			m_tail = (m_tail + 1) % m_capacity;
+			SDL_SemPost(m_filled);
+		}
+
+		// Gives back the item returned by beginPush() without publishing it
+		void cancelPush() {
+			SDL_SemPost(m_free);
+		}
+
+		// Consumer side: waits at most timeout_ms for an item and returns
+		// it, or NULL. endPop() gives it back to the producer.
+		T* beginPop(unsigned int timeout_ms) {
+			if (SDL_SemWaitTimeout(m_filled, timeout_ms) != 0)
+				return NULL;
+			return &m_items[m_head];
+		}
+
+		void endPop() {
+			m_head = (m_head + 1) % m_capacity;
+			SDL_SemPost(m_free);
+		}
+
+		// Number of items waiting for the consumer
+		unsigned int getDepth() const { return SDL_SemValue(m_filled); }
+		unsigned int getCapacity() const { return m_capacity; }
+
+	private:
+		unsigned int m_capacity;
+		T *m_items;
+		unsigned int m_head = 0;
+		unsigned int m_tail = 0;
+		SDL_sem *m_free;
+		SDL_sem *m_filled;
 	};
 
 	class ThreadBase {
@@ -44,6 +129,9 @@ namespace Thread {
 		virtual void onEnd() = 0;
 		virtual void loop() = 0;
 		virtual void construct() {}
+		// Called by destruct() once the thread is asked to stop, to wake
+		// a loop() which waits on something else than the thread itself.
+		virtual void wake() {}
 
 		// The inherited class in responsible for calling this function
 		// in its destructor.
@@ -68,5 +156,7 @@ namespace Thread {
 
 namespace Time {
 	unsigned int getTicks();
+	// High resolution counter, for profiling
+	uint64_t getMicros();
 	void delay(unsigned int ms);
 }
@@ -0,0 +1,59 @@
+-- Exports a network trained by train.lua to the text format read by the
+-- native inference engine of VESPID (src/nn.cc).
+-- Usage: luajit export.lua [nnhornet.t7 [nnhornet.net]]
+require("torch")
+require("nn")
+
+local IMAGE_HEIGHT = 16
+local IMAGE_WIDTH = 32
+
+local src, dst = ...
+src = src or "nnhornet.t7"
+dst = dst or "nnhornet.net"
+
+local categories, norm, net = unpack(torch.load(src))
+net = net:double()
+
+local f = assert(io.open(dst, "w"))
+
+local function writeValues(tensor)
+	local values = tensor:contiguous():view(-1)
+	for i = 1, values:size(1) do
+		f:write(string.format("%.9g\n", values[i]))
+	end
+end
+
+f:write("vespid-nn 1\n")
+f:write("categories ", #categories, " ", table.concat(categories, " "), "\n")
+f:write(string.format("input 3 %d %d\n", IMAGE_HEIGHT, IMAGE_WIDTH))
+f:write(string.format("mean %.9g %.9g %.9g\n", norm.mean[1], norm.mean[2], norm.mean[3]))
+f:write(string.format("stdv %.9g %.9g %.9g\n", norm.stdv[1], norm.stdv[2], norm.stdv[3]))
+f:write("layers ", #net.modules, "\n")
+
+for _, module in ipairs(net.modules) do
+	local t = torch.type(module)
+	if t == "nn.SpatialConvolution" then
+		assert(module.dW == 1 and module.dH == 1 and (module.padW or 0) == 0 and (module.padH or 0) == 0,
+			"Only unpadded convolutions with stride 1 are supported")
+		f:write(string.format("conv %d %d %d %d\n", module.nInputPlane, module.nOutputPlane, module.kH, module.kW))
+		writeValues(module.weight)
+		writeValues(module.bias)
+	elseif t == "nn.ReLU" then
+		f:write("relu\n")
+	elseif t == "nn.SpatialMaxPooling" then
+		f:write(string.format("maxpool %d %d %d %d\n", module.kH, module.kW, module.dH, module.dW))
+	elseif t == "nn.View" then
+		f:write("view\n")
+	elseif t == "nn.Linear" then
+		f:write(string.format("linear %d %d\n", module.weight:size(2), module.weight:size(1)))
+		writeValues(module.weight)
+		writeValues(module.bias)
+	elseif t == "nn.LogSoftMax" then
+		f:write("logsoftmax\n")
+	else
+		error("Unsupported module " .. t)
+	end
+end
+
+f:close()
+print("Exported " .. src .. " to " .. dst .. ".")
@@ -0,0 +1,95 @@
+-- Reads the packs written by vespid-pack and the capture mode (see
+-- src/pack.hh for the format). Requires LuaJIT.
+local ffi = require("ffi")
+require("torch")
+
+ffi.cdef[[
+typedef struct {
+	char magic[8];
+	uint32_t version, header_size, record_size;
+	uint16_t height, width, channels, n_categories;
+	char categories[8][16];
+	uint32_t reserved;
+} vespid_pack_header;
+
+typedef struct {
+	uint8_t pixels[1536];
+	uint64_t timestamp_us;
+	uint32_t seq, number;
+	uint8_t category, source, reserved[6];
+} vespid_pack_record;
+
+typedef struct {
+	uint32_t counts[8];
+	uint64_t n_records;
+	char magic[8];
+} vespid_pack_trailer;
+]]
+
+local header_size = ffi.sizeof("vespid_pack_header")
+local record_size = ffi.sizeof("vespid_pack_record")
+local trailer_size = ffi.sizeof("vespid_pack_trailer")
+
+local pack = {}
+
+function pack.isPack(path)
+	local f = io.open(path, "rb")
+	if not f then
+		return false
+	end
+	local magic = f:read(8)
+	f:close()
+	return magic == "VSPDPACK"
+end
+
+-- Returns {data = n x 3 x height x width RGB tensor in [0, 1] (as
+-- image.load), label = labels numbered from 1, categories = category names,
+-- names = "category/number" of each record}. The file is read at once.
+function pack.load(path)
+	local f = assert(io.open(path, "rb"))
+	local content = f:read("*a")
+	f:close()
+
+	local base = ffi.cast("const uint8_t*", content)
+	local header = ffi.cast("const vespid_pack_header*", base)
+	assert(#content >= header_size and ffi.string(header.magic, 8) == "VSPDPACK", path .. " is not a pack")
+	assert(header.version == 1 and header.header_size == header_size and header.record_size == record_size
+		and header.channels == 3, "unexpected record format in " .. path)
+	local height, width = header.height, header.width
+
+	local categories = {}
+	for i = 0, header.n_categories - 1 do
+		table.insert(categories, ffi.string(header.categories[i]))
+	end
+
+	-- Without a valid footer (the pack was not closed), all the complete
+	-- records are read
+	local n = math.floor((#content - header_size) / record_size)
+	if #content >= header_size + trailer_size then
+		local trailer = ffi.cast("const vespid_pack_trailer*", base + #content - trailer_size)
+		local n_records = tonumber(trailer.n_records)
+		if ffi.string(trailer.magic, 8) == "VSPDINDX"
+				and header_size + n_records * (record_size + 4) + trailer_size == #content then
+			n = n_records
+		end
+	end
+
+	assert(n > 0, "no record in " .. path)
+
+	local records = ffi.cast("const vespid_pack_record*", base + header_size)
+	local bytes = torch.ByteTensor(n, height, width, 3)
+	local label = torch.Tensor(n)
+	local names = {}
+	local dst = torch.data(bytes)
+	for i = 0, n - 1 do
+		ffi.copy(dst + i * height * width * 3, records[i].pixels, height * width * 3)
+		label[i + 1] = records[i].category + 1
+		names[i + 1] = categories[records[i].category + 1] .. "/" .. records[i].number
+	end
+
+	-- BGR pixels to RGB planes
+	local data = bytes:permute(1, 4, 2, 3):index(2, torch.LongTensor{3, 2, 1}):double():div(255)
+	return {data = data, label = label, categories = categories, names = names}
+end
+
+return pack
@@ -1,32 +1,47 @@
 require("torch")
 require("nn")
-require("image")
+local ffi = require("ffi")
 
-local filename = ...
-if not filename then
-	print("Filename expected.")
+-- Must match Image::nnResult in src/classifier.hh
+ffi.cdef[[
+typedef struct {
+	double empty_prob;
+	double asian_prob;
+	double european_prob;
+} nnResult;
+]]
+
+local input_ptr, results_ptr, max_batch, height, width = ...
+if not input_ptr or not results_ptr then
+	print("Input and result buffers expected.")
 	return 1
 end
 
 local categories, norm, net = unpack(torch.load("/usr/local/share/vespid/nnhornet.t7"))
 
--- First yield
-coroutine.yield()
+-- The input tensor wraps the buffer filled by VESPID (batch of planar RGB
+-- images, values between 0 and 1), so images are never copied nor written
+-- to disk.
+local address = tonumber(ffi.cast("intptr_t", input_ptr))
+local inputs = torch.DoubleTensor(torch.DoubleStorage(max_batch * 3 * height * width, address), 1,
+	torch.LongStorage({max_batch, 3, height, width}))
+local results = ffi.cast("nnResult*", results_ptr)
+
+-- First yield, VESPID resumes the coroutine with the batch size.
+local n = coroutine.yield()
 
 while true do
-	local imgdata = image.load(filename, 3, "double")
+	local input = inputs:narrow(1, 1, n)
 	for i = 1, 3 do
-		imgdata[{{i}, {}, {}}]:add(-norm.mean[i])
-		imgdata[{{i}, {}, {}}]:div(norm.stdv[i])
+		input:select(2, i):add(-norm.mean[i])
+		input:select(2, i):div(norm.stdv[i])
 	end
 
-	local results = net:forward(imgdata)
-	local confidences, indices = torch.sort(results, true)
-	local exp_confidences = torch.exp(confidences)
-
-	local t = {}
-	for i = 1, indices:size(1) do
-		t[categories[indices[i]]] = exp_confidences[i]
+	local output = net:forward(input):view(n, -1)
+	for j = 1, n do
+		for i = 1, output:size(2) do
+			results[j - 1][categories[i] .. "_prob"] = math.exp(output[j][i])
+		end
 	end
-	coroutine.yield(t)
+	n = coroutine.yield()
 end
@@ -4,6 +4,8 @@ require("nn")
 require("image")
 require("paths")
 
+local pack = dofile(paths.concat(paths.dirname(paths.thisfile()), "pack.lua"))
+
 local IMAGE_HEIGHT = 16
 local IMAGE_WIDTH = 32
 
@@ -11,25 +13,31 @@ print("Building datasets...")
 
 local categories = {}
 
--- Store filenames
-local images = {}
-for category in paths.files("dataset/train") do
-	if category ~= "." and category ~= ".." then
-		table.insert(categories, category)
-		for img in paths.files("dataset/train/"..category) do
-			if img ~= "." and img ~= ".." then
-				table.insert(images, {path = "dataset/train/"..category.."/"..img, label = #categories})
+-- Packed datasets (see vespid-pack) are used when they exist
+local trainset
+if pack.isPack("dataset/train.vpk") then
+	local train_pack = pack.load("dataset/train.vpk")
+	categories = train_pack.categories
+	trainset = {data = train_pack.data, label = train_pack.label}
+else
+	-- Store filenames
+	local images = {}
+	for category in paths.files("dataset/train") do
+		if category ~= "." and category ~= ".." then
+			table.insert(categories, category)
+			for img in paths.files("dataset/train/"..category) do
+				if img ~= "." and img ~= ".." then
+					table.insert(images, {path = "dataset/train/"..category.."/"..img, label = #categories})
+				end
 			end
 		end
 	end
-end
 
-local trainset = {data = torch.Tensor(#images, 3, IMAGE_HEIGHT, IMAGE_WIDTH), label = torch.Tensor(#images)}
-local n_trainset = {}
-for i, img in ipairs(images) do
-	trainset.data[i] = image.load(img.path, 3, "double")
-	trainset.label[i] = img.label
-	n_trainset[categories[img.label]] = (n_trainset[categories[img.label]] or 0) + 1
+	trainset = {data = torch.Tensor(#images, 3, IMAGE_HEIGHT, IMAGE_WIDTH), label = torch.Tensor(#images)}
+	for i, img in ipairs(images) do
+		trainset.data[i] = image.load(img.path, 3, "double")
+		trainset.label[i] = img.label
+	end
 end
 
 setmetatable(trainset,
@@ -56,19 +64,33 @@ end
 
 -- Build the test dataset
 local test_images = {}
-for cat_i, category in ipairs(categories) do
-	for img in paths.files("dataset/test/"..category) do
-		if img ~= "." and img ~= ".." then
-			table.insert(test_images, {path = "dataset/test/"..category.."/"..img, label = cat_i})
+local testset
+if pack.isPack("dataset/test.vpk") then
+	local test_pack = pack.load("dataset/test.vpk")
+	-- The labels follow the order of the training categories
+	local cat_i = {}
+	for i, category in ipairs(categories) do
+		cat_i[category] = i
+	end
+	testset = {data = test_pack.data, label = {}}
+	for i = 1, test_pack.data:size(1) do
+		local category = test_pack.categories[test_pack.label[i]]
+		testset.label[i] = assert(cat_i[category], "unknown category " .. category .. " in dataset/test.vpk")
+		test_images[i] = {path = "dataset/test.vpk:" .. test_pack.names[i]}
+	end
+else
+	for cat_i, category in ipairs(categories) do
+		for img in paths.files("dataset/test/"..category) do
+			if img ~= "." and img ~= ".." then
+				table.insert(test_images, {path = "dataset/test/"..category.."/"..img, label = cat_i})
+			end
 		end
 	end
-end
-local testset = {data = torch.Tensor(#test_images, 3, IMAGE_HEIGHT, IMAGE_WIDTH), label = {}}
-local n_testset = {}
-for i, img in ipairs(test_images) do
-	testset.data[i] = image.load(img.path, 3, "double")
-	testset.label[i] = img.label
-	n_testset[categories[img.label]] = (n_testset[categories[img.label]] or 0) + 1
+	testset = {data = torch.Tensor(#test_images, 3, IMAGE_HEIGHT, IMAGE_WIDTH), label = {}}
+	for i, img in ipairs(test_images) do
+		testset.data[i] = image.load(img.path, 3, "double")
+		testset.label[i] = img.label
+	end
 end
 
 -- Normalization